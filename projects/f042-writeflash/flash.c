@@ -17,11 +17,22 @@
  * I would recommend calling these with IRQs and any other possible
  * interruptions disabled, so as not to interrupt the operations,
  * as flash access during them can generate HardFaults.
+ *
+ * On the F0, a fetch from flash while it is being erased or programmed
+ * stalls until the operation is done: the code in between runs from
+ * RAM (FLASH_RAMFUNC). A page erase is waited for with the system
+ * locked: interrupts could not be serviced during it anyway, as their
+ * vectors and handlers are in flash, and the flash stays in the hands
+ * of the one caller from unlock to lock.
  */
 
 #include "ch.h"
 #include "hal.h"
 
+#include "flash.h"
+
+#define FLASH_SR_FLAGS (FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR)
+
 void flash_unlock(void) {
 	/* (1) Wait till no operation is on going */
   /* (2) Check that the Flash is unlocked */
@@ -39,46 +50,94 @@ void flash_lock(void) {
   FLASH->CR |= FLASH_CR_LOCK;
 }
 
-void flash_erasepage(uint32_t page_addr) {
+static FLASH_RAMFUNC flash_status_t flash_status(uint32_t sr) {
+  if((sr & FLASH_SR_WRPRTERR) != 0)
+    return FLASH_ERR_WRP;
+  if((sr & FLASH_SR_PGERR) != 0)
+    return FLASH_ERR_PROG;
+  if((sr & FLASH_SR_EOP) == 0)
+    return FLASH_ERR_EOP;
+  return FLASH_OK;
+}
+
+/*
+ * Wait for the end of the operation in progress and clear its status
+ * flags (written as 1 to clear them, not read-modify-written).
+ */
+static FLASH_RAMFUNC flash_status_t flash_wait(void) {
+  uint32_t sr;
+
+  while((FLASH->SR & FLASH_SR_BSY) != 0) {
+    /* For robust implementation, add here time-out management */
+  }
+  sr = FLASH->SR;
+  FLASH->SR = sr & FLASH_SR_FLAGS;
+  return flash_status(sr);
+}
+
+FLASH_RAMFUNC flash_status_t flash_erasepage(uint32_t page_addr) {
+  flash_status_t st;
+
   /* (1) Set the PER bit in the FLASH_CR register to enable page erasing */
   /* (2) Program the FLASH_AR register to select a page to erase */
   /* (3) Set the STRT bit in the FLASH_CR register to start the erasing */
-  /* (4) Wait until the BSY bit is reset in the FLASH_SR register */
-  /* (5) Check the EOP flag in the FLASH_SR register */
-  /* (6) Clear EOP flag by software by writing EOP at 1 */
-  /* (7) Reset the PER Bit to disable the page erase */
+  /* (4) Wait until the BSY bit is reset, check and clear the flags */
+  /* (5) Reset the PER Bit to disable the page erase */
   FLASH->CR |= FLASH_CR_PER; /* (1) */
   FLASH->AR = page_addr; /* (2) */
   FLASH->CR |= FLASH_CR_STRT; /* (3) */
-  while((FLASH->SR & FLASH_SR_BSY) != 0) { /* (4) */ 
-    /* For robust implementation, add here time-out management */
-  }
-  if((FLASH->SR & FLASH_SR_EOP) != 0) /* (5) */ {
-    FLASH->SR |= FLASH_SR_EOP; /* (6)*/
-  } else {
-    /* Manage the error cases */
-  }
-  FLASH->CR &= ~FLASH_CR_PER; /* (7) */
+  st = flash_wait(); /* (4) */
+  FLASH->CR &= ~FLASH_CR_PER; /* (5) */
+  return st;
 }
 
-void flash_write16(uint32_t flash_addr, uint16_t data) {
+FLASH_RAMFUNC flash_status_t flash_write16(uint32_t flash_addr, uint16_t data) {
+  flash_status_t st;
+
   /* (1) Set the PG bit in the FLASH_CR register to enable programming */
   /* (2) Perform the data write (half-word) at the desired address */
-  /* (3) Wait until the BSY bit is reset in the FLASH_SR register */
-  /* (4) Check the EOP flag in the FLASH_SR register */
-  /* (5) clear it by software by writing it at 1 */
-  /* (6) Reset the PG Bit to disable programming */
+  /* (3) Wait until the BSY bit is reset, check and clear the flags */
+  /* (4) Reset the PG Bit to disable programming */
   FLASH->CR |= FLASH_CR_PG; /* (1) */
   *(__IO uint16_t*)(flash_addr) = data; /* (2) */
-  while((FLASH->SR & FLASH_SR_BSY) != 0) /* (3) */ {
-    /* For robust implementation, add here time-out management */
+  st = flash_wait(); /* (3) */
+  FLASH->CR &= ~FLASH_CR_PG; /* (4) */
+  return st;
+}
+
+/*
+ * Program len bytes from src at flash_addr, with PG set for the whole
+ * run. Flash is programmed by halfwords: a head at an odd address or a
+ * tail ending at one is padded with 0xFF, which leaves the other byte
+ * of that halfword erased but no longer programmable (PGERR). Stops at
+ * the first error. With verify, the bytes are then read back.
+ */
+FLASH_RAMFUNC flash_status_t flash_write_buf(uint32_t flash_addr, const void *src, size_t len, bool verify) {
+  const uint8_t *p = src;
+  uint32_t a, end = flash_addr + len;
+  flash_status_t st = FLASH_OK;
+  uint16_t h;
+  size_t i;
+
+  FLASH->CR |= FLASH_CR_PG;
+  for(a = flash_addr & ~1UL; a < end; a += 2) {
+    h = 0xFFFF;
+    if(a >= flash_addr)
+      h = (h & 0xFF00) | p[a - flash_addr];
+    if(a + 1 < end)
+      h = (h & 0x00FF) | (p[a + 1 - flash_addr] << 8);
+    *(__IO uint16_t*)(a) = h;
+    if((st = flash_wait()) != FLASH_OK)
+      break;
   }
-  if((FLASH->SR & FLASH_SR_EOP) != 0) /* (4) */ {
-    FLASH->SR |= FLASH_SR_EOP; /* (5) */
-  } else {
-    /* Manage the error cases */
+  FLASH->CR &= ~FLASH_CR_PG;
+  if(verify && (st == FLASH_OK)) {
+    for(i = 0; i < len; i++) {
+      if(*(__IO uint8_t*)(flash_addr + i) != p[i])
+        return FLASH_ERR_VERIFY;
+    }
   }
-  FLASH->CR &= ~FLASH_CR_PG; /* (6) */
+  return st;
 }
 
 uint16_t flash_read16(uint32_t addr) {
@@ -6,10 +6,34 @@
 #ifndef _FLASH_H_
 #define _FLASH_H_
 
+/* Result of an erase or a write */
+typedef enum {
+  FLASH_OK = 0,
+  FLASH_ERR_PROG,      /* PGERR: programming a halfword that is not erased */
+  FLASH_ERR_WRP,       /* WRPRTERR: the page is write protected */
+  FLASH_ERR_EOP,       /* the operation did not signal its end */
+  FLASH_ERR_VERIFY     /* read back differs from what was written */
+} flash_status_t;
+
+/*
+ * Erasing or programming stalls every fetch from flash until it is done,
+ * so the routines that do it run from RAM: .ramtext, which the startup
+ * code copies along with .data (see the linker scripts in ld/). RAM is
+ * out of branch range of flash, hence long_call.
+ */
+#if !defined(FLASH_RAMFUNC)
+#define FLASH_RAMFUNC __attribute__((section(".ramtext"), noinline, long_call))
+#endif
+
+/*
+ * Erasing and programming are done with the system locked and the flash
+ * unlocked, and return once the operation is over.
+ */
 void flash_unlock(void);
 void flash_lock(void);
-void flash_erasepage(uint32_t page_addr);
-void flash_write16(uint32_t flash_addr, uint16_t data);
+FLASH_RAMFUNC flash_status_t flash_erasepage(uint32_t page_addr);
+FLASH_RAMFUNC flash_status_t flash_write16(uint32_t flash_addr, uint16_t data);
+FLASH_RAMFUNC flash_status_t flash_write_buf(uint32_t flash_addr, const void *src, size_t len, bool verify);
 uint16_t flash_read16(uint32_t addr);
 
 #endif /* _FLASH_H_ */
@@ -87,6 +87,123 @@ static THD_FUNCTION(BlinkThr, arg) {
   }
 }
 
+/*===========================================================================
+ * Flash write benchmark.
+ *===========================================================================*/
+
+#define BENCH_SIZE 1024
+
+static uint8_t bench_buf[BENCH_SIZE];
+
+static void bench_erase(void) {
+  osalSysLock();
+  flash_unlock();
+  flash_erasepage(FLASH_ADDR);
+  flash_lock();
+  osalSysUnlock();
+}
+
+/*
+ * Interrupt blackout: a virtual timer rearmed every BENCH_TICK records
+ * how late it fires; the latest, around an erase, is how long that
+ * erase held off interrupts (to a tick or so).
+ */
+#define BENCH_TICK US2ST(500)
+
+static virtual_timer_t bench_vt;
+static volatile systime_t bench_due, bench_late;
+
+static void bench_tick(void *p) {
+  systime_t now = chVTGetSystemTimeX();
+
+  (void)p;
+  if((systime_t)(now - bench_due) > bench_late) {
+    bench_late = now - bench_due;
+  }
+  chSysLockFromISR();
+  bench_due = now + BENCH_TICK;
+  chVTSetI(&bench_vt, BENCH_TICK, bench_tick, NULL);
+  chSysUnlockFromISR();
+}
+
+static systime_t bench_blackout(void (*erase)(void)) {
+  chVTObjectInit(&bench_vt);
+  chSysLock();
+  bench_late = 0;
+  bench_due = chVTGetSystemTimeX() + BENCH_TICK;
+  chVTSetI(&bench_vt, BENCH_TICK, bench_tick, NULL);
+  chSysUnlock();
+  chThdSleepMilliseconds(5);
+  erase();
+  chThdSleepMilliseconds(5);
+  chVTReset(&bench_vt);
+  return bench_late;
+}
+
+static void bench_print(BaseSequentialStream *chp, const char *name, systime_t t, flash_status_t st) {
+  chprintf(chp, "%-22s %5U us  %6U B/s", name, (uint32_t)(((uint64_t)t * 1000000) / CH_CFG_ST_FREQUENCY),
+           (uint32_t)(((uint64_t)BENCH_SIZE * CH_CFG_ST_FREQUENCY) / ((t > 0) ? t : 1)));
+  if(st != FLASH_OK) {
+    chprintf(chp, "  error %u", st);
+  }
+  chprintf(chp, "\r\n");
+}
+
+/*
+ * Program the page at FLASH_ADDR (erased before each run, not timed)
+ * the way callers do it now, one halfword per lock, then with
+ * flash_write_buf() without and with read-back. Then the longest
+ * interrupt blackout of an erase.
+ */
+static void flash_bench(BaseSequentialStream *chp) {
+  flash_status_t st = FLASH_OK;
+  systime_t t;
+  uint16_t i;
+
+  for(i = 0; i < BENCH_SIZE; i++) {
+    bench_buf[i] = (uint8_t)(i * 7 + 1);
+  }
+
+  bench_erase();
+  t = chVTGetSystemTimeX();
+  for(i = 0; (i < BENCH_SIZE) && (st == FLASH_OK); i += 2) {
+    osalSysLock();
+    flash_unlock();
+    st = flash_write16(FLASH_ADDR + i, bench_buf[i] | (bench_buf[i+1] << 8));
+    flash_lock();
+    osalSysUnlock();
+  }
+  bench_print(chp, "flash_write16 loop", chVTGetSystemTimeX() - t, st);
+
+  bench_erase();
+  t = chVTGetSystemTimeX();
+  osalSysLock();
+  flash_unlock();
+  st = flash_write_buf(FLASH_ADDR, bench_buf, BENCH_SIZE, false);
+  flash_lock();
+  osalSysUnlock();
+  bench_print(chp, "flash_write_buf", chVTGetSystemTimeX() - t, st);
+
+  bench_erase();
+  t = chVTGetSystemTimeX();
+  osalSysLock();
+  flash_unlock();
+  st = flash_write_buf(FLASH_ADDR, bench_buf, BENCH_SIZE, true);
+  flash_lock();
+  osalSysUnlock();
+  bench_print(chp, "flash_write_buf verify", chVTGetSystemTimeX() - t, st);
+
+  /* programming a halfword twice has to be reported */
+  osalSysLock();
+  flash_unlock();
+  st = flash_write_buf(FLASH_ADDR, bench_buf, 2, false);
+  flash_lock();
+  osalSysUnlock();
+  chprintf(chp, "rewrite: %s\r\n", (st == FLASH_ERR_PROG) ? "PGERR reported" : "NOT reported");
+
+  chprintf(chp, "erase blackout         %5U us\r\n", (uint32_t)ST2US(bench_blackout(bench_erase)));
+}
+
 /*===========================================================================
  * Main loop.
  *===========================================================================*/
@@ -172,6 +289,12 @@ int main(void) {
       if(charbuf == '\r') {
         chnPutTimeout(&OUTPUT_CHANNEL, '\n', TIME_IMMEDIATE);          
       }
+      /* 'b': flash write benchmark */
+      if(charbuf == 'b') {
+        chnPutTimeout(&OUTPUT_CHANNEL, '\r', TIME_IMMEDIATE);
+        chnPutTimeout(&OUTPUT_CHANNEL, '\n', TIME_IMMEDIATE);
+        flash_bench((BaseSequentialStream *)&OUTPUT_CHANNEL);
+      }
     }
 
     chThdSleepMilliseconds(50);
@@ -0,0 +1,581 @@
+/*
+ * (c) 2016 flabbergast <s3+flabbergast@sdfeu.org>
+ * Licensed under the Apache License, Version 2.0.
+ */
+
+#include "ch.h"
+#include "hal.h"
+
+#include "flash.h"
+#include "crc16.h"
+#include "wiegand.h"
+#include "carddb.h"
+
+#if WIEG_USE_CARDDB
+
+/* The flash is read in place; addresses are uint32_t, as in flash.h */
+#define FLASH_PTR(a)   ((uintptr_t)(a))
+#define PTR_ADDR(p)    ((uint32_t)(uintptr_t)(p))
+
+#define BANK_HEADER(b) ((const carddb_header_t *)FLASH_PTR(b))
+#define BANK_IDS(b)    ((const uint64_t *)FLASH_PTR((b) + sizeof(carddb_header_t)))
+#define BANK_FLAGS(b)  ((const uint8_t *)(BANK_IDS(b) + BANK_HEADER(b)->count))
+
+#define JOURNAL_HEADER  ((const carddb_journal_t *)FLASH_PTR(CARDDB_JOURNAL_ADDR))
+#define JOURNAL_ENTRIES ((const carddb_entry_t *)FLASH_PTR(CARDDB_JOURNAL_ADDR + sizeof(carddb_journal_t)))
+
+/* State found at init, kept up to date by loads and syncs */
+static struct {
+  uint32_t bank;         /* active bank address, 0 if none */
+  uint32_t generation;
+  bool journal_ok;       /* journal applies to the active bank */
+  uint16_t journal_len;  /* entries written, committed or not */
+} carddb;
+
+/* Bank being written (load or compaction) */
+static struct {
+  bool active;
+  uint32_t bank;
+  uint16_t count;
+  uint16_t n;
+  uint64_t last;
+  uint8_t flags;         /* waiting for the next one, flash is written by halfwords */
+} carddb_write;
+
+/* Sync batch in progress */
+static struct {
+  bool active;
+  uint16_t changes;
+  uint16_t n;
+} carddb_sync;
+
+/*
+ * Held by every call that reads or changes the database: lookups come
+ * from the receive thread, loads and syncs from the shell.
+ */
+static MUTEX_DECL(carddb_mtx);
+
+/*===========================================================================
+ * Flash access.
+ *===========================================================================*/
+
+/*
+ * One operation at a time, so interrupts are only held off briefly.
+ * Halfwords are read back; false if anything fails.
+ */
+static bool carddb_write16(uint32_t addr, uint16_t data) {
+  flash_status_t st;
+
+  osalSysLock();
+  flash_unlock();
+  st = flash_write16(addr, data);
+  flash_lock();
+  osalSysUnlock();
+  return (st == FLASH_OK) && (flash_read16(addr) == data);
+}
+
+static bool carddb_write32(uint32_t addr, uint32_t data) {
+  return carddb_write16(addr, (uint16_t)data) && carddb_write16(addr + 2, (uint16_t)(data >> 16));
+}
+
+static bool carddb_write64(uint32_t addr, uint64_t data) {
+  return carddb_write32(addr, (uint32_t)data) && carddb_write32(addr + 4, (uint32_t)(data >> 32));
+}
+
+static bool carddb_erase(uint32_t addr, uint32_t size) {
+  flash_status_t st = FLASH_OK;
+  uint32_t a;
+
+  for(a=addr; (a<addr+size) && (st == FLASH_OK); a+=FLASH_PAGE_SIZE) {
+    osalSysLock();
+    flash_unlock();
+    st = flash_erasepage(a);
+    flash_lock();
+    osalSysUnlock();
+  }
+  return st == FLASH_OK;
+}
+
+/*===========================================================================
+ * Banks.
+ *===========================================================================*/
+
+static uint16_t carddb_bank_crc(uint32_t bank, uint16_t count) {
+  return crc16_update(CRC16_INIT, (const uint8_t *)BANK_IDS(bank), 9UL*count);
+}
+
+static bool carddb_bank_valid(uint32_t bank) {
+  const carddb_header_t *h = BANK_HEADER(bank);
+  return (h->magic == CARDDB_MAGIC) && (h->count <= CARDDB_CAPACITY)
+         && (carddb_bank_crc(bank, h->count) == h->crc);
+}
+
+static bool carddb_bank_lookup(uint32_t bank, uint64_t id, uint8_t *flags) {
+  const uint64_t *ids = BANK_IDS(bank);
+  uint16_t count = BANK_HEADER(bank)->count;
+  uint16_t lo = 0, hi = count, mid;
+
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    if(ids[mid] < id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if((lo == count) || (ids[lo] != id))
+    return false;
+  *flags = BANK_FLAGS(bank)[lo];
+  return true;
+}
+
+/* The bank that is not active, i.e. the one to write */
+static uint32_t carddb_spare_bank(void) {
+  return (carddb.bank == CARDDB_BANK_ADDR(0)) ? CARDDB_BANK_ADDR(1) : CARDDB_BANK_ADDR(0);
+}
+
+/*
+ * Erase the spare bank and start writing count cards to it. A flash
+ * error ends the write: the bank is not committed.
+ */
+static bool carddb_write_begin(uint16_t count) {
+  carddb_write.bank = carddb_spare_bank();
+  carddb_write.active = carddb_erase(carddb_write.bank, CARDDB_BANK_SIZE);
+  carddb_write.count = count;
+  carddb_write.n = 0;
+  return carddb_write.active;
+}
+
+static bool carddb_write_add(uint64_t id, uint8_t flags) {
+  uint32_t addr;
+  bool ok;
+
+  if(!carddb_write.active || (carddb_write.n >= carddb_write.count)
+     || ((carddb_write.n > 0) && (id <= carddb_write.last)))
+    return false;
+  ok = carddb_write64(PTR_ADDR(&BANK_IDS(carddb_write.bank)[carddb_write.n]), id);
+  addr = PTR_ADDR(BANK_IDS(carddb_write.bank)) + 8UL*carddb_write.count + (carddb_write.n & ~1);
+  if(carddb_write.n & 1) {
+    ok = ok && carddb_write16(addr, carddb_write.flags | (flags << 8));
+  } else {
+    carddb_write.flags = flags;
+  }
+  if(!ok) {
+    carddb_write.active = false;
+    return false;
+  }
+  carddb_write.last = id;
+  carddb_write.n++;
+  return true;
+}
+
+static bool carddb_journal_reset(uint32_t generation);
+static void carddb_scan(void);
+
+/*
+ * Commit the written bank with the given generation, restart the
+ * journal. If the journal cannot be restarted the bank still is the
+ * active one, and the next sync tries again.
+ */
+static bool carddb_write_end(uint32_t generation) {
+  uint32_t bank = carddb_write.bank;
+  uint32_t count = carddb_write.count;
+  bool ok = true;
+
+  if(!carddb_write.active || (carddb_write.n != count))
+    return false;
+  carddb_write.active = false;
+  if(count & 1) {
+    ok = carddb_write16(PTR_ADDR(BANK_IDS(bank)) + 9*count - 1, carddb_write.flags | 0xFF00);
+  }
+  ok = ok && carddb_write32(bank + 4, generation) && carddb_write16(bank + 8, count)
+       && carddb_write16(bank + 10, carddb_bank_crc(bank, count));
+  /* commit */
+  if(!ok || !carddb_write32(bank, CARDDB_MAGIC) || !carddb_bank_valid(bank))
+    return false;
+  /* the new bank first: the old journal does not apply to it */
+  carddb_scan();
+  carddb_journal_reset(generation);
+  return true;
+}
+
+/*===========================================================================
+ * Journal.
+ *===========================================================================*/
+
+static uint16_t carddb_entry_crc(const carddb_entry_t *e) {
+  return crc16_update(CRC16_INIT, (const uint8_t *)e, 10);
+}
+
+static bool carddb_entry_valid(const carddb_entry_t *e) {
+  return carddb_entry_crc(e) == e->check;
+}
+
+static bool carddb_entry_erased(const carddb_entry_t *e) {
+  return (e->id == 0xFFFFFFFFFFFFFFFFULL) && (e->flags == 0xFF) && (e->op == 0xFF) && (e->check == 0xFFFF);
+}
+
+/* Commit entry at index i that covers its preceding entries */
+static uint8_t carddb_commit_size(const carddb_entry_t *e, uint16_t i) {
+  if((e->op != CARDDB_OP_COMMIT) || !carddb_entry_valid(e) || (e->flags > i))
+    return 0xFF;
+  return e->flags;
+}
+
+static bool carddb_journal_reset(uint32_t generation) {
+  carddb_sync.active = false;
+  carddb.journal_ok = carddb_erase(CARDDB_JOURNAL_ADDR, CARDDB_JOURNAL_SIZE)
+                      && carddb_write32(CARDDB_JOURNAL_ADDR + 4, generation)
+                      && carddb_write32(CARDDB_JOURNAL_ADDR, CARDDB_JOURNAL_MAGIC);
+  carddb.journal_len = 0;
+  return carddb.journal_ok;
+}
+
+/*
+ * Append an entry. One that fails gets a check of 0 (which always
+ * programs), so it does not read as erased and the journal goes on
+ * after it; as no commit covers it, it is ignored.
+ */
+static bool carddb_journal_append(uint64_t id, uint8_t flags, uint8_t op) {
+  carddb_entry_t e;
+  uint32_t addr = PTR_ADDR(&JOURNAL_ENTRIES[carddb.journal_len]);
+  bool ok;
+
+  e.id = id;
+  e.flags = flags;
+  e.op = op;
+  ok = carddb_write64(addr, id) && carddb_write16(addr + 8, flags | (op << 8))
+       && carddb_write16(addr + 10, carddb_entry_crc(&e));
+  if(!ok)
+    carddb_write16(addr + 10, 0);
+  carddb.journal_len++;
+  return ok;
+}
+
+/*
+ * Latest committed journal entry for a card, NULL if none. Entries of a
+ * batch are taken into account once its commit is seen.
+ */
+static const carddb_entry_t *carddb_journal_find(uint64_t id) {
+  const carddb_entry_t *found = NULL, *batch = NULL;
+  const carddb_entry_t *e = JOURNAL_ENTRIES;
+  uint16_t i, batch_i = 0;
+  uint8_t n;
+
+  for(i=0; i<carddb.journal_len; i++, e++) {
+    if(e->id == id) {
+      if((e->op != CARDDB_OP_COMMIT) && carddb_entry_valid(e)) {
+        batch = e;
+        batch_i = i;
+      }
+    }
+    if(e->op == CARDDB_OP_COMMIT) {
+      n = carddb_commit_size(e, i);
+      if((batch != NULL) && (n != 0xFF) && (batch_i >= i - n)) {
+        found = batch;
+      }
+      batch = NULL;
+    }
+  }
+  return found;
+}
+
+/*===========================================================================
+ * Lookup.
+ *===========================================================================*/
+
+/* Find the database in flash; a load or sync in progress is dropped */
+static void carddb_scan(void) {
+  const carddb_entry_t *e;
+  bool a = carddb_bank_valid(CARDDB_BANK_ADDR(0));
+  bool b = carddb_bank_valid(CARDDB_BANK_ADDR(1));
+  uint16_t i;
+
+  carddb_write.active = false;
+  carddb_sync.active = false;
+  if(a && b) {
+    carddb.bank = (BANK_HEADER(CARDDB_BANK_ADDR(1))->generation > BANK_HEADER(CARDDB_BANK_ADDR(0))->generation)
+                  ? CARDDB_BANK_ADDR(1) : CARDDB_BANK_ADDR(0);
+  } else if(a || b) {
+    carddb.bank = a ? CARDDB_BANK_ADDR(0) : CARDDB_BANK_ADDR(1);
+  } else {
+    carddb.bank = 0;
+  }
+  carddb.generation = (carddb.bank != 0) ? BANK_HEADER(carddb.bank)->generation : 0;
+
+  /* a journal for an older bank has been merged already */
+  carddb.journal_ok = (JOURNAL_HEADER->magic == CARDDB_JOURNAL_MAGIC)
+                      && (JOURNAL_HEADER->generation == carddb.generation);
+  carddb.journal_len = 0;
+  if(!carddb.journal_ok)
+    return;
+  for(e=JOURNAL_ENTRIES; (carddb.journal_len < CARDDB_JOURNAL_CAPACITY) && !carddb_entry_erased(e); e++) {
+    carddb.journal_len++;
+  }
+  for(i=0, e=JOURNAL_ENTRIES; i<carddb.journal_len; i++, e++) {
+    if(carddb_commit_size(e, i) != 0xFF) {
+      carddb.generation = (uint32_t)e->id;
+    }
+  }
+}
+
+void carddb_init(void) {
+  chMtxLock(&carddb_mtx);
+  carddb_scan();
+  chMtxUnlock(&carddb_mtx);
+}
+
+bool carddb_valid(void) {
+  return carddb.bank != 0;
+}
+
+uint16_t carddb_count(void) {
+  return (carddb.bank != 0) ? BANK_HEADER(carddb.bank)->count : 0;
+}
+
+uint32_t carddb_generation(void) {
+  return carddb.generation;
+}
+
+uint16_t carddb_journal_used(void) {
+  return carddb.journal_len;
+}
+
+/*
+ * Journal first (a short linear scan), then a binary search of the
+ * bank, both straight from flash. Waits for a load, sync or compaction
+ * call in progress to return. Returns false if the card is not listed.
+ */
+bool carddb_lookup(uint64_t id, uint8_t *flags) {
+  const carddb_entry_t *e;
+  bool found;
+
+  chMtxLock(&carddb_mtx);
+  if(carddb.journal_ok && ((e = carddb_journal_find(id)) != NULL)) {
+    *flags = e->flags;
+    found = (e->op == CARDDB_OP_ADD);
+  } else {
+    found = (carddb.bank != 0) && carddb_bank_lookup(carddb.bank, id, flags);
+  }
+  chMtxUnlock(&carddb_mtx);
+  return found;
+}
+
+/*===========================================================================
+ * Full load.
+ *===========================================================================*/
+
+/*
+ * Loading replaces the whole database: begin with the number of cards,
+ * add them in ascending order, end. It goes to the spare bank, the
+ * current contents are used until the end.
+ */
+bool carddb_load_begin(uint16_t count) {
+  bool ok;
+
+  if(count > CARDDB_CAPACITY)
+    return false;
+  chMtxLock(&carddb_mtx);
+  carddb_sync.active = false;
+  ok = carddb_write_begin(count);
+  chMtxUnlock(&carddb_mtx);
+  return ok;
+}
+
+bool carddb_load_add(uint64_t id, uint8_t flags) {
+  bool ok;
+
+  chMtxLock(&carddb_mtx);
+  ok = carddb_write_add(id, flags);
+  chMtxUnlock(&carddb_mtx);
+  return ok;
+}
+
+bool carddb_load_end(void) {
+  bool ok;
+
+  chMtxLock(&carddb_mtx);
+  ok = carddb_write_end(carddb.generation + 1);
+  chMtxUnlock(&carddb_mtx);
+  return ok;
+}
+
+void carddb_clear(void) {
+  chMtxLock(&carddb_mtx);
+  carddb_erase(CARDDB_BANK_ADDR(0), CARDDB_BANK_SIZE);
+  carddb_erase(CARDDB_BANK_ADDR(1), CARDDB_BANK_SIZE);
+  carddb_erase(CARDDB_JOURNAL_ADDR, CARDDB_JOURNAL_SIZE);
+  carddb_scan();
+  chMtxUnlock(&carddb_mtx);
+}
+
+/*===========================================================================
+ * Delta sync.
+ *===========================================================================*/
+
+/*
+ * A sync batch changes the database from 'generation' (which has to be
+ * the current one) to the next. The number of changes is given up
+ * front so the batch can be made to fit in the journal, compacting
+ * first if needed.
+ */
+static bool carddb_journal_merge(void);
+
+bool carddb_sync_begin(uint32_t generation, uint16_t changes) {
+  bool ok = false;
+
+  chMtxLock(&carddb_mtx);
+  if((generation == carddb.generation) && (changes <= 255) && !carddb_write.active) {
+    ok = (carddb.journal_ok || carddb_journal_reset(carddb.generation))
+         && ((carddb.journal_len + changes + 1U <= CARDDB_JOURNAL_CAPACITY) || carddb_journal_merge());
+    /* a compaction restarts the journal, which may have failed */
+    ok = ok && (carddb.journal_ok || carddb_journal_reset(carddb.generation))
+         && (carddb.journal_len + changes + 1U <= CARDDB_JOURNAL_CAPACITY);
+  }
+  if(ok) {
+    carddb_sync.active = true;
+    carddb_sync.changes = changes;
+    carddb_sync.n = 0;
+  }
+  chMtxUnlock(&carddb_mtx);
+  return ok;
+}
+
+bool carddb_sync_change(uint64_t id, uint8_t flags, uint8_t op) {
+  bool ok;
+
+  chMtxLock(&carddb_mtx);
+  ok = carddb_sync.active && (carddb_sync.n < carddb_sync.changes)
+       && ((op == CARDDB_OP_ADD) || (op == CARDDB_OP_DEL));
+  if(ok) {
+    /* a change that fails drops the batch */
+    ok = carddb_journal_append(id, flags, op);
+    carddb_sync.active = ok;
+    carddb_sync.n++;
+  }
+  chMtxUnlock(&carddb_mtx);
+  return ok;
+}
+
+bool carddb_sync_end(void) {
+  bool ok;
+
+  chMtxLock(&carddb_mtx);
+  ok = carddb_sync.active && (carddb_sync.n == carddb_sync.changes);
+  if(ok) {
+    carddb_sync.active = false;
+    ok = carddb_journal_append(carddb.generation + 1, carddb_sync.n, CARDDB_OP_COMMIT);
+  }
+  if(ok) {
+    carddb.generation++;
+  }
+  chMtxUnlock(&carddb_mtx);
+  return ok;
+}
+
+/*===========================================================================
+ * Compaction.
+ *===========================================================================*/
+
+/* Latest committed journal entry per card, sorted by card id */
+static uint8_t carddb_merge_list[CARDDB_JOURNAL_CAPACITY];
+static uint8_t carddb_merge_len;
+
+static void carddb_merge_collect(void) {
+  const carddb_entry_t *e = JOURNAL_ENTRIES;
+  uint16_t i, j, k;
+  uint8_t n, t;
+
+  carddb_merge_len = 0;
+  for(i=0; i<carddb.journal_len; i++) {
+    n = carddb_commit_size(&e[i], i);
+    if(n == 0xFF)
+      continue;
+    for(j=i-n; j<i; j++) {
+      if((e[j].op == CARDDB_OP_COMMIT) || !carddb_entry_valid(&e[j]))
+        continue;
+      for(k=0; (k<carddb_merge_len) && (e[carddb_merge_list[k]].id != e[j].id); k++)
+        ;
+      carddb_merge_list[k] = j;
+      if(k == carddb_merge_len)
+        carddb_merge_len++;
+    }
+  }
+  /* insertion sort, the list is short */
+  for(i=1; i<carddb_merge_len; i++) {
+    t = carddb_merge_list[i];
+    for(j=i; (j>0) && (e[carddb_merge_list[j-1]].id > e[t].id); j--) {
+      carddb_merge_list[j] = carddb_merge_list[j-1];
+    }
+    carddb_merge_list[j] = t;
+  }
+}
+
+/* Merge the bank and the journal list; count only, or write as well */
+static uint32_t carddb_merge(bool write) {
+  const carddb_entry_t *e = JOURNAL_ENTRIES;
+  const uint64_t *ids = NULL;
+  const uint8_t *flags = NULL;
+  uint16_t bc = 0, i = 0, j = 0;
+  uint32_t count = 0;
+
+  if(carddb.bank != 0) {
+    ids = BANK_IDS(carddb.bank);
+    flags = BANK_FLAGS(carddb.bank);
+    bc = BANK_HEADER(carddb.bank)->count;
+  }
+  while((i < bc) || (j < carddb_merge_len)) {
+    if((j >= carddb_merge_len) || ((i < bc) && (ids[i] < e[carddb_merge_list[j]].id))) {
+      if(write)
+        carddb_write_add(ids[i], flags[i]);
+      count++;
+      i++;
+    } else {
+      if((i < bc) && (ids[i] == e[carddb_merge_list[j]].id))
+        i++;
+      if(e[carddb_merge_list[j]].op == CARDDB_OP_ADD) {
+        if(write)
+          carddb_write_add(e[carddb_merge_list[j]].id, e[carddb_merge_list[j]].flags);
+        count++;
+      }
+      j++;
+    }
+  }
+  return count;
+}
+
+/*
+ * Merge the journal into the spare bank, which becomes the active one
+ * with the current generation, and restart the journal. Erases two
+ * bank pages and the journal page; a power loss in between leaves
+ * either the old bank and journal or the new bank.
+ */
+static bool carddb_journal_merge(void) {
+  uint32_t count;
+
+  if(!carddb.journal_ok || carddb_write.active)
+    return false;
+  carddb_sync.active = false;
+  carddb_merge_collect();
+  if(carddb.generation == ((carddb.bank != 0) ? BANK_HEADER(carddb.bank)->generation : 0)) {
+    /* nothing committed, just drop what is there */
+    return (carddb.journal_len == 0) || carddb_journal_reset(carddb.generation);
+  }
+  count = carddb_merge(false);
+  if((count > CARDDB_CAPACITY) || !carddb_write_begin(count))
+    return false;
+  /* a card that fails to write ends the write, and carddb_write_end() sees it */
+  carddb_merge(true);
+  return carddb_write_end(carddb.generation);
+}
+
+bool carddb_compact(void) {
+  bool ok;
+
+  chMtxLock(&carddb_mtx);
+  ok = carddb_journal_merge();
+  chMtxUnlock(&carddb_mtx);
+  return ok;
+}
+
+#endif /* WIEG_USE_CARDDB */
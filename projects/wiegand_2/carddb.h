@@ -0,0 +1,94 @@
+/*
+ * (c) 2016 flabbergast <s3+flabbergast@sdfeu.org>
+ * Licensed under the Apache License, Version 2.0.
+ */
+
+#ifndef _CARDDB_H_
+#define _CARDDB_H_
+
+/*
+ * Card database in flash at CARDDB_ADDR: two banks and a journal.
+ *
+ * A bank is a full, sorted table:
+ *
+ *   carddb_header_t
+ *   uint64_t ids[count]      sorted, ascending
+ *   uint8_t flags[count]     flags of ids[i]
+ *
+ * The valid bank with the highest generation is the active one; the
+ * other one is rewritten by a full load or a compaction, so the active
+ * bank stays usable until the new one is complete. The header's magic
+ * is written last.
+ *
+ * The journal holds changes made on top of the active bank, in batches
+ * ended by a commit entry carrying the new generation. Entries not
+ * covered by a commit (interrupted sync) are ignored. When a batch does
+ * not fit, the bank and the journal are merged into the other bank
+ * (compaction) and the journal is restarted.
+ *
+ * A card id is the whole value field of a decoded frame (facility and
+ * card number, up to 56 bits in the known formats), as it is printed.
+ * The capacity follows from CARDDB_BANK_SIZE, set by the target in
+ * wiegand.h: 9 bytes a card.
+ */
+#define CARDDB_MAGIC         0x32444357   /* "WCD2" */
+#define CARDDB_JOURNAL_MAGIC 0x324A4357   /* "WCJ2" */
+
+typedef struct {
+  uint32_t magic;
+  uint32_t generation;
+  uint16_t count;
+  uint16_t crc;        /* CRC-16 of ids and flags */
+  uint32_t unused;     /* left erased, aligns the ids */
+} carddb_header_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t generation; /* of the bank the journal applies to */
+} carddb_journal_t;
+
+typedef struct {
+  uint64_t id;         /* card id, new generation for CARDDB_OP_COMMIT */
+  uint8_t flags;       /* card flags, number of entries for CARDDB_OP_COMMIT */
+  uint8_t op;
+  uint16_t check;      /* CRC-16 of the above, written last */
+  uint32_t unused;     /* left erased, aligns the next entry */
+} carddb_entry_t;
+
+#define CARDDB_OP_ADD    1   /* add or change a card */
+#define CARDDB_OP_DEL    2
+#define CARDDB_OP_COMMIT 3
+
+#define CARDDB_BANK_ADDR(i)  (CARDDB_ADDR + (i)*CARDDB_BANK_SIZE)
+#define CARDDB_JOURNAL_ADDR  (CARDDB_ADDR + 2*CARDDB_BANK_SIZE)
+
+#define CARDDB_CAPACITY ((CARDDB_BANK_SIZE - sizeof(carddb_header_t)) / 9)
+#define CARDDB_JOURNAL_CAPACITY ((CARDDB_JOURNAL_SIZE - sizeof(carddb_journal_t)) / sizeof(carddb_entry_t))
+
+/* counts are 16 bits */
+#if defined(CARDDB_BANK_SIZE) && ((CARDDB_BANK_SIZE / 9) > 0xFFFF)
+#error "CARDDB_BANK_SIZE holds more cards than a count can hold"
+#endif
+
+/* Card flags */
+#define CARDDB_GRANT    (1<<0)   /* open the door (else: listed but denied) */
+#define CARDDB_EXTENDED (1<<1)   /* hold the relay for WIEG_RELAY_TIME_EXT */
+
+void carddb_init(void);
+bool carddb_valid(void);
+uint16_t carddb_count(void);
+uint32_t carddb_generation(void);
+uint16_t carddb_journal_used(void);
+bool carddb_lookup(uint64_t id, uint8_t *flags);
+
+bool carddb_load_begin(uint16_t count);
+bool carddb_load_add(uint64_t id, uint8_t flags);
+bool carddb_load_end(void);
+void carddb_clear(void);
+
+bool carddb_sync_begin(uint32_t generation, uint16_t changes);
+bool carddb_sync_change(uint64_t id, uint8_t flags, uint8_t op);
+bool carddb_sync_end(void);
+bool carddb_compact(void);
+
+#endif /* _CARDDB_H_ */
@@ -0,0 +1,148 @@
+#!/usr/bin/env python
+#
+# Load a card list into the wiegand_2 card database through the shell.
+#
+# Usage: cardload.py [--full] /dev/ttyACM0 cards.txt   (needs pyserial)
+#
+# cards.txt has one card per line: <id> [flags], both hex; flags default
+# to 1 (grant), 3 = grant with the extended relay time, 0 = listed but
+# denied. The id is the value the reader prints for the card.
+# Lines starting with # are ignored.
+#
+# What was last loaded is kept in cards.txt.state along with the database
+# generation. If the device is still at that generation, only the changes
+# are sent (sync); otherwise, or with --full, the whole list is loaded.
+
+from __future__ import print_function
+
+import json
+import sys
+import time
+
+def read_cards(path):
+    cards = {}
+    with open(path) as f:
+        for line in f:
+            line = line.split("#")[0].split()
+            if not line:
+                continue
+            card = int(line[0], 16)
+            flags = int(line[1], 16) if len(line) > 1 else 1
+            cards[card] = flags
+    return cards
+
+def read_state(path):
+    try:
+        with open(path) as f:
+            state = json.load(f)
+        return state["generation"], dict((int(k, 16), v) for k, v in state["cards"].items())
+    except (IOError, ValueError, KeyError):
+        return None, None
+
+def write_state(path, generation, cards):
+    with open(path, "w") as f:
+        json.dump({"generation": generation,
+                   "cards": dict(("%08x" % k, v) for k, v in cards.items())}, f)
+
+def command(port, cmd):
+    port.write((cmd + "\r\n").encode("ascii"))
+    deadline = time.time() + 5
+    while time.time() < deadline:
+        line = port.readline().decode("ascii", "replace").strip()
+        if line.endswith("OK"):
+            return True
+        if line.endswith("ERR") or line.startswith("Usage"):
+            return False
+    return False
+
+def query(port, cmd):
+    port.write((cmd + "\r\n").encode("ascii"))
+    deadline = time.time() + 2
+    while time.time() < deadline:
+        line = port.readline().decode("ascii", "replace").strip()
+        if line.isdigit():
+            return int(line)
+    return None
+
+def full_load(port, cards):
+    # erases a database bank, takes a while
+    if not command(port, "cards begin %u" % len(cards)):
+        print("Could not start loading (too many cards?)")
+        sys.exit(1)
+    for i, (card, flags) in enumerate(sorted(cards.items())):
+        if not command(port, "cards add %x %x" % (card, flags)):
+            print("Card %08x rejected" % card)
+            sys.exit(1)
+        if i % 100 == 99:
+            print("%u/%u" % (i + 1, len(cards)))
+    if not command(port, "cards end"):
+        print("Database check failed")
+        sys.exit(1)
+
+# A batch and its commit have to fit in the device's journal (63 entries
+# on the F042)
+SYNC_BATCH = 62
+
+def delta_sync(port, generation, changes):
+    for i in range(0, len(changes), SYNC_BATCH):
+        batch = changes[i:i + SYNC_BATCH]
+        # may compact the database first
+        if not command(port, "sync begin %u %u" % (generation, len(batch))):
+            return None
+        for card, flags in batch:
+            if flags is None:
+                ok = command(port, "sync del %x" % card)
+            else:
+                ok = command(port, "sync add %x %x" % (card, flags))
+            if not ok:
+                print("Card %08x rejected" % card)
+                return None
+        if not command(port, "sync end"):
+            return None
+        generation += 1
+    return generation
+
+def main():
+    args = sys.argv[1:]
+    full = "--full" in args
+    if full:
+        args.remove("--full")
+    if len(args) != 2:
+        print("Usage: %s [--full] <serial port> <card list>" % sys.argv[0])
+        sys.exit(1)
+
+    import serial
+    cards = read_cards(args[1])
+    state_path = args[1] + ".state"
+    old_generation, old_cards = read_state(state_path)
+    port = serial.Serial(args[0], timeout=0.5)
+    port.write(b"\r\n")
+    time.sleep(0.2)
+    port.reset_input_buffer()
+
+    start = time.time()
+    generation = query(port, "sync")
+    if generation is None:
+        print("No answer from the device")
+        sys.exit(1)
+    if not full and old_cards is not None and generation == old_generation:
+        changes = [(card, None) for card in sorted(old_cards) if card not in cards]
+        changes += [(card, flags) for card, flags in sorted(cards.items())
+                    if old_cards.get(card) != flags]
+        new_generation = delta_sync(port, generation, changes)
+        if new_generation is None:
+            print("Sync failed, use --full")
+            sys.exit(1)
+        write_state(state_path, new_generation, cards)
+        print("Sent %u changes in %.1f s, generation %u"
+              % (len(changes), time.time() - start, new_generation))
+    else:
+        full_load(port, cards)
+        # a full load moves the generation on by one
+        write_state(state_path, generation + 1, cards)
+        print("Loaded %u cards in %.1f s, generation %u"
+              % (len(cards), time.time() - start, generation + 1))
+    port.close()
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,290 @@
+/*
+ * (c) 2016 flabbergast <s3+flabbergast@sdfeu.org>
+ * Licensed under the Apache License, Version 2.0.
+ */
+
+#include "ch.h"
+#include "hal.h"
+
+#include "flash.h"
+#include "crc16.h"
+#include "wiegand.h"
+#include "cfgstore.h"
+
+#define CFG_PAGES (sizeof(cfg_pages) / sizeof(cfg_pages[0]))
+#define CFG_NO_PAGE 0xFF
+#define CFG_HEADER_SIZE sizeof(cfg_header_t)
+
+static const uint32_t cfg_pages[] = {CFG_PAGE_ADDRS};
+
+/* State found at init, kept up to date by saves */
+static struct {
+  uint8_t page;                 /* active page in cfg_pages, CFG_NO_PAGE if none */
+  uint32_t generation;
+  uint16_t end;                 /* first free byte in the active page */
+  uint16_t index[CFG_KEYS];     /* latest record of each key, 0 if none */
+  uint16_t erases;              /* since boot */
+} cfg = {CFG_NO_PAGE, 0, 0, {0}, 0};
+
+/* Saves come from the shell and from the receive thread (event log) */
+static MUTEX_DECL(cfg_mtx);
+
+/*===========================================================================
+ * Flash access.
+ *===========================================================================*/
+
+/* Read by halfwords, as the flash is written */
+static uint32_t cfg_read32(uint32_t addr) {
+  return flash_read16(addr) | ((uint32_t)flash_read16(addr + 2) << 16);
+}
+
+/* Program a halfword and read it back; false if either fails */
+static bool cfg_write16(uint32_t addr, uint16_t data) {
+  flash_status_t st;
+
+  osalSysLock();
+  flash_unlock();
+  st = flash_write16(addr, data);
+  flash_lock();
+  osalSysUnlock();
+  return (st == FLASH_OK) && (flash_read16(addr) == data);
+}
+
+static bool cfg_write32(uint32_t addr, uint32_t data) {
+  return cfg_write16(addr, (uint16_t)data) && cfg_write16(addr + 2, (uint16_t)(data >> 16));
+}
+
+static bool cfg_erased(uint32_t page) {
+  uint16_t i;
+
+  for(i=0; (i<FLASH_PAGE_SIZE) && (flash_read16(page + i) == 0xFFFF); i+=2)
+    ;
+  return i == FLASH_PAGE_SIZE;
+}
+
+/* Erase a page unless it is erased already; false if it does not come out erased */
+static bool cfg_erase(uint32_t page) {
+  flash_status_t st;
+
+  if(cfg_erased(page))
+    return true;
+  osalSysLock();
+  flash_unlock();
+  st = flash_erasepage(page);
+  flash_lock();
+  osalSysUnlock();
+  cfg.erases++;
+  return (st == FLASH_OK) && cfg_erased(page);
+}
+
+/*===========================================================================
+ * Records.
+ *===========================================================================*/
+
+/* CRC-16 of the record at addr, key and length included */
+static uint16_t cfg_record_crc(uint32_t addr, uint8_t len) {
+  uint16_t crc = CRC16_INIT;
+  uint16_t i, h;
+  uint8_t b[2];
+
+  for(i=0; i<2+len; i+=2) {
+    h = flash_read16(addr + i);
+    b[0] = h & 0xFF;
+    b[1] = h >> 8;
+    crc = crc16_update(crc, b, (i+1 < 2+len) ? 2 : 1);
+  }
+  return crc;
+}
+
+static uint32_t cfg_record_addr(uint8_t key) {
+  return cfg_pages[cfg.page] + cfg.index[key];
+}
+
+static uint8_t cfg_record_len(uint8_t key) {
+  return flash_read16(cfg_record_addr(key)) >> 8;
+}
+
+/*
+ * Append a record at cfg.end of page, CRC last. If a halfword fails,
+ * the page takes nothing more (as after a record cut short, see
+ * cfg_scan()) and false is returned.
+ */
+static bool cfg_record_write(uint32_t page, uint8_t key, const uint8_t *value, uint8_t len) {
+  uint32_t addr = page + cfg.end;
+  uint16_t crc, i, h;
+  uint8_t b[2];
+  bool ok;
+
+  b[0] = key;
+  b[1] = len;
+  crc = crc16_update(CRC16_INIT, b, 2);
+  crc = crc16_update(crc, value, len);
+  ok = cfg_write16(addr, key | (len << 8));
+  for(i=0; ok && (i<len); i+=2) {
+    h = value[i];
+    if(i+1 < len)
+      h |= value[i+1] << 8;
+    else
+      h |= 0xFF00;
+    ok = cfg_write16(addr + 2 + i, h);
+  }
+  if(!ok || !cfg_write16(addr + CFG_RECORD_SIZE(len) - 2, crc)) {
+    cfg.end = FLASH_PAGE_SIZE;
+    return false;
+  }
+  cfg.index[key] = cfg.end;
+  cfg.end += CFG_RECORD_SIZE(len);
+  return true;
+}
+
+/* Build the index of the active page */
+static void cfg_scan(void) {
+  uint32_t page = cfg_pages[cfg.page];
+  uint16_t off = CFG_HEADER_SIZE;
+  uint16_t h, size;
+  uint8_t key, len;
+
+  for(key=0; key<CFG_KEYS; key++)
+    cfg.index[key] = 0;
+  while(off + 4 <= FLASH_PAGE_SIZE) {
+    h = flash_read16(page + off);
+    if(h == 0xFFFF)
+      break;
+    key = h & 0xFF;
+    len = h >> 8;
+    size = CFG_RECORD_SIZE(len);
+    if((len > CFG_VALUE_MAX) || (off + size > FLASH_PAGE_SIZE)) {
+      // cut short while its header was written: nothing fits after it
+      off = FLASH_PAGE_SIZE;
+      break;
+    }
+    if((key < CFG_KEYS) && (cfg_record_crc(page + off, len) == flash_read16(page + off + size - 2)))
+      cfg.index[key] = off;
+    off += size;
+  }
+  cfg.end = off;
+}
+
+/*===========================================================================
+ * Pages.
+ *===========================================================================*/
+
+static bool cfg_page_valid(uint8_t i) {
+  return cfg_read32(cfg_pages[i]) == CFG_MAGIC;
+}
+
+/*
+ * Copy the latest value of each key to the next page, with key's new
+ * value instead of its old one, and make it the active page. On a
+ * flash error the page is not committed and the old one stays active.
+ */
+static bool cfg_compact(uint8_t key, const uint8_t *value, uint8_t len) {
+  uint8_t next = (cfg.page == CFG_NO_PAGE) ? 0 : (cfg.page + 1) % CFG_PAGES;
+  uint32_t page = cfg_pages[next];
+  uint16_t index[CFG_KEYS];
+  uint8_t buf[CFG_VALUE_MAX];
+  uint8_t k, n;
+  bool ok;
+
+  for(k=0; k<CFG_KEYS; k++)
+    index[k] = (cfg.page != CFG_NO_PAGE) ? cfg.index[k] : 0;
+  ok = cfg_erase(page) && cfg_write32(page + 4, cfg.generation + 1);
+  cfg.end = CFG_HEADER_SIZE;
+  for(k=0; ok && (k<CFG_KEYS); k++) {
+    if(k == key) {
+      ok = cfg_record_write(page, k, value, len);
+    } else if(index[k] != 0) {
+      n = cfg_get(k, buf, sizeof(buf));
+      ok = cfg_record_write(page, k, buf, n);
+    } else {
+      cfg.index[k] = 0;
+    }
+  }
+  /* commit */
+  ok = ok && cfg_write32(page, CFG_MAGIC);
+  cfg_init();
+  return ok && (cfg.page == next) && (cfg.index[key] != 0);
+}
+
+/*===========================================================================
+ * Interface.
+ *===========================================================================*/
+
+void cfg_init(void) {
+  uint32_t generation;
+  uint8_t i;
+
+  cfg.page = CFG_NO_PAGE;
+  cfg.generation = 0;
+  for(i=0; i<CFG_PAGES; i++) {
+    generation = cfg_read32(cfg_pages[i] + 4);
+    if(cfg_page_valid(i) && ((cfg.page == CFG_NO_PAGE) || (generation > cfg.generation))) {
+      cfg.page = i;
+      cfg.generation = generation;
+    }
+  }
+  if(cfg.page != CFG_NO_PAGE)
+    cfg_scan();
+}
+
+/*
+ * Copy the value of key to value, at most size bytes. Returns its
+ * length, -1 if the key has no value.
+ */
+int cfg_get(uint8_t key, void *value, uint8_t size) {
+  uint32_t addr;
+  uint16_t h;
+  uint8_t len, i;
+
+  if((key >= CFG_KEYS) || (cfg.page == CFG_NO_PAGE) || (cfg.index[key] == 0))
+    return -1;
+  addr = cfg_record_addr(key) + 2;
+  len = cfg_record_len(key);
+  for(i=0; (i<len) && (i<size); i++) {
+    h = flash_read16(addr + (i & ~1));
+    ((uint8_t *)value)[i] = (i & 1) ? (h >> 8) : (h & 0xFF);
+  }
+  return len;
+}
+
+/*
+ * Save a value, unless it is the one saved already. Only erases flash
+ * when the active page is full. Returns false if the value could not
+ * be written (a flash error); the key then keeps its old value.
+ */
+bool cfg_set(uint8_t key, const void *value, uint8_t len) {
+  uint8_t old[CFG_VALUE_MAX];
+  uint8_t i;
+  bool ok;
+
+  if((key >= CFG_KEYS) || (len > CFG_VALUE_MAX))
+    return false;
+  chMtxLock(&cfg_mtx);
+  if(cfg_get(key, old, sizeof(old)) == len) {
+    for(i=0; (i<len) && (old[i] == ((const uint8_t *)value)[i]); i++)
+      ;
+    if(i == len) {
+      chMtxUnlock(&cfg_mtx);
+      return true;
+    }
+  }
+  if((cfg.page == CFG_NO_PAGE) || (cfg.end + CFG_RECORD_SIZE(len) > FLASH_PAGE_SIZE)) {
+    ok = cfg_compact(key, value, len);
+  } else {
+    ok = cfg_record_write(cfg_pages[cfg.page], key, value, len);
+  }
+  chMtxUnlock(&cfg_mtx);
+  return ok;
+}
+
+uint16_t cfg_used(void) {
+  return (cfg.page != CFG_NO_PAGE) ? cfg.end : 0;
+}
+
+uint32_t cfg_generation(void) {
+  return cfg.generation;
+}
+
+uint16_t cfg_erases(void) {
+  return cfg.erases;
+}
@@ -30,6 +30,12 @@
 
 #define _CHIBIOS_RT_CONF_
 
+/* 1 MHz system time (32-bit TIM2, tick-less) for us Wiegand timestamps */
+#if defined(F042)
+#define CH_CFG_ST_FREQUENCY                 1000000
+#define CH_CFG_ST_TIMEDELTA                 20
+#endif
+
 #include "../chconf-timers-multi.h"
 #include "../chconf-subsys-dbgoff.h"
 
@@ -0,0 +1,27 @@
+/*
+ * (c) 2016 flabbergast <s3+flabbergast@sdfeu.org>
+ * Licensed under the Apache License, Version 2.0.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crc16.h"
+
+/*
+ * Nibble-wise table: 32 bytes of flash instead of 512 for the
+ * byte-wise one, and still 2 lookups per byte.
+ */
+static const uint16_t crc16_table[16] = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+uint16_t crc16_update(uint16_t crc, const uint8_t *data, size_t len) {
+  while(len-- > 0) {
+    crc = (crc << 4) ^ crc16_table[(crc >> 12) ^ (*data >> 4)];
+    crc = (crc << 4) ^ crc16_table[(crc >> 12) ^ (*data & 15)];
+    data++;
+  }
+  return crc;
+}
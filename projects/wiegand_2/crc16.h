@@ -0,0 +1,17 @@
+/*
+ * (c) 2016 flabbergast <s3+flabbergast@sdfeu.org>
+ * Licensed under the Apache License, Version 2.0.
+ */
+
+#ifndef _CRC16_H_
+#define _CRC16_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-16/CCITT-FALSE: poly 0x1021, init 0xFFFF, no reflection */
+#define CRC16_INIT 0xFFFF
+
+uint16_t crc16_update(uint16_t crc, const uint8_t *data, size_t len);
+
+#endif /* _CRC16_H_ */
@@ -69,7 +69,7 @@
  * @brief   Enables the GPT subsystem.
  */
 #if !defined(HAL_USE_GPT) || defined(__DOXYGEN__)
-#define HAL_USE_GPT                 FALSE
+#define HAL_USE_GPT                 TRUE
 #endif
 
 /**
@@ -132,8 +132,12 @@
  * @brief   Enables the SERIAL subsystem.
  */
 #if !defined(HAL_USE_SERIAL) || defined(__DOXYGEN__)
+#if defined(F042)
+#define HAL_USE_SERIAL              TRUE    /* OSDP line, see wiegand.h */
+#else
 #define HAL_USE_SERIAL              FALSE
 #endif
+#endif
 
 /**
  * @brief   Enables the SERIAL over USB subsystem.
@@ -22,6 +22,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "ch.h"
@@ -34,8 +35,12 @@
 
 #include "usbcfg.h"
 #include "wiegand.h"
+#include "carddb.h"
+#include "cfgstore.h"
+#include "osdp.h"
 
-uint8_t wieg_test_buf[26] = {0, 1,1,0,0,1,1,0,0,1,1,0,0, 1,1,0,0,1,1,0,0,1,1,0,0, 1};
+/* 26 bits, 0 110011001100110011001100 1, packed from the top bit down */
+wieg_frame_t wieg_test_buf = {{0x66666640}, 0, 26, 0};
 
 /*===========================================================================*/
 /* Target-specific defs.                                                     */
@@ -93,7 +98,7 @@ static void cmd_mode(BaseSequentialStream *chp, int argc, char *argv[]) {
   (void)argv;
 
   if((argc == 0) || (argc > 1)) {
-    chprintf(chp, "Usage: mode [26|34|err|debug]\r\n");
+    chprintf(chp, "Usage: mode [26|34|ext|err|debug|bin]\r\n");
     chprintf(chp, "Current mode: ");
     if( print_mode & MODE_DEBUG ) {
       chprintf(chp, "debug\r\n");
@@ -107,27 +112,41 @@ static void cmd_mode(BaseSequentialStream *chp, int argc, char *argv[]) {
     } else if( print_mode & MODE_34 ) {
       chprintf(chp, "34\r\n");
       return;
+    } else if( print_mode & MODE_EXT ) {
+      chprintf(chp, "ext\r\n");
+      return;
+    } else if( print_mode & MODE_BIN ) {
+      chprintf(chp, "bin\r\n");
+      return;
     } else {
       chprintf(chp, "unknown?\r\n");
       return;      
     }
   } else {
     if( !strncmp(argv[0], "debug", 5) ) {
-      print_mode = MODE_DEBUG;
+      print_mode = MODE_DEBUG | (print_mode & MODE_KEYPAD);
       chprintf(chp, "New mode: debug\r\n");
       return;
     } else if( !strncmp(argv[0], "err", 3) ) {
-      print_mode = MODE_ERR;
+      print_mode = MODE_ERR | (print_mode & MODE_KEYPAD);
       chprintf(chp, "New mode: err\r\n");
       return;
     } else if( !strncmp(argv[0], "26", 2) ) {
-      print_mode = MODE_26;
+      print_mode = MODE_26 | (print_mode & MODE_KEYPAD);
       chprintf(chp, "New mode: 26\r\n");
       return;
     } else if( !strncmp(argv[0], "34", 2) ) {
-      print_mode = MODE_34;
+      print_mode = MODE_34 | (print_mode & MODE_KEYPAD);
       chprintf(chp, "New mode: 34\r\n");
       return;
+    } else if( !strncmp(argv[0], "ext", 3) ) {
+      print_mode = MODE_EXT | (print_mode & MODE_KEYPAD);
+      chprintf(chp, "New mode: ext\r\n");
+      return;
+    } else if( !strncmp(argv[0], "bin", 3) ) {
+      print_mode = MODE_BIN | (print_mode & MODE_KEYPAD);
+      chprintf(chp, "New mode: bin\r\n");
+      return;
     } else {
       chprintf(chp, "Unknown mode, mode NOT changed\r\n");
       return;
@@ -145,8 +164,13 @@ static void cmd_savemode(BaseSequentialStream *chp, int argc, char *argv[]) {
   }
 
   if(!strncmp(argv[0],"yes",3)) {
-    write_print_mode(print_mode);
-    chprintf(chp, "Mode saved\r\n");    
+    if(write_print_mode(print_mode)) {
+      chprintf(chp, "Mode saved\r\n");
+    } else {
+      chprintf(chp, "Mode NOT saved, flash write failed\r\n");
+    }
+    chprintf(chp, "Settings: %u of %u bytes used, generation %U, %u erases since boot\r\n",
+             cfg_used(), FLASH_PAGE_SIZE, cfg_generation(), cfg_erases());
   } else {
     chprintf(chp, "Mode NOT saved\r\n");    
   }
@@ -159,10 +183,454 @@ static void cmd_version(BaseSequentialStream *chp, int argc, char *argv[]) {
   chprintf(chp, FW_REV_FULLSTRING);
 }
 
+static void cmd_latency(BaseSequentialStream *chp, int argc, char *argv[]) {
+  (void)argv;
+
+  if(argc > 1) {
+    chprintf(chp, "Usage: latency [reset]\r\n");
+    return;
+  }
+
+  if((argc == 1) && !strncmp(argv[0], "reset", 5)) {
+    wieg_latency_last = 0;
+    wieg_latency_max = 0;
+  }
+  /* time from the last bit of a frame until it is being decoded */
+  chprintf(chp, "Frame latency: last %U us, max %U us (frame gap at most %U us)\r\n",
+           WIEG_ST2US(wieg_latency_last), WIEG_ST2US(wieg_latency_max), WIEG_ST2US(WIEG_FRAME_GAP));
+}
+
+static void cmd_queue(BaseSequentialStream *chp, int argc, char *argv[]) {
+  uint8_t i;
+  (void)argv;
+  (void)argc;
+
+  for(i=0; i<WIEG_NUM_READERS; i++) {
+    chprintf(chp, "Reader %u: %u/%u frames queued, %u overruns\r\n", i+1,
+             (uint8_t)(WIEGD[i].queue.head - WIEGD[i].queue.tail), WIEG_QUEUE_SIZE, WIEGD[i].queue.overruns);
+  }
+}
+
+static void cmd_keypad(BaseSequentialStream *chp, int argc, char *argv[]) {
+  (void)argv;
+
+  if((argc == 1) && !strncmp(argv[0], "on", 2)) {
+    print_mode |= MODE_KEYPAD;
+  } else if((argc == 1) && !strncmp(argv[0], "off", 3)) {
+    print_mode &= ~MODE_KEYPAD;
+  } else if(argc != 0) {
+    chprintf(chp, "Usage: keypad [on|off]\r\n");
+    return;
+  }
+  /* card and PIN output together, see MODE_KEYPAD */
+  chprintf(chp, "Keypad: %s (PIN up to %u digits, %U ms timeout)\r\n",
+           (print_mode & MODE_KEYPAD) ? "on" : "off", WIEG_PIN_MAX, WIEG_ST2US(WIEG_PIN_TIMEOUT)/1000);
+}
+
+#if WIEG_SHOULD_RECEIVE
+static void cmd_log(BaseSequentialStream *chp, int argc, char *argv[]) {
+  (void)argv;
+
+  if(argc > 1) {
+    chprintf(chp, "Usage: log [reset]\r\n");
+    return;
+  }
+
+  if((argc == 1) && !strncmp(argv[0], "reset", 5)) {
+    wieg_log_buffered = 0;
+    wieg_log_replayed = 0;
+    wieg_log_lost = 0;
+  }
+  /* frames that could not be output right away */
+  chprintf(chp, "Event log: %u pending, %u buffered, %u replayed, %u lost\r\n",
+           wieg_log_pending(), wieg_log_buffered, wieg_log_replayed, wieg_log_lost);
+}
+
+/*
+ * Frame counters, kept over a soft reset. "stats bin" sends them as one
+ * binary record (see WIEG_STATS_MAGIC_TEXT) for monitoring scripts.
+ */
+static void cmd_stats(BaseSequentialStream *chp, int argc, char *argv[]) {
+  uint8_t rec[WIEG_STATS_MAX_SIZE];
+  const wieg_counters_t *c;
+  uint8_t i;
+
+  if(argc > 1) {
+    chprintf(chp, "Usage: stats [bin|reset]\r\n");
+    return;
+  }
+
+  if((argc == 1) && !strncmp(argv[0], "bin", 3)) {
+    chSequentialStreamWrite(chp, rec, wieg_stats_record(rec));
+    return;
+  }
+  if((argc == 1) && !strncmp(argv[0], "reset", 5)) {
+    wieg_stats_clear();
+  }
+  chprintf(chp, "Counters over %U starts\r\n", wieg_stats.starts);
+  for(i=0; i<WIEG_NUM_READERS; i++) {
+    c = &wieg_stats.reader[i];
+    chprintf(chp, "Reader %u: %U frames, %U bad parity, %U overflows, %U overruns, %U dropped\r\n",
+             i+1, c->frames, c->parity, c->overflows, c->overruns, c->dropped);
+  }
+}
+#endif /* WIEG_SHOULD_RECEIVE */
+
+static void print_hist(BaseSequentialStream *chp, const char *name, const uint16_t *hist) {
+  uint8_t i;
+
+  chprintf(chp, "  %s:", name);
+  for(i=0; i<WIEG_HIST_BUCKETS; i++) {
+    if(hist[i] != 0) {
+      chprintf(chp, " %U+:%u", 1UL<<i, hist[i]);
+    }
+  }
+  chprintf(chp, "\r\n");
+}
+
+static void print_sigstats(BaseSequentialStream *chp, uint8_t reader, const WiegandDriver *wdp) {
+  const wieg_sigstats_t *st = &wdp->sigstats;
+  chprintf(chp, "Reader %u (us bucket:count), %u glitches, %u filtered\r\n", reader, st->glitches, st->filtered);
+  print_hist(chp, "pulse", st->pulse);
+  print_hist(chp, "gap", st->gap);
+  /* learnt timing, see WIEG_GAP_FACTOR */
+  chprintf(chp, "  gap mean %U us, variance %U us^2 (%u samples), frame end after %U us\r\n",
+           wdp->gap_mean >> 4, wdp->gap_var, wdp->gap_samples, WIEG_ST2US(wdp->frame_gap));
+  chprintf(chp, "  %u frames ended at %u bits\r\n", st->early, wdp->close_len);
+  /* edge callback cost, including the filter's re-sample wait */
+  if(st->isr_edges != 0) {
+    chprintf(chp, "  edge callback: avg %U.%U us, max %U us over %U edges\r\n",
+             WIEG_ST2US(st->isr_time) / st->isr_edges, (10 * WIEG_ST2US(st->isr_time) / st->isr_edges) % 10,
+             WIEG_ST2US(st->isr_max), st->isr_edges);
+  }
+}
+
+static void cmd_sigstats(BaseSequentialStream *chp, int argc, char *argv[]) {
+  uint8_t i;
+  (void)argv;
+
+  if(argc > 1) {
+    chprintf(chp, "Usage: sigstats [reset]\r\n");
+    return;
+  }
+
+  for(i=0; i<WIEG_NUM_READERS; i++) {
+    print_sigstats(chp, i+1, &WIEGD[i]);
+  }
+  if((argc == 1) && !strncmp(argv[0], "reset", 5)) {
+    for(i=0; i<WIEG_NUM_READERS; i++) {
+      memset(&WIEGD[i].sigstats, 0, sizeof(WIEGD[i].sigstats));
+    }
+    chprintf(chp, "Statistics reset\r\n");
+  }
+}
+
+#if WIEG_USE_CARDDB
+/*
+ * Card database. Loading (used by cardload.py) replaces it:
+ * cards begin <count>, cards add <id> [flags] in ascending id order,
+ * cards end. Ids (the printed value, up to 64 bits) and flags are hex;
+ * each step answers OK or ERR.
+ */
+static void cmd_cards(BaseSequentialStream *chp, int argc, char *argv[]) {
+  uint64_t id;
+  uint8_t flags;
+  bool ok;
+
+  if(argc == 0) {
+    chprintf(chp, "Card database: %s, %u/%u cards, generation %u\r\n", carddb_valid() ? "valid" : "empty",
+             carddb_count(), CARDDB_CAPACITY, carddb_generation());
+    chprintf(chp, "Journal: %u/%u entries\r\n", carddb_journal_used(), CARDDB_JOURNAL_CAPACITY);
+    chprintf(chp, "Access: %u granted, %u denied\r\n", wieg_access_granted, wieg_access_denied);
+    return;
+  }
+
+  if(!strncmp(argv[0], "check", 5) && (argc == 2)) {
+    id = strtoull(argv[1], NULL, 16);
+    /* chprintf has no 64-bit conversions */
+    chprintf(chp, "%08x%08x: ", (uint32_t)(id >> 32), (uint32_t)id);
+    if(carddb_lookup(id, &flags)) {
+      chprintf(chp, "flags %02x\r\n", flags);
+    } else {
+      chprintf(chp, "not listed\r\n");
+    }
+    return;
+  } else if(!strncmp(argv[0], "begin", 5) && (argc == 2)) {
+    ok = carddb_load_begin(strtoul(argv[1], NULL, 10));
+  } else if(!strncmp(argv[0], "add", 3) && ((argc == 2) || (argc == 3))) {
+    flags = (argc == 3) ? strtoul(argv[2], NULL, 16) : CARDDB_GRANT;
+    ok = carddb_load_add(strtoull(argv[1], NULL, 16), flags);
+  } else if(!strncmp(argv[0], "end", 3) && (argc == 1)) {
+    ok = carddb_load_end();
+  } else if(!strncmp(argv[0], "clear", 5) && (argc == 2) && !strncmp(argv[1], "yes", 3)) {
+    carddb_clear();
+    ok = true;
+  } else {
+    chprintf(chp, "Usage: cards [check <id>|begin <count>|add <id> [flags]|end|clear yes]\r\n");
+    return;
+  }
+  chprintf(chp, ok ? "OK\r\n" : "ERR\r\n");
+}
+
+/*
+ * Delta sync (used by cardload.py): sync begin <generation> <changes>,
+ * then 'changes' times sync add <id> [flags] or sync del <id>, then
+ * sync end. The generation has to be the current one (see 'cards').
+ */
+static void cmd_sync(BaseSequentialStream *chp, int argc, char *argv[]) {
+  uint8_t flags;
+  bool ok;
+
+  if(argc == 0) {
+    chprintf(chp, "%u\r\n", carddb_generation());
+    return;
+  }
+
+  if(!strncmp(argv[0], "begin", 5) && (argc == 3)) {
+    ok = carddb_sync_begin(strtoul(argv[1], NULL, 10), strtoul(argv[2], NULL, 10));
+  } else if(!strncmp(argv[0], "add", 3) && ((argc == 2) || (argc == 3))) {
+    flags = (argc == 3) ? strtoul(argv[2], NULL, 16) : CARDDB_GRANT;
+    ok = carddb_sync_change(strtoull(argv[1], NULL, 16), flags, CARDDB_OP_ADD);
+  } else if(!strncmp(argv[0], "del", 3) && (argc == 2)) {
+    ok = carddb_sync_change(strtoull(argv[1], NULL, 16), 0, CARDDB_OP_DEL);
+  } else if(!strncmp(argv[0], "end", 3) && (argc == 1)) {
+    ok = carddb_sync_end();
+  } else if(!strncmp(argv[0], "compact", 7) && (argc == 1)) {
+    ok = carddb_compact();
+  } else {
+    chprintf(chp, "Usage: sync [begin <generation> <changes>|add <id> [flags]|del <id>|end|compact]\r\n");
+    return;
+  }
+  chprintf(chp, ok ? "OK\r\n" : "ERR\r\n");
+}
+#endif /* WIEG_USE_CARDDB */
+
+/* static, the transmit callbacks use it */
+static wieg_gen_t gen;
+
+static bool key_pressed(BaseSequentialStream *chp) {
+  return chnGetTimeout((BaseChannel *)chp, TIME_IMMEDIATE) != Q_TIMEOUT;
+}
+
+static void cmd_gen(BaseSequentialStream *chp, int argc, char *argv[]) {
+  wieg_frame_t f;
+  uint32_t rate, elapsed;
+  uint8_t reader;
+  int i;
+
+  if(argc < 4) {
+    chprintf(chp, "Usage: gen <reader> <format> <count> <frames/s> [seq <first card>|rand] [fc <facility>] [err <%%>]\r\n");
+    return;
+  }
+  memset(&gen, 0, sizeof(gen));
+  reader = strtoul(argv[0], NULL, 10);
+  gen.format = wieg_format_find(argv[1]);
+  gen.count = strtoul(argv[2], NULL, 10);
+  rate = strtoul(argv[3], NULL, 10);
+  for(i=4; i<argc; i++) {
+    if(!strncmp(argv[i], "rand", 4)) {
+      gen.random = true;
+    } else if(i+1 == argc) {
+      break;
+    } else if(!strncmp(argv[i], "seq", 3)) {
+      gen.card = strtoul(argv[++i], NULL, 10);
+    } else if(!strncmp(argv[i], "fc", 2)) {
+      gen.facility = strtoul(argv[++i], NULL, 10);
+    } else if(!strncmp(argv[i], "err", 3)) {
+      gen.err_pct = strtoul(argv[++i], NULL, 10);
+    } else {
+      break;
+    }
+  }
+  if((i < argc) || (reader < 1) || (reader > WIEG_NUM_READERS) || (gen.format == NULL)
+     || (rate == 0) || (rate > 1000) || (gen.err_pct > 100) || !wieg_encode(&f, gen.format, gen.facility, 0)) {
+    chprintf(chp, "Bad reader, format, rate, facility or option\r\n");
+    return;
+  }
+  if((gen.err_pct != 0) && !wieg_format_has_parity(gen.format)) {
+    chprintf(chp, "Format %s has no parity to get wrong\r\n", gen.format->name);
+    return;
+  }
+  gen.period = 1000000UL / rate;
+  gen.seed = chVTGetSystemTime() | 1;
+
+  chprintf(chp, "Sending %U %s frames on reader %u, any key stops\r\n", gen.count, gen.format->name, reader);
+  while((gen.queued < gen.count) && !key_pressed(chp)) {
+    if(!wieg_gen_step(&WIEGD[reader-1], &gen)) {
+      chThdSleepMilliseconds(1);
+    }
+  }
+  /* the queued ones still go out */
+  while(gen.sent < gen.queued) {
+    chThdSleepMilliseconds(10);
+  }
+
+  chprintf(chp, "Sent %U frames, %U with a parity error\r\n", gen.sent, gen.errors);
+  if(gen.sent > 1) {
+    elapsed = WIEG_ST2US(gen.last - gen.first);
+    rate = (uint32_t)(((uint64_t)(gen.sent - 1) * 100000000ULL) / elapsed);
+    chprintf(chp, "Rate: %U.%02U frames/s (asked %U.%02U)\r\n", rate / 100, rate % 100,
+             100000000UL / gen.period / 100, 100000000UL / gen.period % 100);
+    chprintf(chp, "Period error: avg %U us, max %U us\r\n", gen.dev_sum / (gen.sent - 1), gen.dev_max);
+  }
+}
+
+#if (WIEG_SHOULD_RECEIVE) && WIEG_USE_CAPTURE
+/*
+ * Record the raw edges of a reader for the next frames, then send them
+ * as one binary record (see WIEG_CAP_MAGIC, decoded by wiegcap.py).
+ */
+static void cmd_capture(BaseSequentialStream *chp, int argc, char *argv[]) {
+  const uint8_t *rec;
+  uint16_t len;
+  uint8_t reader;
+
+  if(argc != 2) {
+    chprintf(chp, "Usage: capture <reader> <frames>\r\n");
+    return;
+  }
+  reader = strtoul(argv[0], NULL, 10);
+  if((reader < 1) || !wieg_capture_start(reader-1, strtoul(argv[1], NULL, 10))) {
+    chprintf(chp, "Bad reader or frame count\r\n");
+    return;
+  }
+
+  chprintf(chp, "Capturing reader %u, any key stops\r\n", reader);
+  while(wieg_capture_running() && !key_pressed(chp)) {
+    chThdSleepMilliseconds(10);
+  }
+  wieg_capture_stop();
+
+  rec = wieg_capture_record(&len);
+  chprintf(chp, "Captured %u frames, %u bytes%s\r\n", rec[6] | (rec[7] << 8), len,
+           (rec[5] & WIEG_CAP_FULL) ? " (buffer full)" : "");
+  chSequentialStreamWrite(chp, rec, len);
+}
+#endif /* WIEG_SHOULD_RECEIVE && WIEG_USE_CAPTURE */
+
+#if (WIEG_SHOULD_RECEIVE) && WIEG_USE_PROXY
+static void cmd_proxy(BaseSequentialStream *chp, int argc, char *argv[]) {
+  const wieg_format_t *fmt;
+  uint8_t i;
+
+  if(argc == 0) {
+    chprintf(chp, "Proxy:");
+    for(i=0; i<WIEG_NUM_READERS; i++) {
+      if(wieg_proxy.readers & (1U << i)) {
+        chprintf(chp, " %u->%u", i+1, (i+1) % WIEG_NUM_READERS + 1);
+      }
+    }
+    if(wieg_proxy.readers == 0) {
+      chprintf(chp, " off");
+    }
+    chprintf(chp, ", format %s", (wieg_proxy.format != NULL) ? wieg_proxy.format->name : "kept");
+    if(wieg_proxy.fc_remap) {
+      chprintf(chp, ", facility %U->%U", wieg_proxy.fc_from, wieg_proxy.fc_to);
+    }
+    chprintf(chp, "\r\n%u forwarded, %u invalid, %u unfit, %u dropped\r\n",
+             wieg_proxy.forwarded, wieg_proxy.invalid, wieg_proxy.unfit, wieg_proxy.dropped);
+    /* last input bit to first output bit */
+    chprintf(chp, "Delay: last %U us, max %U us\r\n",
+             WIEG_ST2US(wieg_proxy.delay_last), WIEG_ST2US(wieg_proxy.delay_max));
+    return;
+  }
+
+  if(!strncmp(argv[0], "off", 3) && (argc == 1)) {
+    wieg_proxy.readers = 0;
+  } else if(!strncmp(argv[0], "both", 4) && (argc == 1)) {
+    wieg_proxy.readers = (1U << WIEG_NUM_READERS) - 1;
+  } else if((argv[0][0] >= '1') && (argv[0][0] < '1' + WIEG_NUM_READERS) && (argc == 1)) {
+    wieg_proxy.readers = 1U << (argv[0][0] - '1');
+  } else if(!strncmp(argv[0], "format", 6) && (argc == 2)) {
+    fmt = wieg_format_find(argv[1]);
+    if((fmt == NULL) && strncmp(argv[1], "keep", 4)) {
+      chprintf(chp, "Unknown format\r\n");
+      return;
+    }
+    wieg_proxy.format = fmt;
+  } else if(!strncmp(argv[0], "fc", 2) && (argc == 2) && !strncmp(argv[1], "off", 3)) {
+    wieg_proxy.fc_remap = false;
+  } else if(!strncmp(argv[0], "fc", 2) && (argc == 3)) {
+    wieg_proxy.fc_from = strtoul(argv[1], NULL, 10);
+    wieg_proxy.fc_to = strtoul(argv[2], NULL, 10);
+    wieg_proxy.fc_remap = true;
+  } else if(!strncmp(argv[0], "reset", 5) && (argc == 1)) {
+    wieg_proxy.forwarded = 0;
+    wieg_proxy.invalid = 0;
+    wieg_proxy.unfit = 0;
+    wieg_proxy.dropped = 0;
+    wieg_proxy.delay_last = 0;
+    wieg_proxy.delay_max = 0;
+  } else {
+    chprintf(chp, "Usage: proxy [off|<from reader>|both|format <name|keep>|fc <from> <to>|fc off|reset]\r\n");
+    return;
+  }
+  chprintf(chp, "OK\r\n");
+}
+#endif /* WIEG_SHOULD_RECEIVE && WIEG_USE_PROXY */
+
+#if WIEG_USE_OSDP
+static void cmd_osdp(BaseSequentialStream *chp, int argc, char *argv[]) {
+  const osdp_pd_t *pd;
+  uint8_t i;
+
+  if(argc == 0) {
+    for(i=0; i<OSDP_MAX_PDS; i++) {
+      pd = &osdp_pds[i];
+      if(pd->addr == OSDP_PD_NONE) {
+        chprintf(chp, "%u: off\r\n", i+1);
+        continue;
+      }
+      chprintf(chp, "%u: address %u, reader %u, %s\r\n", i+1, pd->addr, pd->reader+1,
+               pd->online ? "online" : "offline");
+      chprintf(chp, "   %U polls, %u timeouts, %u errors, %u cards, %u keys, %u lost\r\n",
+               pd->polls, pd->timeouts, pd->errors, pd->cards, pd->keys, pd->lost);
+    }
+    return;
+  }
+
+  i = atoi(argv[0]);
+  if((argc == 2) && !strncmp(argv[1], "off", 3)) {
+    if(osdp_set_pd(i-1, OSDP_PD_NONE, 0)) {
+      chprintf(chp, "OK\r\n");
+      return;
+    }
+  } else if(argc == 3) {
+    if(osdp_set_pd(i-1, atoi(argv[1]), atoi(argv[2])-1)) {
+      chprintf(chp, "OK\r\n");
+      return;
+    }
+  }
+  chprintf(chp, "Usage: osdp [<slot> <address> <reader>|<slot> off]\r\n");
+}
+#endif /* WIEG_USE_OSDP */
+
 static const ShellCommand commands[] = {
   {"mode", cmd_mode},
   {"savemode", cmd_savemode},
   {"version", cmd_version},
+  {"latency", cmd_latency},
+  {"queue", cmd_queue},
+  {"keypad", cmd_keypad},
+#if WIEG_SHOULD_RECEIVE
+  {"log", cmd_log},
+  {"stats", cmd_stats},
+#endif
+  {"sigstats", cmd_sigstats},
+  {"gen", cmd_gen},
+#if (WIEG_SHOULD_RECEIVE) && WIEG_USE_CAPTURE
+  {"capture", cmd_capture},
+#endif
+#if (WIEG_SHOULD_RECEIVE) && WIEG_USE_PROXY
+  {"proxy", cmd_proxy},
+#endif
+#if WIEG_USE_OSDP
+  {"osdp", cmd_osdp},
+#endif
+#if WIEG_USE_CARDDB
+  {"cards", cmd_cards},
+  {"sync", cmd_sync},
+#endif
   {NULL, NULL}
 };
 
@@ -247,6 +715,9 @@ int main(void) {
    * Setup things for wiegand
    */
   wieg_init();
+#if WIEG_USE_OSDP
+  osdp_init();
+#endif
 
   /*
    * Initializes a serial-over-USB CDC driver.
@@ -280,7 +751,7 @@ int main(void) {
       // sdWrite(&OUTPUT_CHANNEL, (uint8_t *)"hello world\r\n", 13);
       // chprintf((BaseSequentialStream *)&OUTPUT_CHANNEL, "Hello world\r\n");
       chnPutTimeout(&OUTPUT_CHANNEL, 'W', TIME_IMMEDIATE);
-      // wieg_send(wieg_test_buf, 26);
+      // wieg_send(&WIEGD[0], &wieg_test_buf);
       led_blink = 1;
       chThdSleepMilliseconds(200);
       // chnWrite((BaseChannel *)&OUTPUT_CHANNEL, (uint8_t *)"Hello, world\r\n", 14);
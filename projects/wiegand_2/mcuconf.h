@@ -41,6 +41,7 @@
 #define KINETIS_EXT_PORTC_WIDTH                 12
 #define KINETIS_EXT_PORTD_WIDTH                 8
 #define KINETIS_EXT_PORTE_WIDTH                 2
+#define KINETIS_GPT_USE_PIT0                    TRUE
 
 #endif /* TEENSY */
 
@@ -75,6 +76,7 @@
 #define KINETIS_EXT_PORTC_WIDTH                 8
 #define KINETIS_EXT_PORTD_WIDTH                 8
 #define KINETIS_EXT_PORTE_WIDTH                 0
+#define KINETIS_GPT_USE_PIT0                    TRUE
 
 #endif /* MCHCK */
 
@@ -118,6 +120,7 @@
 #define KINETIS_EXT_PORTC_WIDTH                 4
 #define KINETIS_EXT_PORTD_WIDTH                 8
 #define KINETIS_EXT_PORTE_WIDTH                 0
+#define KINETIS_GPT_USE_PIT0                    TRUE
 
 /*
  * Kinetis FOPT configuration byte
@@ -219,7 +222,7 @@
 #define STM32_GPT_USE_TIM1                  FALSE
 #define STM32_GPT_USE_TIM2                  FALSE
 #define STM32_GPT_USE_TIM3                  FALSE
-#define STM32_GPT_USE_TIM14                 FALSE
+#define STM32_GPT_USE_TIM14                 TRUE
 #define STM32_GPT_TIM1_IRQ_PRIORITY         2
 #define STM32_GPT_TIM2_IRQ_PRIORITY         2
 #define STM32_GPT_TIM3_IRQ_PRIORITY         2
@@ -263,7 +266,7 @@
  * SERIAL driver system settings.
  */
 #define STM32_SERIAL_USE_USART1             FALSE
-#define STM32_SERIAL_USE_USART2             FALSE
+#define STM32_SERIAL_USE_USART2             TRUE
 #define STM32_SERIAL_USART1_PRIORITY        3
 #define STM32_SERIAL_USART2_PRIORITY        3
 
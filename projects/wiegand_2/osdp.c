@@ -0,0 +1,261 @@
+/*
+ * (c) 2016 flabbergast <s3+flabbergast@sdfeu.org>
+ * Licensed under the Apache License, Version 2.0.
+ */
+
+#include "ch.h"
+#include "hal.h"
+
+#include "crc16.h"
+#include "wiegand.h"
+#include "osdp.h"
+
+#if WIEG_USE_OSDP
+
+osdp_pd_t osdp_pds[OSDP_MAX_PDS];
+
+/* The last packet sent or received; only the OSDP thread uses it */
+static uint8_t osdp_buf[OSDP_MAX_PACKET];
+
+static const SerialConfig osdp_sdcfg = {
+  OSDP_BITRATE,
+  OSDP_SD_CR1,
+  0,
+  OSDP_SD_CR3
+};
+
+/*===========================================================================
+ * Packets.
+ *===========================================================================*/
+
+static void osdp_send(const osdp_pd_t *pd, uint8_t cmd, const uint8_t *data, uint8_t len) {
+  uint16_t n = OSDP_HEADER_SIZE + len + 2;
+  uint16_t crc;
+  uint8_t i;
+
+  osdp_buf[0] = OSDP_SOM;
+  osdp_buf[1] = pd->addr;
+  osdp_buf[2] = n & 0xFF;
+  osdp_buf[3] = n >> 8;
+  osdp_buf[4] = pd->sqn | OSDP_CTRL_CRC;
+  osdp_buf[5] = cmd;
+  for(i = 0; i < len; i++)
+    osdp_buf[OSDP_HEADER_SIZE+i] = data[i];
+  crc = crc16_update(OSDP_CRC_INIT, osdp_buf, n - 2);
+  osdp_buf[n-2] = crc & 0xFF;
+  osdp_buf[n-1] = crc >> 8;
+
+  // whatever came in since is stale, a late reply to the last command
+  while(chnGetTimeout(&OSDP_SD, TIME_IMMEDIATE) != Q_TIMEOUT)
+    ;
+  chnWrite(&OSDP_SD, osdp_buf, n);
+}
+
+/*
+ * Wait for the reply of pd to the command just sent, within
+ * OSDP_REPLY_TIMEOUT. Returns the length of its data (in osdp_buf from
+ * OSDP_HEADER_SIZE), -1 on a timeout or a bad reply; bytes before a
+ * start of message are skipped.
+ */
+static int osdp_receive(osdp_pd_t *pd) {
+  systime_t start = chVTGetSystemTimeX();
+  uint16_t i = 0, n = OSDP_HEADER_SIZE;
+  msg_t c;
+
+  while(i < n) {
+    systime_t waited = chVTGetSystemTimeX() - start;
+    if(waited >= OSDP_REPLY_TIMEOUT)
+      break;
+    c = chnGetTimeout(&OSDP_SD, OSDP_REPLY_TIMEOUT - waited);
+    if(c == Q_TIMEOUT)
+      break;
+    if((i == 0) && (c != OSDP_SOM))
+      continue;
+    osdp_buf[i++] = (uint8_t)c;
+    if(i == 4) {
+      n = osdp_buf[2] | (osdp_buf[3] << 8);
+      if((n < OSDP_HEADER_SIZE + 2) || (n > OSDP_MAX_PACKET)) {
+        pd->errors++;
+        return -1;
+      }
+    }
+  }
+  if(i < n) {
+    pd->timeouts++;
+    return -1;
+  }
+
+  if((osdp_buf[1] != (pd->addr | OSDP_REPLY))
+     || ((osdp_buf[4] & (OSDP_CTRL_SQN | OSDP_CTRL_CRC | OSDP_CTRL_SCB)) != (pd->sqn | OSDP_CTRL_CRC))
+     || (crc16_update(OSDP_CRC_INIT, osdp_buf, n - 2) != (osdp_buf[n-2] | (osdp_buf[n-1] << 8)))) {
+    pd->errors++;
+    return -1;
+  }
+  return n - OSDP_HEADER_SIZE - 2;
+}
+
+/*===========================================================================
+ * Replies.
+ *===========================================================================*/
+
+/* osdp_RAW: reader, format, bit count, then the bits MSB-first */
+static void osdp_card(osdp_pd_t *pd, const uint8_t *data, int len) {
+  wieg_frame_t f;
+  uint16_t n;
+  uint8_t i;
+
+  if(len < 4) {
+    pd->errors++;
+    return;
+  }
+  n = data[2] | (data[3] << 8);
+  if((n == 0) || ((n + 7) / 8 > len - 4)) {
+    pd->errors++;
+    return;
+  }
+  if(n > WIEG_BUFFER_SIZE)
+    n = WIEG_BUFFER_SIZE;
+
+  for(i = 0; i < WIEG_BUFFER_WORDS; i++)
+    f.bits[i] = 0;
+  for(i = 0; i < (n + 7) / 8; i++)
+    f.bits[i/4] |= (uint32_t)data[4+i] << (24 - 8*(i%4));
+  f.n = n;
+  f.time = chVTGetSystemTimeX();
+
+  pd->cards++;
+  if(!wieg_input_frame(pd->reader, &f))
+    pd->lost++;
+}
+
+/* osdp_KEYPAD: reader, count, then the keys in ASCII */
+static void osdp_keys(osdp_pd_t *pd, const uint8_t *data, int len) {
+  wieg_frame_t f;
+  uint8_t i, key;
+
+  if((len < 2) || (data[1] > len - 2)) {
+    pd->errors++;
+    return;
+  }
+  for(i = 0; i < data[1]; i++) {
+    key = data[2+i];
+    if((key >= '0') && (key <= '9'))
+      key -= '0';
+    else if((key == '*') || (key == OSDP_KEY_STAR))
+      key = WIEG_KEY_CANCEL;
+    else if((key == '#') || (key == OSDP_KEY_HASH))
+      key = WIEG_KEY_ENTER;
+    else
+      continue;
+    f.bits[0] = (uint32_t)key << 28;
+    f.n = 4;
+    f.time = chVTGetSystemTimeX();
+    pd->keys++;
+    if(!wieg_input_frame(pd->reader, &f))
+      pd->lost++;
+  }
+}
+
+static void osdp_poll_pd(osdp_pd_t *pd) {
+  const uint8_t *data = &osdp_buf[OSDP_HEADER_SIZE];
+  int len;
+
+  osdp_send(pd, OSDP_CMD_POLL, NULL, 0);
+  pd->polls++;
+  len = osdp_receive(pd);
+  if(len < 0) {
+    if(pd->online && ((systime_t)(chVTGetSystemTimeX() - pd->last_reply) >= OSDP_OFFLINE_TIME)) {
+      pd->online = false;
+      pd->sqn = 0;
+    }
+    return;
+  }
+
+  pd->online = true;
+  pd->last_reply = chVTGetSystemTimeX();
+  switch(osdp_buf[5]) {
+  case OSDP_ACK:
+    break;
+  case OSDP_RAW:
+    osdp_card(pd, data, len);
+    break;
+  case OSDP_KEYPAD:
+    osdp_keys(pd, data, len);
+    break;
+  case OSDP_BUSY:
+    // same command again, with the same sequence number
+    return;
+  case OSDP_NAK:
+    pd->errors++;
+    if((len > 0) && (data[0] == OSDP_NAK_SQN)) {
+      pd->sqn = 0;
+      return;
+    }
+    break;
+  default:
+    pd->errors++;
+    break;
+  }
+  pd->sqn = (pd->sqn % 3) + 1;
+}
+
+/*===========================================================================
+ * Polling.
+ *===========================================================================*/
+
+/* One round: each PD in turn */
+void osdp_poll(void) {
+  uint8_t i;
+
+  for(i = 0; i < OSDP_MAX_PDS; i++) {
+    if(osdp_pds[i].addr != OSDP_PD_NONE)
+      osdp_poll_pd(&osdp_pds[i]);
+  }
+}
+
+/*
+ * Set the PD in a slot (addr OSDP_PD_NONE frees it); it starts over,
+ * offline and at sequence number 0.
+ */
+bool osdp_set_pd(uint8_t slot, uint8_t addr, uint8_t reader) {
+  osdp_pd_t *pd;
+
+  if((slot >= OSDP_MAX_PDS) || (reader >= WIEG_NUM_READERS)
+     || ((addr > OSDP_ADDR_MAX) && (addr != OSDP_PD_NONE)))
+    return false;
+  pd = &osdp_pds[slot];
+  chSysLock();
+  pd->addr = addr;
+  pd->reader = reader;
+  pd->sqn = 0;
+  pd->online = false;
+  pd->polls = 0;
+  pd->timeouts = pd->errors = pd->cards = pd->keys = pd->lost = 0;
+  chSysUnlock();
+  return true;
+}
+
+static THD_WORKING_AREA(waOsdpThr, 256);
+static THD_FUNCTION(OsdpThr, arg) {
+  (void)arg;
+  chRegSetThreadName("osdp");
+
+  while(true) {
+    osdp_poll();
+    chThdSleep(OSDP_POLL_INTERVAL);
+  }
+}
+
+void osdp_init(void) {
+  uint8_t i;
+
+  for(i = 0; i < OSDP_MAX_PDS; i++)
+    osdp_pds[i].addr = OSDP_PD_NONE;
+  palSetPadMode(OSDP_TX_GPIO, OSDP_TX_PIN, OSDP_PINS_MODE);
+  palSetPadMode(OSDP_RX_GPIO, OSDP_RX_PIN, OSDP_PINS_MODE);
+  palSetPadMode(OSDP_DE_GPIO, OSDP_DE_PIN, OSDP_PINS_MODE);
+  sdStart(&OSDP_SD, &osdp_sdcfg);
+  chThdCreateStatic(waOsdpThr, sizeof(waOsdpThr), NORMALPRIO+1, OsdpThr, NULL);
+}
+
+#endif /* WIEG_USE_OSDP */
@@ -0,0 +1,89 @@
+/*
+ * (c) 2016 flabbergast <s3+flabbergast@sdfeu.org>
+ * Licensed under the Apache License, Version 2.0.
+ */
+
+#ifndef _OSDP_H_
+#define _OSDP_H_
+
+/*
+ * OSDP (Open Supervised Device Protocol), control panel side, on the
+ * RS-485 line at OSDP_SD (see wiegand.h). The readers (PDs) are polled
+ * in turn; their card reads (osdp_RAW) and key presses (osdp_KEYPAD) go
+ * through the Wiegand receive path as frames of the reader each PD
+ * stands in for, see wieg_input_frame(). Keys become 4-bit keypad frames
+ * (see MODE_KEYPAD).
+ *
+ * Packet, multi-byte fields little endian:
+ *
+ *   OSDP_SOM
+ *   address (| OSDP_REPLY in replies)
+ *   length of the whole packet (2 bytes)
+ *   control: sequence number, OSDP_CTRL_CRC
+ *   command or reply code
+ *   data
+ *   CRC-16/AUG-CCITT (OSDP_CRC_INIT) of all of the above (2 bytes)
+ *
+ * There is no secure channel. A PD's sequence number is 0 to start over,
+ * then 1, 2, 3, 1, ...; it only moves on after a valid reply, so a PD
+ * whose reply was lost sends it again. A PD is offline after
+ * OSDP_OFFLINE_TIME without a valid reply, and starts over at 0.
+ */
+#define OSDP_SOM             0x53
+#define OSDP_REPLY           0x80
+#define OSDP_ADDR_MAX        0x7E
+#define OSDP_CTRL_SQN        0x03
+#define OSDP_CTRL_CRC        0x04
+#define OSDP_CTRL_SCB        0x08
+#define OSDP_CRC_INIT        0x1D0F
+#define OSDP_HEADER_SIZE     6     /* up to the command or reply code */
+#define OSDP_MAX_PACKET      64
+
+/* Commands */
+#define OSDP_CMD_POLL        0x60
+
+/* Replies */
+#define OSDP_ACK             0x40
+#define OSDP_NAK             0x41
+#define OSDP_RAW             0x50
+#define OSDP_KEYPAD          0x53
+#define OSDP_BUSY            0x79
+
+/* NAK reason: the PD did not expect this sequence number */
+#define OSDP_NAK_SQN         0x04
+
+/* Keys sent for '*' and '#' (also as ASCII) */
+#define OSDP_KEY_STAR        0x7F
+#define OSDP_KEY_HASH        0x0D
+
+/* Line timing: bit rate, reply deadline, pause between polling rounds */
+#define OSDP_BITRATE         9600
+#define OSDP_REPLY_TIMEOUT   (MS2ST(200))
+#define OSDP_POLL_INTERVAL   (MS2ST(50))
+#define OSDP_OFFLINE_TIME    (WIEG_US2ST(8000000UL))
+
+/* PDs on the line */
+#define OSDP_MAX_PDS         2
+#define OSDP_PD_NONE         0xFF
+
+typedef struct {
+  uint8_t addr;        /* OSDP_PD_NONE: slot not used */
+  uint8_t reader;      /* its reads come as this reader (index in WIEGD[]) */
+  uint8_t sqn;         /* of the next command */
+  bool online;
+  systime_t last_reply;
+  uint32_t polls;
+  uint16_t timeouts;
+  uint16_t errors;     /* bad replies and NAKs */
+  uint16_t cards;
+  uint16_t keys;
+  uint16_t lost;       /* reads the receive queue did not take */
+} osdp_pd_t;
+
+extern osdp_pd_t osdp_pds[OSDP_MAX_PDS];
+
+void osdp_init(void);
+bool osdp_set_pd(uint8_t slot, uint8_t addr, uint8_t reader);
+void osdp_poll(void);
+
+#endif /* _OSDP_H_ */
@@ -0,0 +1,91 @@
+/*
+ * (c) 2016 flabbergast <s3+flabbergast@sdfeu.org>
+ * Licensed under the Apache License, Version 2.0.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <setjmp.h>
+
+#include "hal.h"
+
+/* Simulated time in us; system time is its lower 32 bits */
+extern uint64_t sim_now;
+
+/* Events signalled to the receive thread and not handled yet */
+extern eventmask_t sim_events;
+
+/* Everything written to any channel */
+#define SIM_OUT_SIZE 4096
+extern uint8_t sim_out[SIM_OUT_SIZE];
+extern size_t sim_out_len;
+extern uint32_t sim_out_writes;
+
+void sim_set_pad(ioportid_t port, uint8_t pad, uint8_t level);
+
+/* Called for pad writes by the code under test (the transmitter), if set */
+extern void (*sim_pad_output)(ioportid_t port, uint8_t pad, uint8_t level);
+
+/*
+ * Time goes on by 1 us per system time read inside an edge callback, so
+ * busy waits end; pads read then get the level at that time from this
+ * hook (given the current level), if set.
+ */
+extern uint8_t (*sim_pad_lookahead)(ioportid_t port, uint8_t pad, uint64_t t, uint8_t level);
+void sim_ext_edge(expchannel_t channel);
+bool sim_next_timer(uint64_t until);
+
+/*
+ * Called when a thread makes another ready (wieg_input_frame()), so the
+ * receive code runs right away as on the device, if set
+ */
+extern void (*sim_reschedule)(void);
+
+/*
+ * Flash (sim_flash.c): latency of a page erase and of programming a
+ * halfword in simulated us (F042 typical by default), and what was
+ * done since the start.
+ */
+#define SIM_FLASH_ERASE_US   20000
+#define SIM_FLASH_PROGRAM_US 40
+
+typedef struct {
+  uint32_t erase_us;
+  uint32_t program_us;
+  uint32_t erases;
+  uint32_t programs;   /* halfwords */
+  uint32_t errors;     /* operations that failed */
+  uint64_t busy_us;
+  uint32_t cuts;       /* power cuts */
+  uint32_t cut_erases; /* ... of those, in an erase */
+  uint32_t fails;      /* halfwords failed on purpose */
+} sim_flash_t;
+
+extern sim_flash_t sim_flash;
+
+/*
+ * Called after each erase and halfword, if set: edge interrupts wait
+ * for the flash (code fetches stall), not for the code programming it.
+ */
+extern void (*sim_flash_done)(void);
+
+/*
+ * Power cut: the sim_flash_cut_in'th erase or halfword from now (0:
+ * none) is left half done, then sim_flash_cut is jumped to, where the
+ * simulator carries on as after a reset.
+ */
+extern uint32_t sim_flash_cut_in;
+extern jmp_buf sim_flash_cut;
+
+/*
+ * Worn out cell: the sim_flash_fail_in'th halfword programmed from now
+ * (0: none) is left as it was and fails (PGERR).
+ */
+extern uint32_t sim_flash_fail_in;
+
+bool sim_flash_open(const char *path, uint32_t base, uint32_t size, uint32_t page);
+void sim_flash_close(void);
+uint32_t sim_flash_wear_count(uint32_t addr);
+
+#endif /* SIM_H */
@@ -0,0 +1,255 @@
+/*
+ * (c) 2016 flabbergast <s3+flabbergast@sdfeu.org>
+ * Licensed under the Apache License, Version 2.0.
+ */
+
+/*
+ * Host implementation of flash.h: a NOR flash of sim_flash_open()'s
+ * size and page size at its base address, mmap'd from a file (or
+ * anonymous memory) followed by an erase counter (uint32_t) per page,
+ * so that wear adds up over runs kept in the same file. It is mapped
+ * at the base address itself, as code that reads the flash through
+ * pointers (carddb.c) expects.
+ *
+ * As on the F0: an erase sets the page holding the address to 0xFF,
+ * programming is by halfwords and can only clear bits; programming a
+ * halfword that is not erased fails (PGERR) and leaves it alone, but
+ * for 0x0000 which always goes in. Erasing or programming while the
+ * flash is locked or outside of it fails (WRPRTERR). Each erase and
+ * each halfword moves the simulated time on by its latency (then
+ * sim_flash_done runs), and every error is counted in sim_flash.errors
+ * (there should be none).
+ *
+ * A power cut (sim_flash_cut_in) leaves the operation it hits half
+ * done: a page erase sets random bits of the page, programming clears
+ * random bits of those the halfword was to clear. The flash is locked
+ * again (as at a reset) and the code longjmp()s to sim_flash_cut.
+ * A halfword can also be made to fail (sim_flash_fail_in), which is
+ * counted in sim_flash.fails rather than as an error.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "flash.h"
+#include "sim.h"
+
+sim_flash_t sim_flash = {SIM_FLASH_ERASE_US, SIM_FLASH_PROGRAM_US, 0, 0, 0, 0, 0, 0, 0};
+void (*sim_flash_done)(void) = NULL;
+uint32_t sim_flash_cut_in = 0;
+jmp_buf sim_flash_cut;
+uint32_t sim_flash_fail_in = 0;
+
+static uint8_t *sim_flash_mem = NULL;
+static uint32_t *sim_flash_wear;
+static uint32_t sim_flash_base, sim_flash_size, sim_flash_page;
+static size_t sim_flash_map_size;
+static bool sim_flash_locked = true;
+
+/*===========================================================================
+ * Setup.
+ *===========================================================================*/
+
+/*
+ * Map size bytes of flash (a multiple of page) at base, kept in path
+ * or, if NULL, in memory. A new file (or one of another size) starts
+ * erased, with its counters at 0. Returns false on an error, errno set.
+ */
+bool sim_flash_open(const char *path, uint32_t base, uint32_t size, uint32_t page) {
+  size_t map_size = size + (size / page) * sizeof(uint32_t);
+  struct stat st;
+  bool fresh = true;
+  void *p;
+  int fd;
+
+  sim_flash_close();
+  if(path == NULL) {
+    p = mmap((void *)(uintptr_t)base, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  } else {
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0)
+      return false;
+    if((fstat(fd, &st) == 0) && ((size_t)st.st_size == map_size))
+      fresh = false;
+    if(fresh && (ftruncate(fd, map_size) != 0)) {
+      close(fd);
+      return false;
+    }
+    p = mmap((void *)(uintptr_t)base, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+  }
+  if(p == MAP_FAILED)
+    return false;
+  if(p != (void *)(uintptr_t)base) {
+    munmap(p, map_size);
+    errno = EADDRINUSE;
+    return false;
+  }
+
+  sim_flash_mem = p;
+  sim_flash_wear = (uint32_t *)(sim_flash_mem + size);
+  sim_flash_base = base;
+  sim_flash_size = size;
+  sim_flash_page = page;
+  sim_flash_map_size = map_size;
+  sim_flash_locked = true;
+  if(fresh) {
+    memset(sim_flash_mem, 0xFF, size);
+    memset(sim_flash_wear, 0, map_size - size);
+  }
+  return true;
+}
+
+void sim_flash_close(void) {
+  if(sim_flash_mem != NULL) {
+    munmap(sim_flash_mem, sim_flash_map_size);
+    sim_flash_mem = NULL;
+  }
+}
+
+/* Counts an operation towards a power cut, true if it is the one cut */
+static bool sim_flash_cutting(void) {
+  if((sim_flash_cut_in == 0) || (--sim_flash_cut_in != 0))
+    return false;
+  sim_flash_locked = true;
+  sim_flash.cuts++;
+  return true;
+}
+
+/* Counts a halfword towards a failure, true if it is the one failing */
+static bool sim_flash_failing(void) {
+  if((sim_flash_fail_in == 0) || (--sim_flash_fail_in != 0))
+    return false;
+  sim_flash.fails++;
+  return true;
+}
+
+/* Erases of the page holding addr, 0 if it is not in the flash */
+uint32_t sim_flash_wear_count(uint32_t addr) {
+  if((sim_flash_mem == NULL) || (addr < sim_flash_base) || (addr - sim_flash_base >= sim_flash_size))
+    return 0;
+  return sim_flash_wear[(addr - sim_flash_base) / sim_flash_page];
+}
+
+/*===========================================================================
+ * flash.h.
+ *===========================================================================*/
+
+/* Offset of len bytes at addr in the flash, -1 if they are not all in it */
+static int32_t sim_flash_offset(uint32_t addr, uint32_t len) {
+  if((sim_flash_mem == NULL) || (addr < sim_flash_base) || (addr - sim_flash_base + len > sim_flash_size))
+    return -1;
+  return addr - sim_flash_base;
+}
+
+static flash_status_t sim_flash_error(flash_status_t st, const char *what, uint32_t addr) {
+  sim_flash.errors++;
+  if(sim_flash.errors <= 10) {
+    fprintf(stderr, "flash: %s at 0x%08x%s\n", what, addr, sim_flash_locked ? " (locked)" : "");
+  }
+  return st;
+}
+
+void flash_unlock(void) {
+  sim_flash_locked = false;
+}
+
+void flash_lock(void) {
+  sim_flash_locked = true;
+}
+
+flash_status_t flash_erasepage(uint32_t page_addr) {
+  int32_t off = sim_flash_offset(page_addr, 1);
+  uint32_t i;
+
+  if(sim_flash_locked || (off < 0))
+    return sim_flash_error(FLASH_ERR_WRP, "erase", page_addr);
+  off -= off % sim_flash_page;
+  sim_flash_wear[off / sim_flash_page]++;
+  if(sim_flash_cutting()) {
+    sim_flash.cut_erases++;
+    for(i=0; i<sim_flash_page; i++)
+      sim_flash_mem[off + i] |= rand();
+    longjmp(sim_flash_cut, 1);
+  }
+  memset(&sim_flash_mem[off], 0xFF, sim_flash_page);
+  sim_flash.erases++;
+  sim_flash.busy_us += sim_flash.erase_us;
+  sim_now += sim_flash.erase_us;
+  if(sim_flash_done != NULL)
+    sim_flash_done();
+  return FLASH_OK;
+}
+
+flash_status_t flash_write16(uint32_t flash_addr, uint16_t data) {
+  int32_t off = sim_flash_offset(flash_addr, 2);
+  uint16_t h;
+
+  if(sim_flash_locked || (off < 0))
+    return sim_flash_error(FLASH_ERR_WRP, "program", flash_addr);
+  if((flash_addr & 1) != 0)
+    return sim_flash_error(FLASH_ERR_PROG, "unaligned program", flash_addr);
+  sim_flash.programs++;
+  sim_flash.busy_us += sim_flash.program_us;
+  sim_now += sim_flash.program_us;
+  if(sim_flash_done != NULL)
+    sim_flash_done();
+  if(sim_flash_failing())
+    return FLASH_ERR_PROG;
+  memcpy(&h, &sim_flash_mem[off], 2);
+  if((h != 0xFFFF) && (data != 0x0000))
+    return sim_flash_error(FLASH_ERR_PROG, "program of a non-erased halfword", flash_addr);
+  if(sim_flash_cutting()) {
+    h &= data | (uint16_t)rand();
+    memcpy(&sim_flash_mem[off], &h, 2);
+    longjmp(sim_flash_cut, 1);
+  }
+  h &= data;
+  memcpy(&sim_flash_mem[off], &h, 2);
+  return FLASH_OK;
+}
+
+flash_status_t flash_write_buf(uint32_t flash_addr, const void *src, size_t len, bool verify) {
+  const uint8_t *p = src;
+  uint32_t a, end = flash_addr + len;
+  flash_status_t st = FLASH_OK;
+  uint16_t h;
+  size_t i;
+
+  for(a = flash_addr & ~1UL; (a < end) && (st == FLASH_OK); a += 2) {
+    h = 0xFFFF;
+    if(a >= flash_addr)
+      h = (h & 0xFF00) | p[a - flash_addr];
+    if(a + 1 < end)
+      h = (h & 0x00FF) | (p[a + 1 - flash_addr] << 8);
+    st = flash_write16(a, h);
+  }
+  if(verify && (st == FLASH_OK)) {
+    for(i = 0; i < len; i++) {
+      if(sim_flash_mem[flash_addr - sim_flash_base + i] != p[i])
+        return FLASH_ERR_VERIFY;
+    }
+  }
+  return st;
+}
+
+/* Outside of the flash (code) reads as erased */
+uint16_t flash_read16(uint32_t addr) {
+  int32_t off = sim_flash_offset(addr, 2);
+  uint16_t h;
+
+  if(off < 0)
+    return 0xFFFF;
+  memcpy(&h, &sim_flash_mem[off], 2);
+  return h;
+}
@@ -0,0 +1,284 @@
+/*
+ * (c) 2016 flabbergast <s3+flabbergast@sdfeu.org>
+ * Licensed under the Apache License, Version 2.0.
+ */
+
+/*
+ * Host implementation of the kernel and HAL stubs: time only moves when
+ * the simulator says so, virtual timers fire from sim_next_timer() and
+ * signalled events are collected in sim_events for the simulator to
+ * hand to the receive code. SD2 is a file descriptor set by the
+ * simulator; waiting on it moves the time on by the real time waited.
+ */
+
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "usbcfg.h"
+#include "sim.h"
+
+uint64_t sim_now = 0;
+eventmask_t sim_events = 0;
+
+uint8_t sim_out[SIM_OUT_SIZE];
+size_t sim_out_len = 0;
+uint32_t sim_out_writes = 0;
+
+GPIO_TypeDef sim_gpio[6] = {{0}, {1}, {2}, {3}, {4}, {5}};
+EXTDriver EXTD1;
+GPTDriver GPTD14;
+/* The host is connected, and has the port open unless the simulator
+ * closes it */
+static USBDriver USBD1 = {USB_ACTIVE};
+volatile bool usb_port_open = true;
+static const SerialUSBConfig sim_serusbcfg = {&USBD1};
+SerialUSBDriver SDU1 = {&sim_serusbcfg};
+SerialDriver SD2 = {-1};
+
+/*===========================================================================
+ * Kernel.
+ *===========================================================================*/
+
+#define SIM_MAX_TIMERS 16
+
+static virtual_timer_t *sim_timers[SIM_MAX_TIMERS];
+static uint8_t sim_timer_count = 0;
+
+/* us spent in the current edge callback, see sim.h */
+static bool sim_in_isr = false;
+static uint32_t sim_isr_time;
+
+uint8_t (*sim_pad_lookahead)(ioportid_t port, uint8_t pad, uint64_t t, uint8_t level) = NULL;
+void (*sim_pad_output)(ioportid_t port, uint8_t pad, uint8_t level) = NULL;
+void (*sim_reschedule)(void) = NULL;
+
+systime_t chVTGetSystemTimeX(void) {
+  if(sim_in_isr)
+    return (systime_t)(sim_now + sim_isr_time++);
+  return (systime_t)sim_now;
+}
+
+void chVTObjectInit(virtual_timer_t *vtp) {
+  vtp->armed = false;
+  if(sim_timer_count < SIM_MAX_TIMERS) {
+    sim_timers[sim_timer_count++] = vtp;
+  }
+}
+
+void chVTSetI(virtual_timer_t *vtp, systime_t delay, vtfunc_t vtfunc, void *par) {
+  vtp->deadline = sim_now + delay;
+  vtp->func = vtfunc;
+  vtp->par = par;
+  vtp->armed = true;
+}
+
+void chVTResetI(virtual_timer_t *vtp) {
+  vtp->armed = false;
+}
+
+/*
+ * Fire the earliest timer due at or before 'until', moving the time to
+ * its deadline. Returns false if there is none.
+ */
+bool sim_next_timer(uint64_t until) {
+  virtual_timer_t *next = NULL;
+  uint8_t i;
+
+  for(i=0; i<sim_timer_count; i++) {
+    if(sim_timers[i]->armed && (sim_timers[i]->deadline <= until)
+       && ((next == NULL) || (sim_timers[i]->deadline < next->deadline))) {
+      next = sim_timers[i];
+    }
+  }
+  if(next == NULL)
+    return false;
+  /* a timer that was due during a flash operation fires late */
+  if(next->deadline > sim_now)
+    sim_now = next->deadline;
+  next->armed = false;
+  next->func(next->par);
+  return true;
+}
+
+void chEvtSignalI(thread_t *tp, eventmask_t events) {
+  (void)tp;
+  sim_events |= events;
+}
+
+eventmask_t chEvtWaitAny(eventmask_t events) {
+  eventmask_t e = sim_events & events;
+  sim_events &= ~e;
+  return e;
+}
+
+eventmask_t chEvtWaitAnyTimeout(eventmask_t events, systime_t time) {
+  (void)time;
+  return chEvtWaitAny(events);
+}
+
+/* Threads never run, the simulator calls their bodies */
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, void (*pf)(void *), void *arg) {
+  (void)size;
+  (void)prio;
+  (void)pf;
+  (void)arg;
+  return (thread_t *)wsp;
+}
+
+void chThdSleep(systime_t time) {
+  sim_now += time;
+}
+
+void chSchRescheduleS(void) {
+  if(sim_reschedule != NULL)
+    sim_reschedule();
+}
+
+void chBSemObjectInit(binary_semaphore_t *bsp, bool taken) {
+  bsp->taken = taken;
+}
+
+void chBSemSignalI(binary_semaphore_t *bsp) {
+  bsp->taken = false;
+}
+
+msg_t chBSemWait(binary_semaphore_t *bsp) {
+  bsp->taken = true;
+  return 0;
+}
+
+/*===========================================================================
+ * HAL.
+ *===========================================================================*/
+
+static uint16_t sim_pads_low[6];
+
+uint8_t palReadPad(ioportid_t port, uint8_t pad) {
+  uint8_t level = (sim_pads_low[port->id] & (1U << pad)) ? PAL_LOW : PAL_HIGH;
+  if(sim_in_isr && (sim_pad_lookahead != NULL))
+    level = sim_pad_lookahead(port, pad, sim_now + sim_isr_time, level);
+  return level;
+}
+
+void sim_set_pad(ioportid_t port, uint8_t pad, uint8_t level) {
+  if(level == PAL_LOW) {
+    sim_pads_low[port->id] |= 1U << pad;
+  } else {
+    sim_pads_low[port->id] &= ~(1U << pad);
+  }
+}
+
+void palSetPad(ioportid_t port, uint8_t pad) {
+  if(sim_pad_output != NULL)
+    sim_pad_output(port, pad, PAL_HIGH);
+  sim_set_pad(port, pad, PAL_HIGH);
+}
+
+void palClearPad(ioportid_t port, uint8_t pad) {
+  if(sim_pad_output != NULL)
+    sim_pad_output(port, pad, PAL_LOW);
+  sim_set_pad(port, pad, PAL_LOW);
+}
+
+void extStart(EXTDriver *extp, const EXTConfig *config) {
+  uint8_t i;
+  extp->config = config;
+  extp->enabled = 0;
+  for(i=0; i<EXT_MAX_CHANNELS; i++) {
+    if(config->channels[i].mode & EXT_CH_MODE_AUTOSTART) {
+      extp->enabled |= 1UL << i;
+    }
+  }
+}
+
+void extChannelEnableI(EXTDriver *extp, expchannel_t channel) {
+  extp->enabled |= 1UL << channel;
+}
+
+void extChannelDisableI(EXTDriver *extp, expchannel_t channel) {
+  extp->enabled &= ~(1UL << channel);
+}
+
+/* An edge on an EXT line, the pad level has to be set before */
+void sim_ext_edge(expchannel_t channel) {
+  if((EXTD1.config != NULL) && (EXTD1.enabled & (1UL << channel))
+     && (EXTD1.config->channels[channel].cb != NULL)) {
+    sim_in_isr = true;
+    sim_isr_time = 0;
+    EXTD1.config->channels[channel].cb(&EXTD1, channel);
+    sim_in_isr = false;
+  }
+}
+
+static virtual_timer_t sim_gpt_vt;
+
+static void sim_gpt_fire(void *arg) {
+  GPTDriver *gptp = arg;
+  gptp->config->callback(gptp);
+}
+
+void gptStart(GPTDriver *gptp, const GPTConfig *config) {
+  gptp->config = config;
+  chVTObjectInit(&sim_gpt_vt);
+}
+
+void gptStartOneShotI(GPTDriver *gptp, gptcnt_t interval) {
+  chVTSetI(&sim_gpt_vt, (systime_t)((uint64_t)interval * 1000000 / gptp->config->frequency), sim_gpt_fire, gptp);
+}
+
+void sdStart(SerialDriver *sdp, const SerialConfig *config) {
+  (void)sdp;
+  (void)config;
+}
+
+/*
+ * Real time waited on SD2 is capped at SIM_SD_WAIT_MS: a reply that
+ * does not come takes the whole timeout in system time, not in host time
+ */
+#define SIM_SD_WAIT_MS 20
+
+msg_t chnGetTimeout(void *chn, systime_t time) {
+  struct pollfd pfd = {((SerialDriver *)chn)->fd, POLLIN, 0};
+  struct timespec t0, t1;
+  uint64_t waited;
+  uint8_t b;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if((pfd.fd < 0) || (poll(&pfd, 1, (time == TIME_IMMEDIATE) ? 0 : SIM_SD_WAIT_MS) != 1)
+     || (read(pfd.fd, &b, 1) != 1)) {
+    sim_now += time;
+    return Q_TIMEOUT;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  waited = (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+  sim_now += (waited < time) ? waited : time;
+  return b;
+}
+
+msg_t chnPutTimeout(void *chn, uint8_t b, systime_t time) {
+  (void)chn;
+  (void)time;
+  sim_out_writes++;
+  if(sim_out_len >= SIM_OUT_SIZE)
+    return MSG_TIMEOUT;
+  sim_out[sim_out_len++] = b;
+  return MSG_OK;
+}
+
+size_t chnWriteTimeout(void *chn, const uint8_t *bp, size_t n, systime_t time) {
+  (void)time;
+  if(chn == &SD2)
+    return (write(SD2.fd, bp, n) == (ssize_t)n) ? n : 0;
+  sim_out_writes++;
+  if(n > SIM_OUT_SIZE - sim_out_len) {
+    n = SIM_OUT_SIZE - sim_out_len;
+  }
+  memcpy(&sim_out[sim_out_len], bp, n);
+  sim_out_len += n;
+  return n;
+}
@@ -0,0 +1,93 @@
+/*
+ * (c) 2016 flabbergast <s3+flabbergast@sdfeu.org>
+ * Licensed under the Apache License, Version 2.0.
+ */
+
+/*
+ * Host stand-in for the parts of the ChibiOS kernel API used by
+ * wiegand.c, see sim_hal.c. System time is 1 MHz, as on the F042.
+ */
+
+#ifndef CH_H
+#define CH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TRUE  1
+#define FALSE 0
+
+#define CH_CFG_ST_FREQUENCY 1000000
+
+typedef uint32_t systime_t;
+typedef int32_t msg_t;
+typedef uint32_t eventmask_t;
+typedef uint8_t tprio_t;
+typedef struct thread thread_t;
+typedef void (*vtfunc_t)(void *par);
+
+typedef struct {
+  uint64_t deadline;   /* in sim time, not wrapped */
+  vtfunc_t func;
+  void *par;
+  bool armed;
+} virtual_timer_t;
+
+typedef struct {
+  bool taken;
+} binary_semaphore_t;
+
+/* Only taken by code the simulator runs from one thread */
+typedef struct {
+  bool locked;
+} mutex_t;
+
+#define NORMALPRIO      64
+#define ALL_EVENTS      ((eventmask_t)-1)
+#define EVENT_MASK(eid) ((eventmask_t)1 << (eventmask_t)(eid))
+#define TIME_IMMEDIATE  ((systime_t)0)
+#define TIME_INFINITE   ((systime_t)-1)
+#define MSG_OK          ((msg_t)0)
+#define MSG_TIMEOUT     ((msg_t)-1)
+#define Q_TIMEOUT       MSG_TIMEOUT
+
+#define US2ST(usec) ((systime_t)(usec))
+#define MS2ST(msec) ((systime_t)((msec) * 1000UL))
+
+#define THD_WORKING_AREA(s, n) uint8_t s[n]
+#define THD_FUNCTION(tname, arg) void tname(void *arg)
+
+#define osalSysLock()
+#define osalSysUnlock()
+#define osalSysLockFromISR()
+#define osalSysUnlockFromISR()
+#define chSysLock()
+#define chSysUnlock()
+
+/* Runs the simulator's receive code, see sim_reschedule */
+void chSchRescheduleS(void);
+
+systime_t chVTGetSystemTimeX(void);
+#define chVTGetSystemTime() chVTGetSystemTimeX()
+void chVTObjectInit(virtual_timer_t *vtp);
+void chVTSetI(virtual_timer_t *vtp, systime_t delay, vtfunc_t vtfunc, void *par);
+void chVTResetI(virtual_timer_t *vtp);
+
+void chEvtSignalI(thread_t *tp, eventmask_t events);
+eventmask_t chEvtWaitAny(eventmask_t events);
+eventmask_t chEvtWaitAnyTimeout(eventmask_t events, systime_t time);
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, void (*pf)(void *), void *arg);
+#define chRegSetThreadName(name) ((void)(name))
+void chThdSleep(systime_t time);
+
+void chBSemObjectInit(binary_semaphore_t *bsp, bool taken);
+void chBSemSignalI(binary_semaphore_t *bsp);
+msg_t chBSemWait(binary_semaphore_t *bsp);
+
+#define MUTEX_DECL(name) mutex_t name = {false}
+#define chMtxLock(mp) ((mp)->locked = true)
+#define chMtxUnlock(mp) ((mp)->locked = false)
+
+#endif /* CH_H */
@@ -0,0 +1,150 @@
+/*
+ * (c) 2016 flabbergast <s3+flabbergast@sdfeu.org>
+ * Licensed under the Apache License, Version 2.0.
+ */
+
+/*
+ * Host stand-in for the parts of the ChibiOS HAL used by wiegand.c,
+ * see sim_hal.c. Pads are plain levels set by the simulator.
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+#include "ch.h"
+
+/* PAL */
+typedef struct {
+  uint8_t id;
+} GPIO_TypeDef;
+
+typedef GPIO_TypeDef *ioportid_t;
+typedef uint32_t iomode_t;
+
+extern GPIO_TypeDef sim_gpio[6];
+#define GPIOA (&sim_gpio[0])
+#define GPIOB (&sim_gpio[1])
+#define GPIOF (&sim_gpio[5])
+
+#define PAL_LOW  0
+#define PAL_HIGH 1
+
+#define PAL_MODE_INPUT            1
+#define PAL_MODE_INPUT_PULLUP     2
+#define PAL_MODE_OUTPUT_PUSHPULL  3
+#define PAL_MODE_OUTPUT_OPENDRAIN 4
+#define PAL_MODE_ALTERNATE(n)     (0x100 | (n))
+
+#define GPIOA_PIN1 1U
+#define GPIOA_PIN2 2U
+#define GPIOA_PIN3 3U
+#define GPIOA_PIN7 7U
+
+uint8_t palReadPad(ioportid_t port, uint8_t pad);
+void palSetPad(ioportid_t port, uint8_t pad);
+void palClearPad(ioportid_t port, uint8_t pad);
+#define palSetPadMode(port, pad, mode) do { (void)(port); (void)(pad); (void)(mode); } while(0)
+
+/* EXT */
+typedef uint32_t expchannel_t;
+typedef struct EXTDriver EXTDriver;
+typedef void (*extcallback_t)(EXTDriver *extp, expchannel_t channel);
+
+typedef struct {
+  uint32_t mode;
+  extcallback_t cb;
+} EXTChannelConfig;
+
+#define EXT_MAX_CHANNELS 32
+
+typedef struct {
+  EXTChannelConfig channels[EXT_MAX_CHANNELS];
+} EXTConfig;
+
+struct EXTDriver {
+  const EXTConfig *config;
+  uint32_t enabled;    /* channel mask */
+};
+
+extern EXTDriver EXTD1;
+
+#define EXT_CH_MODE_DISABLED   0
+#define EXT_CH_MODE_BOTH_EDGES 3
+#define EXT_CH_MODE_AUTOSTART  4
+#define EXT_MODE_GPIOA         0x00
+#define EXT_MODE_GPIOF         0x50
+
+void extStart(EXTDriver *extp, const EXTConfig *config);
+void extChannelEnableI(EXTDriver *extp, expchannel_t channel);
+void extChannelDisableI(EXTDriver *extp, expchannel_t channel);
+
+/* GPT, one-shots run on a virtual timer */
+typedef uint32_t gptcnt_t;
+typedef struct GPTDriver GPTDriver;
+typedef void (*gptcallback_t)(GPTDriver *gptp);
+
+typedef struct {
+  uint32_t frequency;
+  gptcallback_t callback;
+  uint32_t cr2;
+  uint32_t dier;
+} GPTConfig;
+
+struct GPTDriver {
+  const GPTConfig *config;
+};
+
+extern GPTDriver GPTD14;
+
+void gptStart(GPTDriver *gptp, const GPTConfig *config);
+void gptStartOneShotI(GPTDriver *gptp, gptcnt_t interval);
+
+/* Channels, all output but SD2's goes to one capture buffer */
+typedef struct {
+  int dummy;
+} BaseChannel;
+
+typedef struct {
+  int dummy;
+} USBConfig;
+
+typedef struct {
+  uint8_t state;
+} USBDriver;
+
+#define USB_ACTIVE 4
+
+typedef struct {
+  USBDriver *usbp;
+} SerialUSBConfig;
+
+typedef struct {
+  const SerialUSBConfig *config;
+} SerialUSBDriver;
+
+msg_t chnPutTimeout(void *chn, uint8_t b, systime_t time);
+size_t chnWriteTimeout(void *chn, const uint8_t *bp, size_t n, systime_t time);
+#define chnWrite(chn, bp, n) chnWriteTimeout(chn, bp, n, TIME_INFINITE)
+
+/* Serial, SD2 reads and writes a file descriptor (a pty) */
+typedef struct {
+  uint32_t speed;
+  uint32_t cr1;
+  uint32_t cr2;
+  uint32_t cr3;
+} SerialConfig;
+
+typedef struct {
+  int fd;
+} SerialDriver;
+
+extern SerialDriver SD2;
+
+#define USART_CR1_DEAT_0 (1U << 21)
+#define USART_CR1_DEDT_0 (1U << 16)
+#define USART_CR3_DEM    (1U << 14)
+
+void sdStart(SerialDriver *sdp, const SerialConfig *config);
+msg_t chnGetTimeout(void *chn, systime_t time);
+
+#endif /* HAL_H */
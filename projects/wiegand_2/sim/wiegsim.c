@@ -0,0 +1,2015 @@
+/*
+ * (c) 2016 flabbergast <s3+flabbergast@sdfeu.org>
+ * Licensed under the Apache License, Version 2.0.
+ */
+
+/*
+ * Wiegand receive path on the host.
+ *
+ * wiegand.c is built against the stubs in stubs/ and fed edges on the
+ * DAT0/DAT1 lines of each reader, either synthetic or from a trace
+ * file. The edge callbacks, frame timer, queue, classification and
+ * output run exactly as on the device; the receive thread body is
+ * called whenever the frame timer signals it.
+ *
+ * In binary output mode (the default) every record is checked against
+ * the frame that was sent. Host CPU time spent in the edge callback and
+ * in frame processing is reported, as well as the output size.
+ *
+ * Trace files have one edge per line: <time us> <reader 1..> <line 0|1> <level 0|1>
+ *
+ * With -f each reader sends a single (random) card format, as most do,
+ * which lets the receive code end frames at that length.
+ *
+ * With -k (MODE_KEYPAD) every card is followed by a PIN typed on the
+ * reader's keypad (4 or 8-bit keys) ended by '#', '*' or the timeout;
+ * each card is expected back once, with its PIN if it was entered.
+ * There are no error frames then, they could pass for keys.
+ *
+ * With -p only reader 1 gets frames and the proxy forwards them to
+ * reader 2; the frames the transmitter sends there are decoded from its
+ * pad writes, checked, and the delay from the last input bit to the
+ * first output bit is reported. A frame long enough for the gap to be
+ * learnt from it must not wait WIEG_FRAME_GAP.
+ *
+ * With -c the edges of reader 1 are captured (see wieg_capture_start())
+ * and the capture record is written to a file, for wiegcap.py.
+ *
+ * With -o the cards (and PINs, with -k) come from OSDP readers instead,
+ * one per reader, answering the panel's polls on a pty (see sim_osdp());
+ * each card has to come out exactly once, whatever the line loses.
+ *
+ * The flash past the code is emulated (see sim_flash.c), in memory or,
+ * with -F, in a file whose contents and wear carry over from run to run;
+ * -L sets the latency of an erase and of programming a halfword. With
+ * -S no frames are sent, the settings store takes that many random
+ * saves instead, checked as they go and after each simulated reset; its
+ * wear and the save rate (on the device and on the host) are reported.
+ * With -X one save in n has the power cut in the middle of it (see
+ * sim_flash_cut_in); the key has to hold its old value or the new one
+ * after the reset, and the others theirs. With -W one save in n has a
+ * halfword fail (sim_flash_fail_in); the save has to report it, and
+ * the store keep the old values, also after a reset.
+ *
+ * With -D the card database takes that many random loads, syncs and
+ * compactions instead, checked after each one and each simulated reset,
+ * and by a lookup at each flash operation as the receive thread may do;
+ * with -X one in n (one in two of those that write a bank) is cut short
+ * and the database has to be the one before or after it.
+ *
+ * With -B no frames are sent either: that many random frames of each
+ * format in wieg_formats.h, and of random lengths, are packed as the
+ * edge callbacks do and checked bit by bit, field by field and parity
+ * by parity against the byte per bit buffer frames were kept in before;
+ * decoding both is timed on the host.
+ *
+ * With -H the host closes the port now and then and the device resets
+ * while it is closed, see sim_host_round(); with -W as well, about one
+ * halfword in n/2 fails to program, which must not lose an event.
+ *
+ * Usage: wiegsim [-n frames] [-r readers] [-e err%] [-g glitch%] [-j jitter us] [-f] [-k] [-p] [-o]
+ *                [-s seed] [-m bin|debug|err|26|34|ext] [-t trace] [-w trace] [-c capture] [-v]
+ *                [-F flash file] [-L erase us,program us] [-S saves] [-D ops] [-X n] [-W n] [-H closed,open]
+ *                [-B frames]
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../wiegand.c"
+#include "../osdp.h"
+#include "../cfgstore.h"
+
+#include "sim.h"
+
+volatile uint8_t led_blink = 0;
+
+typedef struct {
+  uint64_t t;
+  uint32_t seq;        /* keeps the order of simultaneous edges */
+  uint8_t reader;
+  uint8_t line;
+  uint8_t level;
+} sim_edge_t;
+
+/* Frames sent and not received yet, per reader (the event log's worth) */
+#define SIM_EXPECT_SIZE 64
+
+typedef struct {
+  wieg_frame_t f;
+  uint8_t fmt;
+  uint64_t value;
+  uint8_t flags;       /* WIEG_REC_PIN */
+  uint8_t pin_len;
+  char pin[WIEG_PIN_MAX];
+} sim_expect_t;
+
+static sim_expect_t sim_expect[WIEG_NUM_READERS][SIM_EXPECT_SIZE];
+static uint8_t sim_expect_head[WIEG_NUM_READERS];
+static uint8_t sim_expect_tail[WIEG_NUM_READERS];
+
+static bool sim_check = false;
+static uint32_t sim_last_seq;
+static bool sim_any_seq = false;
+/* Frames not from the lines (OSDP) have the time they were handed over */
+static bool sim_any_time = false;
+static bool sim_verbose = false;
+
+/* Frames expected on reader 2's lines (proxy), and the one coming in */
+static wieg_frame_t sim_fwd_expect[SIM_EXPECT_SIZE];
+static uint8_t sim_fwd_head, sim_fwd_tail;
+static wieg_frame_t sim_fwd_frame;
+static uint64_t sim_fwd_first;
+
+static struct {
+  uint32_t sent;
+  uint32_t received;
+  uint32_t decoded;
+  uint32_t mismatches;
+  uint32_t unexpected;
+  uint32_t replayed;   /* ... records, from the event log */
+  uint32_t seq_errors; /* sequence numbers not going up */
+  uint32_t glitches;
+  uint32_t frames;     /* processed by the receive code */
+  uint64_t edges;
+  uint64_t edge_ns;
+  uint64_t edge_ns_max;
+  uint64_t frame_ns;
+  uint64_t frame_ns_max;
+  uint64_t eof_us;     /* last bit -> frame handed to the receive thread */
+  uint64_t eof_us_max;
+  uint64_t out_bytes;
+  uint64_t out_writes;
+  uint32_t fwd_expected;
+  uint32_t fwd_received;
+  uint32_t fwd_mismatches;
+  uint64_t fwd_us;     /* last input bit -> first output bit */
+  uint64_t fwd_us_max;
+  uint32_t fwd_slow;   /* frames long enough to learn the gap from that waited WIEG_FRAME_GAP */
+} stats;
+
+static uint64_t sim_clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*===========================================================================
+ * Output checking.
+ *===========================================================================*/
+
+static void sim_check_record(const uint8_t *rec) {
+  uint8_t reader = rec[2] & WIEG_REC_READER;
+  uint8_t flags = rec[2] & WIEG_REC_PIN;
+  uint8_t n = rec[4];
+  const uint8_t *pin = &rec[WIEG_REC_HEADER_SIZE + (n+7)/8];
+  uint32_t time = rec[5] | (rec[6] << 8) | (rec[7] << 16) | ((uint32_t)rec[8] << 24);
+  uint32_t seq = rec[17] | (rec[18] << 8) | (rec[19] << 16) | ((uint32_t)rec[20] << 24);
+  uint64_t value = 0;
+  sim_expect_t *e;
+  uint8_t i;
+  bool ok;
+
+  for(i=0; i<8; i++) {
+    value |= (uint64_t)rec[9+i] << (8*i);
+  }
+  /* output in order, replayed or not, and never twice */
+  if(sim_any_seq && (seq <= sim_last_seq))
+    stats.seq_errors++;
+  sim_last_seq = seq;
+  sim_any_seq = true;
+  if(rec[2] & WIEG_REC_REPLAYED)
+    stats.replayed++;
+  if((reader >= WIEG_NUM_READERS) || (sim_expect_tail[reader] == sim_expect_head[reader])) {
+    stats.unexpected++;
+    return;
+  }
+  e = &sim_expect[reader][sim_expect_tail[reader]++ & (SIM_EXPECT_SIZE-1)];
+  ok = (n == e->f.n) && (rec[3] == e->fmt) && (value == e->value)
+       && (sim_any_time || (time == e->f.time)) && (flags == e->flags);
+  if(ok && flags) {
+    ok = (pin[0] == e->pin_len) && !memcmp(&pin[1], e->pin, e->pin_len);
+  }
+  for(i=0; ok && (i<n); i++) {
+    ok = (((rec[WIEG_REC_HEADER_SIZE + i/8] >> (7 - i%8)) & 1) == wieg_get_bit(&e->f, i));
+  }
+  if(ok) {
+    if(e->fmt != WIEG_REC_NO_FORMAT)
+      stats.decoded++;
+  } else {
+    stats.mismatches++;
+    if(sim_verbose) {
+      printf("mismatch: reader %u, %u bits, format %u, value 0x%llX, PIN %s (expected %u bits, format %u, value 0x%llX, PIN %.*s)\n",
+             reader+1, n, rec[3], (unsigned long long)value, flags ? "yes" : "no",
+             e->f.n, e->fmt, (unsigned long long)e->value, e->flags ? e->pin_len : 2, e->flags ? e->pin : "no");
+    }
+  }
+}
+
+/* Split the captured output into records and check them */
+static void sim_check_output(void) {
+  size_t i = 0;
+  uint8_t len;
+
+  while(i + 2 <= sim_out_len) {
+    len = sim_out[i+1];
+    if((sim_out[i] != WIEG_REC_SYNC) || (len < WIEG_REC_HEADER_SIZE + 2) || (i + len > sim_out_len)
+       || (crc16_update(CRC16_INIT, &sim_out[i+1], len - 3) != (sim_out[i+len-2] | (sim_out[i+len-1] << 8)))) {
+      stats.unexpected++;
+      return;
+    }
+    stats.received++;
+    sim_check_record(&sim_out[i]);
+    i += len;
+  }
+}
+
+/* Transmitter pad writes: collect the bits sent on reader 2's lines */
+static void sim_fwd_pad(ioportid_t port, uint8_t pad, uint8_t level) {
+  const WiegandConfig *cfg = WIEGD[1].config;
+  const wieg_frame_t *e;
+  uint64_t us;
+  uint8_t i;
+  bool ok;
+
+  if(level != PAL_LOW)
+    return;
+  if((port == cfg->dat0_gpio) && (pad == cfg->dat0_pin)) {
+    wieg_frame_push(&sim_fwd_frame, 0);
+  } else if((port == cfg->dat1_gpio) && (pad == cfg->dat1_pin)) {
+    wieg_frame_push(&sim_fwd_frame, 1);
+  } else {
+    return;
+  }
+  if(sim_fwd_frame.n == 1) {
+    sim_fwd_first = sim_now;
+  }
+  if(sim_fwd_tail == sim_fwd_head) {
+    stats.fwd_mismatches++;
+    sim_fwd_frame.n = 0;
+    return;
+  }
+  e = &sim_fwd_expect[sim_fwd_tail & (SIM_EXPECT_SIZE-1)];
+  if(sim_fwd_frame.n < e->n)
+    return;
+  ok = true;
+  for(i=0; ok && (i<e->n); i++) {
+    ok = (wieg_get_bit(&sim_fwd_frame, i) == wieg_get_bit(e, i));
+  }
+  stats.fwd_received++;
+  if(!ok)
+    stats.fwd_mismatches++;
+  us = (systime_t)((systime_t)sim_fwd_first - e->time);
+  stats.fwd_us += us;
+  if(us > stats.fwd_us_max)
+    stats.fwd_us_max = us;
+  if((e->n > WIEG_GAP_MIN_SAMPLES) && (us >= WIEG_ST2US(WIEG_FRAME_GAP)))
+    stats.fwd_slow++;
+  sim_fwd_tail++;
+  sim_fwd_frame.n = 0;
+}
+
+static void sim_print_record(const uint8_t *rec) {
+  uint8_t n = rec[4];
+  uint64_t value = 0;
+  uint8_t i;
+
+  for(i=0; i<8; i++) {
+    value |= (uint64_t)rec[9+i] << (8*i);
+  }
+  printf("%10lu reader %u ", (unsigned long)(rec[5] | (rec[6] << 8) | (rec[7] << 16) | ((uint32_t)rec[8] << 24)),
+         (rec[2] & WIEG_REC_READER)+1);
+  if(rec[3] == WIEG_REC_NO_FORMAT) {
+    printf("err");
+  } else {
+    printf("%s", wieg_formats[rec[3]].name);
+  }
+  printf(" %3u bits ", n);
+  for(i=0; i<n; i++) {
+    putchar('0' + ((rec[WIEG_REC_HEADER_SIZE + i/8] >> (7 - i%8)) & 1));
+  }
+  if(rec[3] != WIEG_REC_NO_FORMAT) {
+    printf(" 0x%llX", (unsigned long long)value);
+  }
+  if(rec[2] & WIEG_REC_PIN) {
+    i = WIEG_REC_HEADER_SIZE + (n+7)/8;
+    printf(" PIN %.*s", rec[i], (const char *)&rec[i+1]);
+  }
+  putchar('\n');
+}
+
+static void sim_dump_output(void) {
+  size_t i = 0;
+
+  if(!(print_mode & MODE_BIN)) {
+    fwrite(sim_out, 1, sim_out_len, stdout);
+    return;
+  }
+  while((i + 2 <= sim_out_len) && (sim_out[i] == WIEG_REC_SYNC) && (i + sim_out[i+1] <= sim_out_len)) {
+    sim_print_record(&sim_out[i]);
+    i += sim_out[i+1];
+  }
+}
+
+/*===========================================================================
+ * Running.
+ *===========================================================================*/
+
+/* Inside sim_receive(), edges can run from sim_flash_done */
+static bool sim_receiving = false;
+
+/* What the receive thread does when woken up */
+static void sim_receive(void) {
+  eventmask_t events;
+  uint32_t frames = 0;
+  uint64_t t0, ns;
+  uint8_t i;
+
+  uint8_t j, n;
+
+  /* it wakes up again once it is done */
+  if(sim_receiving)
+    return;
+  sim_receiving = true;
+  events = chEvtWaitAny(ALL_EVENTS);
+
+  for(i=0; i<WIEG_NUM_READERS; i++) {
+    if(events & EVENT_MASK(i)) {
+      n = (uint8_t)(WIEGD[i].queue.head - WIEGD[i].queue.tail);
+      for(j=0; j<n; j++) {
+        /* system time wraps after 71 minutes */
+        ns = (systime_t)((systime_t)sim_now - WIEGD[i].queue.frames[(WIEGD[i].queue.tail + j) & (WIEG_QUEUE_SIZE-1)].time);
+        stats.eof_us += ns;
+        if(ns > stats.eof_us_max)
+          stats.eof_us_max = ns;
+      }
+      frames += n;
+    }
+  }
+  sim_out_len = 0;
+  sim_out_writes = 0;
+  t0 = sim_clock_ns();
+  wieg_recv_events(events);
+  ns = sim_clock_ns() - t0;
+  stats.frames += frames;
+  if(frames > 0) {
+    stats.frame_ns += ns;
+    if(ns / frames > stats.frame_ns_max)
+      stats.frame_ns_max = ns / frames;
+  }
+  stats.out_bytes += sim_out_len;
+  stats.out_writes += sim_out_writes;
+  if(sim_check) {
+    sim_check_output();
+  }
+  if(sim_verbose) {
+    sim_dump_output();
+  }
+  sim_receiving = false;
+}
+
+static void sim_run_until(uint64_t t) {
+  while(sim_next_timer(t)) {
+    if(sim_events != 0)
+      sim_receive();
+  }
+  if(sim_now < t)
+    sim_now = t;
+}
+
+static void sim_run_edge(const sim_edge_t *e) {
+  const WiegandConfig *cfg = WIEGD[e->reader].config;
+  uint64_t t0, ns;
+
+  sim_run_until(e->t);
+  if(e->line == 0) {
+    sim_set_pad(cfg->dat0_gpio, cfg->dat0_pin, e->level);
+  } else {
+    sim_set_pad(cfg->dat1_gpio, cfg->dat1_pin, e->level);
+  }
+  t0 = sim_clock_ns();
+  sim_ext_edge(e->line ? cfg->dat1_channel : cfg->dat0_channel);
+  ns = sim_clock_ns() - t0;
+  stats.edges++;
+  stats.edge_ns += ns;
+  if(ns > stats.edge_ns_max)
+    stats.edge_ns_max = ns;
+  /* a frame can also end on an edge */
+  if(sim_events != 0)
+    sim_receive();
+}
+
+static int sim_edge_cmp(const void *a, const void *b) {
+  const sim_edge_t *ea = a, *eb = b;
+  if(ea->t != eb->t)
+    return (ea->t < eb->t) ? -1 : 1;
+  return (ea->seq < eb->seq) ? -1 : (ea->seq > eb->seq);
+}
+
+/*===========================================================================
+ * Synthetic traffic.
+ *===========================================================================*/
+
+/* Room for one frame per reader, with both glitches on every bit */
+#define SIM_MAX_EDGES (WIEG_NUM_READERS * WIEG_BUFFER_SIZE * 6)
+
+static sim_edge_t sim_edges[SIM_MAX_EDGES];
+static size_t sim_edge_count;
+static uint32_t sim_seq;
+
+/* Edge being handled, for the pad lookahead */
+static size_t sim_edge_cur;
+
+/* The edges that came in during a flash operation (sim_flash_done) */
+static void sim_edges_due(void) {
+  while((sim_edge_cur + 1 < sim_edge_count) && (sim_edges[sim_edge_cur + 1].t <= sim_now)) {
+    sim_edge_cur++;
+    sim_run_edge(&sim_edges[sim_edge_cur]);
+  }
+}
+
+/* Level of a pad at time t, taking the edges still to come into account */
+static uint8_t sim_edges_lookahead(ioportid_t port, uint8_t pad, uint64_t t, uint8_t level) {
+  const WiegandConfig *cfg;
+  size_t i;
+
+  for(i=sim_edge_cur+1; (i<sim_edge_count) && (sim_edges[i].t <= t); i++) {
+    cfg = WIEGD[sim_edges[i].reader].config;
+    if(sim_edges[i].line ? ((cfg->dat1_gpio == port) && (cfg->dat1_pin == pad))
+                         : ((cfg->dat0_gpio == port) && (cfg->dat0_pin == pad))) {
+      level = sim_edges[i].level;
+    }
+  }
+  return level;
+}
+
+static void sim_add_edge(uint64_t t, uint8_t reader, uint8_t line, uint8_t level) {
+  sim_edge_t *e = &sim_edges[sim_edge_count++];
+  e->t = t;
+  e->seq = sim_seq++;
+  e->reader = reader;
+  e->line = line;
+  e->level = level;
+}
+
+static uint32_t sim_rand(uint32_t n) {
+  return (uint32_t)(rand() % n);
+}
+
+/*
+ * A random frame: a valid one of format 'fixed' (random if NULL) or
+ * random bits
+ */
+static void sim_make_frame(wieg_frame_t *f, uint8_t err_pct, const wieg_format_t *fixed) {
+  const wieg_format_t *fmt;
+  uint16_t tries;
+  uint8_t i;
+
+  if(sim_rand(100) < err_pct) {
+    f->n = 4 + sim_rand(WIEG_BUFFER_SIZE - 3);
+    fmt = NULL;
+  } else {
+    fmt = (fixed != NULL) ? fixed : &wieg_formats[sim_rand(WIEG_FMT_COUNT)];
+    f->n = fmt->length;
+  }
+  /* random bits until the parity matches, at most 1/8 pass per try */
+  for(tries=0; tries<1000; tries++) {
+    for(i=0; i<WIEG_BUFFER_WORDS; i++) {
+      f->bits[i] = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    }
+    if((i = f->n & 31) != 0) {
+      f->bits[f->n >> 5] &= ~(0xFFFFFFFFUL >> i);
+    }
+    for(i=(f->n+31)>>5; i<WIEG_BUFFER_WORDS; i++) {
+      f->bits[i] = 0;
+    }
+    if((fmt == NULL) || (wieg_classify(f) == fmt))
+      break;
+  }
+}
+
+/* Edges for frame f on reader r starting at t0, returns its last bit time */
+static uint64_t sim_frame_edges(const wieg_frame_t *f, uint8_t r, uint64_t t0, uint16_t jitter, uint8_t glitch_pct) {
+  uint64_t t = t0;
+  uint8_t i, line;
+
+  for(i=0; i<f->n; i++) {
+    if(i > 0) {
+      if(sim_rand(100) < glitch_pct) {
+        /* ringing: a 2-9 us spike on either line between bits */
+        line = sim_rand(2);
+        sim_add_edge(t + WIEG_PAUSE_WIDTH_US/2, r, line, PAL_LOW);
+        sim_add_edge(t + WIEG_PAUSE_WIDTH_US/2 + 2 + sim_rand(8), r, line, PAL_HIGH);
+        stats.glitches++;
+      }
+      t += WIEG_PAUSE_WIDTH_US;
+      if(jitter > 0)
+        t = t - jitter + sim_rand(2*jitter + 1);
+    }
+    line = wieg_get_bit(f, i);
+    sim_add_edge(t, r, line, PAL_LOW);
+    sim_add_edge(t + WIEG_PULSE_WIDTH_US, r, line, PAL_HIGH);
+    if(sim_rand(100) < glitch_pct) {
+      /* crosstalk on the other line, inside the hold-off */
+      sim_add_edge(t + 5, r, !line, PAL_LOW);
+      sim_add_edge(t + 8, r, !line, PAL_HIGH);
+      stats.glitches++;
+    }
+  }
+  return t;
+}
+
+static sim_expect_t *sim_expect_frame(uint8_t r, const wieg_frame_t *f, uint64_t last) {
+  sim_expect_t *e = &sim_expect[r][sim_expect_head[r]++ & (SIM_EXPECT_SIZE-1)];
+  const wieg_format_t *fmt = wieg_classify(f);
+
+  e->f = *f;
+  e->f.time = (systime_t)last;
+  e->fmt = (fmt != NULL) ? wieg_format_id(fmt) : WIEG_REC_NO_FORMAT;
+  e->value = (fmt != NULL) ? wieg_field(wieg_frame_value(f), f->n, fmt->value_start, fmt->value_len) : 0;
+  e->flags = 0;
+  e->pin_len = 0;
+  return e;
+}
+
+/* A keypad frame for key, 8-bit (key and its complement) if wide */
+static void sim_make_key(wieg_frame_t *f, uint8_t key, bool wide) {
+  f->n = wide ? 8 : 4;
+  f->bits[0] = wide ? (((~(uint32_t)key << 4) & 0xF0) | key) << 24 : (uint32_t)key << 28;
+}
+
+/*
+ * Keys typed after the card expected in e: up to WIEG_PIN_MAX digits,
+ * then '#' (mostly), '*' or nothing. Returns the number of keys.
+ */
+static uint8_t sim_make_pin(sim_expect_t *e, uint8_t *keys) {
+  uint8_t digits = sim_rand(WIEG_PIN_MAX + 1);
+  uint8_t end = sim_rand(10);
+  uint8_t i;
+
+  for(i=0; i<digits; i++) {
+    e->pin[i] = '0' + sim_rand(10);
+    keys[i] = e->pin[i] - '0';
+  }
+  if(end == 0)
+    return digits;
+  keys[digits] = (end == 1) ? WIEG_KEY_CANCEL : WIEG_KEY_ENTER;
+  if(end > 1) {
+    e->flags = WIEG_REC_PIN;
+    e->pin_len = digits;
+  }
+  return digits + 1;
+}
+
+/*
+ * Keys typed after a card on reader r, from the card's last bit at
+ * 'last', see sim_make_pin(). Returns the last bit time.
+ */
+static uint64_t sim_keypad_edges(sim_expect_t *e, uint8_t r, uint64_t last, bool wide,
+                                 uint16_t jitter, uint8_t glitch_pct) {
+  wieg_frame_t f;
+  uint8_t keys[WIEG_PIN_MAX + 1];
+  uint8_t i, n = sim_make_pin(e, keys);
+
+  for(i=0; i<n; i++) {
+    sim_make_key(&f, keys[i], wide);
+    /* human typing speed */
+    last = sim_frame_edges(&f, r, last + 30000 + sim_rand(200000), jitter, glitch_pct);
+  }
+  return last;
+}
+
+static void sim_write_edges(FILE *out) {
+  size_t i;
+  for(i=0; i<sim_edge_count; i++) {
+    fprintf(out, "%llu %u %u %u\n", (unsigned long long)sim_edges[i].t,
+            sim_edges[i].reader+1, sim_edges[i].line, sim_edges[i].level);
+  }
+}
+
+/*===========================================================================
+ * Host disconnects.
+ *===========================================================================*/
+
+/*
+ * Write failures (-W): with frames, one halfword in about sim_fails/2;
+ * one save or card database operation in sim_fails
+ */
+static uint32_t sim_fails = 0;
+
+static struct {
+  uint32_t closed;     /* frames sent with the port closed ... */
+  uint32_t open;       /* ... then open, over and over (-H) */
+  uint32_t closes;
+  uint32_t resets;
+  uint32_t lost;       /* events in the RAM ring at a reset */
+  bool reset_due;
+} sim_host;
+
+/*
+ * A reset of the device as far as the event log goes: its RAM is gone,
+ * but for WIEG_NOINIT which is garbage after a power up. The events in
+ * the RAM ring were the last ones of their readers, they are no longer
+ * expected.
+ */
+static void sim_log_reset(bool power) {
+  uint8_t i = wieg_log_head;
+  uint8_t r;
+
+  while(i != wieg_log_tail) {
+    i--;
+    r = wieg_log_ring[i & (WIEG_LOG_RAM_SIZE-1)].reader & WIEG_REC_READER;
+    sim_expect_head[r]--;
+    sim_host.lost++;
+  }
+  wieg_log_head = 0;
+  wieg_log_tail = 0;
+  wieg_log_seq = 0;
+  wieg_log_seq_end = 0;
+  wieg_log_flash_len = 0;
+  wieg_log_flash_read = 0;
+  if(power) {
+    wieg_log_kept[0] = rand();
+    wieg_log_kept[1] = rand();
+  }
+  cfg_init();
+  wieg_log_init();
+  sim_host.resets++;
+}
+
+/*
+ * Before a round of frames at t: the port is closed for sim_host.closed
+ * frames, then open for sim_host.open. In each closed stretch the
+ * device resets, soft and power up in turn, and in turn as the port
+ * closes (nothing logged) and halfway through (events in flash, which
+ * have to come back after it); sequence numbers go on from before.
+ */
+static void sim_host_round(uint64_t t) {
+  uint32_t pos = stats.sent % (sim_host.closed + sim_host.open);
+  bool open = (pos >= sim_host.closed);
+
+  if(usb_port_open && !open) {
+    sim_host.closes++;
+    sim_host.reset_due = true;
+  }
+  usb_port_open = open;
+  if(sim_host.reset_due && (pos >= ((sim_host.resets & 2) ? sim_host.closed / 2 : 0))) {
+    /* the frames sent so far are through the receive code */
+    sim_run_until(t);
+    sim_log_reset(sim_host.resets & 1);
+    sim_host.reset_due = false;
+  }
+}
+
+/* Open the port and let the event log empty */
+static void sim_host_flush(void) {
+  uint32_t i;
+
+  usb_port_open = true;
+  for(i=0; (i<1000) && (wieg_log_pending() > 0); i++) {
+    sim_now += WIEG_ST2US(WIEG_LOG_REPLAY_INTERVAL);
+    sim_receive();
+  }
+}
+
+/*
+ * Rounds of one frame per reader; the readers' frames are offset so
+ * their edges interleave. Each round ends after the longest frame plus
+ * the frame gap.
+ */
+static void sim_synthetic(uint32_t frames, uint8_t readers, uint8_t err_pct, uint16_t jitter,
+                          uint8_t glitch_pct, bool fixed, bool keypad, bool proxy, FILE *trace) {
+  const wieg_format_t *formats[WIEG_NUM_READERS];
+  bool wide[WIEG_NUM_READERS];
+  wieg_frame_t f;
+  sim_expect_t *e;
+  uint64_t t = 1000, last, end;
+  uint8_t r;
+
+  for(r=0; r<WIEG_NUM_READERS; r++) {
+    formats[r] = fixed ? &wieg_formats[sim_rand(WIEG_FMT_COUNT)] : NULL;
+    wide[r] = sim_rand(2);
+  }
+
+  while(stats.sent < frames) {
+    if(sim_host.closed > 0)
+      sim_host_round(t);
+    if((sim_fails > 0) && (sim_flash_fail_in == 0))
+      sim_flash_fail_in = 1 + rand() % sim_fails;
+    sim_edge_count = 0;
+    end = t;
+    for(r=0; (r<readers) && (stats.sent < frames); r++) {
+      sim_make_frame(&f, err_pct, formats[r]);
+      last = sim_frame_edges(&f, r, t + r*(WIEG_PAUSE_WIDTH_US/readers + 37), jitter, glitch_pct);
+      e = sim_expect_frame(r, &f, last);
+      if(keypad)
+        last = sim_keypad_edges(e, r, last, wide[r], jitter, glitch_pct);
+      if(proxy && ((wieg_classify(&f) != NULL) || (wieg_key(&f) >= 0))) {
+        f.time = (systime_t)last;
+        sim_fwd_expect[sim_fwd_head++ & (SIM_EXPECT_SIZE-1)] = f;
+        stats.fwd_expected++;
+        /* the transmitter takes longer than the frame came in */
+        last += f.n*WIEG_PAUSE_WIDTH_US + WIEG_TX_FRAME_GAP;
+      }
+      stats.sent++;
+      if(last > end)
+        end = last;
+    }
+    qsort(sim_edges, sim_edge_count, sizeof(sim_edge_t), sim_edge_cmp);
+    if(trace != NULL)
+      sim_write_edges(trace);
+    for(sim_edge_cur=0; sim_edge_cur<sim_edge_count; sim_edge_cur++) {
+      sim_run_edge(&sim_edges[sim_edge_cur]);
+    }
+    t = end + WIEG_FRAME_GAP + 1000 + sim_rand(5000);
+    if(keypad) {
+      /* the receive thread wakes up periodically to end PIN entries */
+      t += WIEG_ST2US(WIEG_PIN_TIMEOUT) + WIEG_ST2US(WIEG_LOG_REPLAY_INTERVAL);
+      sim_run_until(t);
+      sim_receive();
+    }
+  }
+  sim_run_until(t);
+  if(sim_host.closed > 0)
+    sim_host_flush();
+}
+
+static bool sim_replay(FILE *in) {
+  unsigned long long t;
+  unsigned reader, line, level;
+  sim_edge_t e = {0, 0, 0, 0, 0};
+  uint64_t last = 0;
+  char buf[128];
+
+  while(fgets(buf, sizeof(buf), in) != NULL) {
+    if((buf[0] == '#') || (buf[0] == '\n'))
+      continue;
+    if((sscanf(buf, "%llu %u %u %u", &t, &reader, &line, &level) != 4)
+       || (reader < 1) || (reader > WIEG_NUM_READERS) || (line > 1) || (t < last)) {
+      fprintf(stderr, "bad trace line: %s", buf);
+      return false;
+    }
+    e.t = last = t;
+    e.reader = reader - 1;
+    e.line = line;
+    e.level = level ? PAL_HIGH : PAL_LOW;
+    sim_run_edge(&e);
+  }
+  sim_run_until(last + WIEG_FRAME_GAP + 1);
+  return true;
+}
+
+/*===========================================================================
+ * OSDP readers.
+ *===========================================================================*/
+
+/*
+ * The readers (PDs) on the other side of a pty, in a thread of their
+ * own: both answer on the one line, at addresses 1, 2, ... Each has a
+ * queue of replies (cards, keys) that are sent in turn; a reply stays at
+ * the head until the next sequence number shows it came through, and a
+ * repeated sequence number gets the same reply again. A few replies are
+ * dropped, corrupted or BUSY, and a PD sometimes restarts and NAKs the
+ * sequence number until the panel starts over at 0.
+ */
+#define SIM_PD_QUEUE    8
+#define SIM_PD_DATA     (OSDP_MAX_PACKET - OSDP_HEADER_SIZE - 2)
+#define SIM_PD_NO_SQN   0xFF
+
+typedef struct {
+  uint8_t code;
+  uint8_t len;
+  uint8_t data[SIM_PD_DATA];
+} sim_pd_reply_t;
+
+typedef struct {
+  sim_pd_reply_t queue[SIM_PD_QUEUE];
+  uint8_t head, tail;
+  uint8_t last_sqn;    /* SIM_PD_NO_SQN after a restart */
+  uint8_t reply[OSDP_MAX_PACKET];
+  uint16_t reply_len;
+} sim_pd_t;
+
+static struct {
+  sim_pd_t pd[WIEG_NUM_READERS];
+  uint8_t count;
+  int fd;              /* pty slave */
+  bool silent;
+  bool stop;
+  unsigned seed;
+  pthread_mutex_t lock;
+  uint32_t dropped;
+  uint32_t corrupted;
+  uint32_t busy;
+  uint32_t restarts;
+} sim_pds;
+
+static void sim_pd_write(const uint8_t *p, uint16_t n) {
+  uint8_t buf[OSDP_MAX_PACKET];
+  uint32_t r = rand_r(&sim_pds.seed) % 100;
+
+  if(r < 3) {
+    sim_pds.dropped++;
+    return;
+  }
+  memcpy(buf, p, n);
+  if(r < 6) {
+    buf[rand_r(&sim_pds.seed) % n] ^= 1 << (rand_r(&sim_pds.seed) % 8);
+    sim_pds.corrupted++;
+  }
+  if(write(sim_pds.fd, buf, n) != n)
+    perror("pty");
+}
+
+static uint16_t sim_pd_packet(uint8_t *p, uint8_t addr, uint8_t sqn, uint8_t code, const uint8_t *data, uint8_t len) {
+  uint16_t n = OSDP_HEADER_SIZE + len + 2;
+  uint16_t crc;
+
+  p[0] = OSDP_SOM;
+  p[1] = addr | OSDP_REPLY;
+  p[2] = n & 0xFF;
+  p[3] = n >> 8;
+  p[4] = sqn | OSDP_CTRL_CRC;
+  p[5] = code;
+  if(len > 0)
+    memcpy(&p[OSDP_HEADER_SIZE], data, len);
+  crc = crc16_update(OSDP_CRC_INIT, p, n - 2);
+  p[n-2] = crc & 0xFF;
+  p[n-1] = crc >> 8;
+  return n;
+}
+
+/* A command to PD number i, sequence number sqn */
+static void sim_pd_command(uint8_t i, uint8_t sqn) {
+  sim_pd_t *pd = &sim_pds.pd[i];
+  const sim_pd_reply_t *r;
+  uint8_t buf[OSDP_MAX_PACKET];
+  uint8_t reason = OSDP_NAK_SQN;
+
+  if((sqn != 0) && (sqn == pd->last_sqn)) {
+    sim_pd_write(pd->reply, pd->reply_len);
+    return;
+  }
+  if((sqn != 0) && ((pd->last_sqn == SIM_PD_NO_SQN) || (sqn != pd->last_sqn % 3 + 1))) {
+    sim_pd_write(buf, sim_pd_packet(buf, i + 1, sqn, OSDP_NAK, &reason, 1));
+    return;
+  }
+  if(rand_r(&sim_pds.seed) % 100 < 2) {
+    sim_pd_write(buf, sim_pd_packet(buf, i + 1, sqn, OSDP_BUSY, NULL, 0));
+    sim_pds.busy++;
+    return;
+  }
+
+  pthread_mutex_lock(&sim_pds.lock);
+  // a new sequence number: the last reply came through (0: maybe not)
+  if((sqn != 0) && (pd->last_sqn != SIM_PD_NO_SQN) && (pd->reply[5] != OSDP_ACK))
+    pd->tail++;
+  if((pd->tail == pd->head) && (rand_r(&sim_pds.seed) % 100 < 1)) {
+    pd->last_sqn = SIM_PD_NO_SQN;
+    sim_pds.restarts++;
+    pthread_mutex_unlock(&sim_pds.lock);
+    sim_pd_write(buf, sim_pd_packet(buf, i + 1, sqn, OSDP_NAK, &reason, 1));
+    return;
+  }
+  if(pd->tail != pd->head) {
+    r = &pd->queue[pd->tail % SIM_PD_QUEUE];
+    pd->reply_len = sim_pd_packet(pd->reply, i + 1, sqn, r->code, r->data, r->len);
+  } else {
+    pd->reply_len = sim_pd_packet(pd->reply, i + 1, sqn, OSDP_ACK, NULL, 0);
+  }
+  pd->last_sqn = sqn;
+  pthread_mutex_unlock(&sim_pds.lock);
+  sim_pd_write(pd->reply, pd->reply_len);
+}
+
+static void *sim_pd_thread(void *arg) {
+  struct pollfd pfd = {sim_pds.fd, POLLIN, 0};
+  uint8_t buf[OSDP_MAX_PACKET];
+  uint16_t len = 0, n;
+  ssize_t got;
+
+  (void)arg;
+  while(!sim_pds.stop) {
+    if((poll(&pfd, 1, 50) != 1) || ((got = read(sim_pds.fd, &buf[len], sizeof(buf) - len)) <= 0))
+      continue;
+    len += got;
+    while(len > 0) {
+      if(buf[0] != OSDP_SOM) {
+        memmove(buf, &buf[1], --len);
+        continue;
+      }
+      if(len < 4)
+        break;
+      n = buf[2] | (buf[3] << 8);
+      if((n < OSDP_HEADER_SIZE + 2) || (n > OSDP_MAX_PACKET)) {
+        memmove(buf, &buf[1], --len);
+        continue;
+      }
+      if(len < n)
+        break;
+      if(!sim_pds.silent && (buf[1] >= 1) && (buf[1] <= sim_pds.count) && (buf[5] == OSDP_CMD_POLL)
+         && (crc16_update(OSDP_CRC_INIT, buf, n - 2) == (buf[n-2] | (buf[n-1] << 8)))) {
+        sim_pd_command(buf[1] - 1, buf[4] & OSDP_CTRL_SQN);
+      }
+      len -= n;
+      memmove(buf, &buf[n], len);
+    }
+  }
+  return NULL;
+}
+
+static void sim_pd_queue(uint8_t i, uint8_t code, const uint8_t *data, uint8_t len) {
+  sim_pd_t *pd = &sim_pds.pd[i];
+  sim_pd_reply_t *r;
+
+  pthread_mutex_lock(&sim_pds.lock);
+  r = &pd->queue[pd->head % SIM_PD_QUEUE];
+  r->code = code;
+  r->len = len;
+  memcpy(r->data, data, len);
+  pd->head++;
+  pthread_mutex_unlock(&sim_pds.lock);
+}
+
+static bool sim_pd_idle(void) {
+  bool idle = true;
+  uint8_t i;
+
+  pthread_mutex_lock(&sim_pds.lock);
+  for(i=0; i<sim_pds.count; i++) {
+    idle = idle && (sim_pds.pd[i].tail == sim_pds.pd[i].head);
+  }
+  pthread_mutex_unlock(&sim_pds.lock);
+  return idle;
+}
+
+/* Card f read on PD i, as osdp_RAW */
+static void sim_pd_card(uint8_t i, const wieg_frame_t *f) {
+  uint8_t data[SIM_PD_DATA];
+  uint8_t j;
+
+  data[0] = 0;         /* reader of the PD */
+  data[1] = 0;         /* raw, unspecified format */
+  data[2] = f->n;
+  data[3] = 0;
+  for(j=0; j<(f->n+7)/8; j++) {
+    data[4+j] = f->bits[j/4] >> (24 - 8*(j%4));
+  }
+  sim_pd_queue(i, OSDP_RAW, data, 4 + j);
+}
+
+/* Keys typed on PD i, a few per osdp_KEYPAD, '*' and '#' either way */
+static void sim_pd_keys(uint8_t i, const uint8_t *keys, uint8_t n) {
+  uint8_t data[2 + WIEG_PIN_MAX + 1];
+  uint8_t j = 0, k;
+
+  while(j < n) {
+    data[0] = 0;
+    data[1] = 0;
+    for(k=1+sim_rand(3); k && (j < n); k--, j++) {
+      if(keys[j] == WIEG_KEY_CANCEL)
+        data[2 + data[1]++] = sim_rand(2) ? '*' : OSDP_KEY_STAR;
+      else if(keys[j] == WIEG_KEY_ENTER)
+        data[2 + data[1]++] = sim_rand(2) ? '#' : OSDP_KEY_HASH;
+      else
+        data[2 + data[1]++] = '0' + keys[j];
+    }
+    sim_pd_queue(i, OSDP_KEYPAD, data, 2 + data[1]);
+  }
+}
+
+/* Poll until the PDs have nothing left to send; false if they never get there */
+static bool sim_osdp_drain(void) {
+  uint16_t rounds;
+
+  for(rounds=0; rounds<1000; rounds++) {
+    if(sim_pd_idle())
+      return true;
+    osdp_poll();
+    sim_run_until(sim_now + WIEG_ST2US(OSDP_POLL_INTERVAL));
+  }
+  return false;
+}
+
+/*
+ * Rounds of a card (and a PIN with -k) on each reader's PD, polled
+ * until all came through. Then the PDs go quiet and have to be taken
+ * offline. Returns false if the polling got stuck or a PD's state was
+ * wrong.
+ */
+static bool sim_osdp(uint32_t frames, uint8_t readers, uint8_t err_pct, bool keypad) {
+  struct termios tio;
+  pthread_t thread;
+  wieg_frame_t f;
+  sim_expect_t *e;
+  uint8_t keys[WIEG_PIN_MAX + 1];
+  bool ok = true;
+  uint8_t r;
+  int fd;
+
+  fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if((fd < 0) || (grantpt(fd) != 0) || (unlockpt(fd) != 0)
+     || ((sim_pds.fd = open(ptsname(fd), O_RDWR | O_NOCTTY)) < 0)) {
+    perror("pty");
+    return false;
+  }
+  tcgetattr(sim_pds.fd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(sim_pds.fd, TCSANOW, &tio);
+  sim_pds.count = readers;
+  sim_pds.seed = rand();
+  for(r=0; r<readers; r++) {
+    sim_pds.pd[r].last_sqn = SIM_PD_NO_SQN;
+  }
+  pthread_mutex_init(&sim_pds.lock, NULL);
+  pthread_create(&thread, NULL, sim_pd_thread, NULL);
+
+  osdp_init();
+  SD2.fd = fd;
+  for(r=0; r<readers; r++) {
+    osdp_set_pd(r, r + 1, r);
+  }
+
+  while(ok && (stats.sent < frames)) {
+    for(r=0; (r<readers) && (stats.sent < frames); r++) {
+      sim_make_frame(&f, err_pct, NULL);
+      e = sim_expect_frame(r, &f, 0);
+      sim_pd_card(r, &f);
+      if(keypad)
+        sim_pd_keys(r, keys, sim_make_pin(e, keys));
+      stats.sent++;
+    }
+    ok = sim_osdp_drain();
+    if(keypad) {
+      /* PINs not ended time out */
+      sim_run_until(sim_now + WIEG_ST2US(WIEG_PIN_TIMEOUT) + WIEG_ST2US(WIEG_LOG_REPLAY_INTERVAL));
+      sim_receive();
+    }
+  }
+  for(r=0; r<readers; r++) {
+    /* nothing came over the lines: no end of frame timing learnt */
+    ok = ok && osdp_pds[r].online && (WIEGD[r].stable == 0) && (WIEGD[r].close_len == 0);
+  }
+
+  sim_pds.silent = true;
+  osdp_poll();
+  sim_now += WIEG_ST2US(OSDP_OFFLINE_TIME);
+  osdp_poll();
+  for(r=0; r<readers; r++) {
+    ok = ok && !osdp_pds[r].online && (osdp_pds[r].sqn == 0);
+  }
+
+  sim_pds.stop = true;
+  pthread_join(thread, NULL);
+  close(sim_pds.fd);
+  close(fd);
+  return ok;
+}
+
+/*===========================================================================
+ * Packed frames.
+ *===========================================================================*/
+
+/*
+ * Frames as they were kept before they were packed into words: one
+ * byte per bit, fields and parities read bit by bit. The reference the
+ * packed frames are checked against.
+ */
+static uint64_t sim_bytes_field(const uint8_t *buf, uint8_t start, uint8_t len) {
+  uint64_t v = 0;
+  uint8_t i;
+
+  for(i=start; i<start+len; i++)
+    v = (v << 1) | (buf[i] != 0);
+  return v;
+}
+
+/* Parity of the bits in mask, frame bit i being bit n-1-i of mask */
+static uint8_t sim_bytes_parity(const uint8_t *buf, uint8_t n, uint64_t mask) {
+  uint8_t i, ones = 0;
+
+  for(i=0; i<n; i++) {
+    if(((mask >> (n - 1 - i)) & 1) && buf[i])
+      ones++;
+  }
+  return ones & 1;
+}
+
+static const wieg_format_t *sim_bytes_classify(const uint8_t *buf, uint8_t n) {
+  const wieg_format_t *fmt;
+  uint8_t p;
+
+  for(fmt=wieg_formats; fmt<wieg_formats+WIEG_FMT_COUNT; fmt++) {
+    if(fmt->length != n)
+      continue;
+    for(p=0; p<WIEG_MAX_PARITY; p++) {
+      if((fmt->parity[p].mask != 0) && (sim_bytes_parity(buf, n, fmt->parity[p].mask) != fmt->parity[p].odd))
+        return NULL;
+    }
+    return fmt;
+  }
+  return NULL;
+}
+
+/* Random n bits; with valid, drawn again until they are a valid frame of fmt */
+static void sim_bytes_random(uint8_t *buf, uint8_t n, const wieg_format_t *fmt, bool valid) {
+  uint8_t i;
+
+  do {
+    for(i=0; i<n; i++)
+      buf[i] = rand() & 1;
+  } while(valid && (sim_bytes_classify(buf, n) != fmt));
+}
+
+static void sim_bytes_pack(wieg_frame_t *f, const uint8_t *buf, uint8_t n) {
+  uint8_t i;
+
+  f->n = 0;
+  for(i=0; i<n; i++)
+    wieg_frame_push(f, buf[i]);
+}
+
+/*
+ * A frame packed as the edge callbacks do reads the same as its bytes:
+ * every bit, a random field, the whole value, its format (parities)
+ * and, if it has one, the facility, card and printed value.
+ */
+static bool sim_packed_check(const uint8_t *buf, uint8_t n) {
+  const wieg_format_t *fmt;
+  wieg_frame_t f;
+  uint64_t value;
+  uint8_t i, start, len;
+
+  sim_bytes_pack(&f, buf, n);
+  if(f.n != n)
+    return false;
+  for(i=0; i<n; i++) {
+    if(wieg_get_bit(&f, i) != buf[i])
+      return false;
+  }
+  start = rand() % n;
+  len = rand() % (n - start + 1);
+  if(len > 32)
+    len = 32;
+  if(wieg_get_bits(&f, start, len) != sim_bytes_field(buf, start, len))
+    return false;
+  if(n > WIEG_FORMAT_MAX_LENGTH)
+    return true;
+  value = wieg_frame_value(&f);
+  fmt = sim_bytes_classify(buf, n);
+  if((value != sim_bytes_field(buf, 0, n)) || (wieg_classify(&f) != fmt))
+    return false;
+  if(fmt == NULL)
+    return true;
+  return (wieg_field(value, n, fmt->facility_start, fmt->facility_len) == sim_bytes_field(buf, fmt->facility_start, fmt->facility_len))
+         && (wieg_field(value, n, fmt->card_start, fmt->card_len) == sim_bytes_field(buf, fmt->card_start, fmt->card_len))
+         && (wieg_field(value, n, fmt->value_start, fmt->value_len) == sim_bytes_field(buf, fmt->value_start, fmt->value_len));
+}
+
+/* Frames of each format the benchmark decodes, and how many times */
+#define SIM_PACKED_BENCH 64
+#define SIM_PACKED_ROUNDS 2000
+
+/*
+ * Check frames frames of each format in wieg_formats.h, half of them
+ * valid, and as many of random lengths up to WIEG_BUFFER_SIZE; then
+ * time decoding (classify, printed value) both ways. Returns false if
+ * a packed frame reads differently from its bytes.
+ */
+static bool sim_packed(uint32_t frames) {
+  static uint8_t bufs[WIEG_FMT_COUNT*SIM_PACKED_BENCH][WIEG_BUFFER_SIZE];
+  static wieg_frame_t packed[WIEG_FMT_COUNT*SIM_PACKED_BENCH];
+  const wieg_format_t *fmt;
+  volatile uint64_t sink = 0;
+  uint64_t t0, packed_ns, bytes_ns;
+  uint32_t i, k, r;
+  uint8_t n;
+
+  for(k=0; k<WIEG_FMT_COUNT; k++) {
+    for(i=0; i<frames; i++) {
+      sim_bytes_random(bufs[0], wieg_formats[k].length, &wieg_formats[k], i & 1);
+      if(!sim_packed_check(bufs[0], wieg_formats[k].length)) {
+        if(sim_verbose)
+          printf("format %s: packed frame %u reads differently\n", wieg_formats[k].name, i);
+        return false;
+      }
+    }
+  }
+  for(i=0; i<frames; i++) {
+    n = 1 + rand() % WIEG_BUFFER_SIZE;
+    sim_bytes_random(bufs[0], n, NULL, false);
+    if(!sim_packed_check(bufs[0], n)) {
+      if(sim_verbose)
+        printf("%u-bit packed frame %u reads differently\n", n, i);
+      return false;
+    }
+  }
+
+  for(i=0; i<WIEG_FMT_COUNT*SIM_PACKED_BENCH; i++) {
+    fmt = &wieg_formats[i % WIEG_FMT_COUNT];
+    sim_bytes_random(bufs[i], fmt->length, fmt, i & 1);
+    sim_bytes_pack(&packed[i], bufs[i], fmt->length);
+  }
+  t0 = sim_clock_ns();
+  for(r=0; r<SIM_PACKED_ROUNDS; r++) {
+    for(i=0; i<WIEG_FMT_COUNT*SIM_PACKED_BENCH; i++) {
+      fmt = wieg_classify(&packed[i]);
+      if(fmt != NULL)
+        sink += wieg_field(wieg_frame_value(&packed[i]), packed[i].n, fmt->value_start, fmt->value_len);
+    }
+  }
+  packed_ns = sim_clock_ns() - t0;
+  t0 = sim_clock_ns();
+  for(r=0; r<SIM_PACKED_ROUNDS; r++) {
+    for(i=0; i<WIEG_FMT_COUNT*SIM_PACKED_BENCH; i++) {
+      fmt = sim_bytes_classify(bufs[i], wieg_formats[i % WIEG_FMT_COUNT].length);
+      if(fmt != NULL)
+        sink += sim_bytes_field(bufs[i], fmt->value_start, fmt->value_len);
+    }
+  }
+  bytes_ns = sim_clock_ns() - t0;
+  (void)sink;
+
+  printf("packed frames: %u per format (%u formats) and %u of random lengths read as their bytes\n",
+         frames, WIEG_FMT_COUNT, frames);
+  printf("packed frames: %u bytes per frame, %u at a byte per bit\n", (unsigned)sizeof(packed[0].bits), WIEG_BUFFER_SIZE);
+  printf("packed decode: %.1f ns per frame host, %.1f at a byte per bit\n",
+         (double)packed_ns / (SIM_PACKED_ROUNDS * WIEG_FMT_COUNT * SIM_PACKED_BENCH),
+         (double)bytes_ns / (SIM_PACKED_ROUNDS * WIEG_FMT_COUNT * SIM_PACKED_BENCH));
+  return true;
+}
+
+/*===========================================================================
+ * Settings store.
+ *===========================================================================*/
+
+/* The flash past the code (see ld/STM32F042x6_WIEG.ld), up to FLASH_ADDR's page */
+#define SIM_FLASH_BASE 0x08006000
+#define SIM_FLASH_SIZE (FLASH_ADDR + FLASH_PAGE_SIZE - SIM_FLASH_BASE)
+
+/* Keys saved to (not the print mode's or the event log's), and saves between resets */
+#define SIM_CFG_KEY_FIRST 2
+#define SIM_CFG_KEYS 4
+#define SIM_CFG_RESET 97
+
+static int16_t sim_cfg_len[SIM_CFG_KEYS];
+static uint8_t sim_cfg_value[SIM_CFG_KEYS][CFG_VALUE_MAX];
+
+/* Power cuts (-X): one in sim_cuts saves, and what they left */
+static uint32_t sim_cuts = 0;
+static struct {
+  uint32_t old;        /* the value saved before was left */
+  uint32_t new;        /* ... the new one */
+} sim_cut_stats;
+
+/* Saves that hit a write failure (-W) and said so */
+static uint32_t sim_fails_reported = 0;
+
+/* The store has the values saved last */
+static bool sim_cfg_check(void) {
+  uint8_t buf[CFG_VALUE_MAX];
+  uint8_t k;
+
+  for(k=0; k<SIM_CFG_KEYS; k++) {
+    if((cfg_get(SIM_CFG_KEY_FIRST + k, buf, sizeof(buf)) != sim_cfg_len[k])
+       || ((sim_cfg_len[k] > 0) && memcmp(buf, sim_cfg_value[k], sim_cfg_len[k]))) {
+      if(sim_verbose)
+        printf("key %u: value not the one saved\n", SIM_CFG_KEY_FIRST + k);
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * cfg_set() with the power cut at its ops'th flash operation, if it
+ * gets that far. Returns false if it was cut.
+ */
+static bool sim_cfg_set_cut(uint8_t key, const uint8_t *value, uint8_t len, uint32_t ops) {
+  sim_flash_cut_in = ops;
+  if(setjmp(sim_flash_cut) != 0)
+    return false;
+  cfg_set(key, value, len);
+  sim_flash_cut_in = 0;
+  return true;
+}
+
+/* After a cut save of key: the old value or the new one is there */
+static bool sim_cfg_cut_check(uint8_t k, const uint8_t *value, uint8_t len) {
+  uint8_t buf[CFG_VALUE_MAX];
+  int got;
+
+  cfg_init();
+  got = cfg_get(SIM_CFG_KEY_FIRST + k, buf, sizeof(buf));
+  if((got == len) && !memcmp(buf, value, len)) {
+    sim_cut_stats.new++;
+    sim_cfg_len[k] = len;
+    memcpy(sim_cfg_value[k], value, len);
+  } else if((got == sim_cfg_len[k]) && ((got < 0) || !memcmp(buf, sim_cfg_value[k], got))) {
+    sim_cut_stats.old++;
+  } else {
+    if(sim_verbose)
+      printf("key %u: neither the old nor the new value after a power cut\n", SIM_CFG_KEY_FIRST + k);
+    return false;
+  }
+  return sim_cfg_check();
+}
+
+/*
+ * cfg_set() with its ops'th halfword failing, if it gets that far. A
+ * save that fails has to say so and leave the old value, also after a
+ * reset. Returns false if it does not.
+ */
+static bool sim_cfg_set_fail(uint8_t k, const uint8_t *value, uint8_t len, uint32_t ops) {
+  bool ok;
+
+  sim_flash_fail_in = ops;
+  ok = cfg_set(SIM_CFG_KEY_FIRST + k, value, len);
+  if(sim_flash_fail_in != 0) {
+    /* done in fewer halfwords */
+    sim_flash_fail_in = 0;
+    sim_cfg_len[k] = len;
+    memcpy(sim_cfg_value[k], value, len);
+    return ok && sim_cfg_check();
+  }
+  if(ok) {
+    if(sim_verbose)
+      printf("key %u: a flash write failed, the save did not say so\n", SIM_CFG_KEY_FIRST + k);
+    return false;
+  }
+  sim_fails_reported++;
+  if(!sim_cfg_check())
+    return false;
+  cfg_init();
+  return sim_cfg_check();
+}
+
+/*
+ * Save random values, of any length, to random keys; one in eight is
+ * the key's value again, which writes nothing. With sim_cuts, one save
+ * in that many has the power cut at one of its first 20 flash
+ * operations (a record is up to 18 halfwords) or, one time in four, its
+ * first 256, which takes in a compaction of the store's page. Returns false if a save fails
+ * or a value read back is not the one saved.
+ */
+static bool sim_settings(uint32_t saves) {
+  uint8_t value[CFG_VALUE_MAX];
+  uint8_t k, len, j;
+  uint32_t i;
+
+  for(k=0; k<SIM_CFG_KEYS; k++) {
+    sim_cfg_len[k] = cfg_get(SIM_CFG_KEY_FIRST + k, sim_cfg_value[k], CFG_VALUE_MAX);
+  }
+  for(i=0; i<saves; i++) {
+    k = rand() % SIM_CFG_KEYS;
+    if((sim_cfg_len[k] >= 0) && ((rand() % 8) == 0)) {
+      len = sim_cfg_len[k];
+      memcpy(value, sim_cfg_value[k], len);
+    } else {
+      len = rand() % (CFG_VALUE_MAX + 1);
+      for(j=0; j<len; j++)
+        value[j] = rand();
+    }
+    if((sim_cuts > 0) && ((rand() % sim_cuts) == 0)) {
+      if(!sim_cfg_set_cut(SIM_CFG_KEY_FIRST + k, value, len, 1 + rand() % ((rand() % 4) ? 20 : 256))) {
+        if(!sim_cfg_cut_check(k, value, len))
+          return false;
+        continue;
+      }
+    } else if((sim_fails > 0) && ((rand() % sim_fails) == 0)) {
+      if(!sim_cfg_set_fail(k, value, len, 1 + rand() % ((rand() % 4) ? 18 : 256)))
+        return false;
+      continue;
+    } else if(!cfg_set(SIM_CFG_KEY_FIRST + k, value, len)) {
+      if(sim_verbose)
+        printf("save %u: key %u not saved\n", i, SIM_CFG_KEY_FIRST + k);
+      return false;
+    }
+    sim_cfg_len[k] = len;
+    memcpy(sim_cfg_value[k], value, len);
+    if(!sim_cfg_check())
+      return false;
+    if((i % SIM_CFG_RESET) == SIM_CFG_RESET - 1) {
+      cfg_init();
+      if(!sim_cfg_check())
+        return false;
+    }
+  }
+  return true;
+}
+
+/*===========================================================================
+ * Card database.
+ *===========================================================================*/
+
+/*
+ * Cards used (in ascending order, all even, two by two the same in the
+ * low 32 bits) and operations between resets
+ */
+#define SIM_DB_IDS 256
+#define SIM_DB_RESET 53
+
+static uint64_t sim_db_id[SIM_DB_IDS];
+static int16_t sim_db_flags[SIM_DB_IDS];   /* -1: not listed */
+static uint32_t sim_db_gen;
+static struct {
+  uint32_t loads;
+  uint32_t syncs;
+  uint32_t changes;
+  uint32_t compactions;
+  uint32_t cut_banks;  /* power cuts while a bank was written */
+  uint32_t cut_old;    /* ... that left the database as before */
+  uint32_t cut_new;    /* ... as after */
+  uint32_t peeks;      /* lookups during flash operations */
+  uint32_t peek_errors;
+  uint32_t fails;      /* operations that hit a write failure */
+} sim_db_stats;
+
+/* The database before and after the operation in progress, for sim_db_peek() */
+static const int16_t *sim_db_before, *sim_db_after;
+
+/* The database lists the cards of flags, with their flags, and no other */
+static bool sim_db_check(const int16_t *flags, uint32_t gen) {
+  uint8_t f;
+  uint16_t i;
+
+  if(carddb_generation() != gen)
+    return false;
+  for(i=0; i<SIM_DB_IDS; i++) {
+    if(carddb_lookup(sim_db_id[i], &f) ? (flags[i] != f) : (flags[i] >= 0))
+      return false;
+    if(carddb_lookup(sim_db_id[i] + 1, &f) || carddb_lookup((uint32_t)sim_db_id[i], &f))
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Run at each flash operation, as a lookup from the receive thread can
+ * come in between any two: a card reads as before the operation or as
+ * after it.
+ */
+static void sim_db_peek(void) {
+  uint16_t i = rand() % SIM_DB_IDS;
+  int16_t got;
+  uint8_t f;
+
+  if(sim_db_before == NULL)
+    return;
+  got = carddb_lookup(sim_db_id[i], &f) ? f : -1;
+  sim_db_stats.peeks++;
+  if((got != sim_db_before[i]) && (got != sim_db_after[i])) {
+    sim_db_stats.peek_errors++;
+    if(sim_verbose && (sim_db_stats.peek_errors <= 10))
+      printf("card %016llx read %d during an operation, %d before it, %d after\n",
+             (unsigned long long)sim_db_id[i], got, sim_db_before[i], sim_db_after[i]);
+  }
+}
+
+/* Load a random half of the cards */
+static bool sim_db_load(int16_t *flags) {
+  uint16_t i, count = 0;
+
+  for(i=0; i<SIM_DB_IDS; i++) {
+    flags[i] = (rand() % 2) ? (rand() & (CARDDB_GRANT | CARDDB_EXTENDED)) : -1;
+    if(flags[i] >= 0)
+      count++;
+  }
+  if(!carddb_load_begin(count))
+    return false;
+  for(i=0; i<SIM_DB_IDS; i++) {
+    if((flags[i] >= 0) && !carddb_load_add(sim_db_id[i], flags[i]))
+      return false;
+  }
+  sim_db_stats.loads++;
+  return carddb_load_end();
+}
+
+/* Sync a batch of 1 to 16 random changes, a card may change more than once */
+static bool sim_db_sync(int16_t *flags) {
+  uint8_t n = 1 + rand() % 16;
+  uint8_t j, f, op;
+  uint16_t i;
+
+  if(!carddb_sync_begin(carddb_generation(), n))
+    return false;
+  for(j=0; j<n; j++) {
+    i = rand() % SIM_DB_IDS;
+    if((rand() % 3) == 0) {
+      op = CARDDB_OP_DEL;
+      f = 0;
+      flags[i] = -1;
+    } else {
+      op = CARDDB_OP_ADD;
+      f = rand() & (CARDDB_GRANT | CARDDB_EXTENDED);
+      flags[i] = f;
+    }
+    if(!carddb_sync_change(sim_db_id[i], f, op))
+      return false;
+  }
+  sim_db_stats.syncs++;
+  sim_db_stats.changes += n;
+  return carddb_sync_end();
+}
+
+/* Operations, picked at random: one in SIM_DB_OPS is a load, one a compaction, the others syncs */
+#define SIM_DB_OPS     64
+#define SIM_DB_LOAD    0
+#define SIM_DB_COMPACT 1
+
+/* Flash operations the last load or compaction took */
+static uint32_t sim_db_bank_ops = 400;
+
+/*
+ * Operation op on the database (syncs compact when the journal is
+ * full); flags and gen are updated to what the database should be
+ * after it.
+ */
+static bool sim_db_op(uint8_t op, int16_t *flags, uint32_t *gen) {
+  switch(op) {
+    case SIM_DB_LOAD:
+      (*gen)++;
+      return sim_db_load(flags);
+    case SIM_DB_COMPACT:
+      sim_db_stats.compactions++;
+      return carddb_compact();
+    default:
+      (*gen)++;
+      return sim_db_sync(flags);
+  }
+}
+
+/*
+ * sim_db_op() with the power cut at its ops'th flash operation, if it
+ * gets that far. Returns false if it was cut, else its result in ok.
+ */
+static bool sim_db_op_cut(uint8_t op, int16_t *flags, uint32_t *gen, uint32_t ops, bool *ok) {
+  sim_flash_cut_in = ops;
+  if(setjmp(sim_flash_cut) != 0)
+    return false;
+  *ok = sim_db_op(op, flags, gen);
+  sim_flash_cut_in = 0;
+  return true;
+}
+
+/* True if op may write a bank: a load, a compaction or a sync that compacts */
+static bool sim_db_bank_op(uint8_t op) {
+  return (op == SIM_DB_LOAD) || (op == SIM_DB_COMPACT)
+         || (carddb_journal_used() + 17U > CARDDB_JOURNAL_CAPACITY);
+}
+
+/*
+ * Where to cut op: a sync within its up to 102 halfwords; one that
+ * compacts, a load or a compaction anywhere in it or, one time in two
+ * for the latter, about its last 24 flash operations, where the new
+ * bank is committed and the journal restarted.
+ */
+static uint32_t sim_db_cut_at(uint8_t op) {
+  if(!sim_db_bank_op(op))
+    return 1 + rand() % 104;
+  if((op != SIM_DB_LOAD) && (op != SIM_DB_COMPACT))
+    return 1 + rand() % (sim_db_bank_ops + 104);
+  if((rand() % 2) && (sim_db_bank_ops > 24))
+    return sim_db_bank_ops - 24 + rand() % 32;
+  return 1 + rand() % (sim_db_bank_ops + 8);
+}
+
+/* After a cut operation: the database found is the one before it or after */
+static bool sim_db_cut_check(const int16_t *flags, uint32_t gen, uint32_t bank_wear) {
+  carddb_init();
+  if((sim_flash_wear_count(CARDDB_BANK_ADDR(0)) + sim_flash_wear_count(CARDDB_BANK_ADDR(1))) != bank_wear)
+    sim_db_stats.cut_banks++;
+  if(sim_db_check(sim_db_flags, sim_db_gen)) {
+    sim_db_stats.cut_old++;
+  } else if(sim_db_check(flags, gen)) {
+    sim_db_stats.cut_new++;
+    memcpy(sim_db_flags, flags, sizeof(sim_db_flags));
+    sim_db_gen = gen;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/*
+ * After an operation that failed on a write failure: the database is
+ * the one before it, also after a reset. (One that hit it restarting
+ * the journal after committing a bank succeeds, the next sync tries
+ * again.)
+ */
+static bool sim_db_fail_check(void) {
+  sim_db_stats.fails++;
+  if(!sim_db_check(sim_db_flags, sim_db_gen))
+    return false;
+  carddb_init();
+  return sim_db_check(sim_db_flags, sim_db_gen);
+}
+
+/*
+ * Random operations on the card database, each checked against what it
+ * should hold, as is the database found after each simulated reset.
+ * With sim_cuts, one operation in that many, and one in two of those
+ * that write a bank, has the power cut (see sim_db_cut_at()): after the
+ * reset the database has to be the one before or after it. With
+ * sim_fails, as many have a halfword fail instead.
+ * Returns false on a failed operation or a card listed wrong.
+ */
+static bool sim_carddb(uint32_t ops) {
+  static int16_t flags[SIM_DB_IDS];
+  uint32_t i, low, gen, bank_wear, done;
+  uint8_t op;
+  bool ok;
+
+  for(i=0; i<SIM_DB_IDS; i++) {
+    low = (i & 1) ? (uint32_t)sim_db_id[i-1] : ((i << 22) | (rand() & 0x3FFFFE));
+    sim_db_id[i] = ((uint64_t)(i + 1) << 48) | ((uint64_t)(rand() & 0xFFFF) << 32) | low;
+    sim_db_flags[i] = -1;
+  }
+  carddb_clear();
+  sim_db_gen = carddb_generation();
+  sim_db_before = sim_db_flags;
+  sim_db_after = flags;
+  sim_flash_done = sim_db_peek;
+  for(i=0; i<ops; i++) {
+    memcpy(flags, sim_db_flags, sizeof(flags));
+    gen = sim_db_gen;
+    op = rand() % SIM_DB_OPS;
+    bank_wear = sim_flash_wear_count(CARDDB_BANK_ADDR(0)) + sim_flash_wear_count(CARDDB_BANK_ADDR(1));
+    done = sim_flash.erases + sim_flash.programs;
+    if((sim_cuts > 0) && ((rand() % (sim_db_bank_op(op) ? 2 : sim_cuts)) == 0)) {
+      if(!sim_db_op_cut(op, flags, &gen, sim_db_cut_at(op), &ok)) {
+        if(!sim_db_cut_check(flags, gen, bank_wear)) {
+          if(sim_verbose)
+            printf("operation %u: neither the database before nor after a power cut\n", i);
+          return false;
+        }
+        continue;
+      }
+    } else if((sim_fails > 0) && ((rand() % (sim_db_bank_op(op) ? 2 : sim_fails)) == 0)) {
+      sim_flash_fail_in = sim_db_cut_at(op);
+      ok = sim_db_op(op, flags, &gen);
+      if(sim_flash_fail_in != 0) {
+        /* done before the halfword */
+        sim_flash_fail_in = 0;
+      } else if(!ok) {
+        if(!sim_db_fail_check()) {
+          if(sim_verbose)
+            printf("operation %u: not the database before a write failure\n", i);
+          return false;
+        }
+        continue;
+      }
+    } else {
+      ok = sim_db_op(op, flags, &gen);
+    }
+    if(((op == SIM_DB_LOAD) || (op == SIM_DB_COMPACT))
+       && (sim_flash_wear_count(CARDDB_BANK_ADDR(0)) + sim_flash_wear_count(CARDDB_BANK_ADDR(1)) != bank_wear)) {
+      sim_db_bank_ops = sim_flash.erases + sim_flash.programs - done;
+    }
+    if(!ok) {
+      if(sim_verbose)
+        printf("operation %u failed\n", i);
+      return false;
+    }
+    memcpy(sim_db_flags, flags, sizeof(flags));
+    sim_db_gen = gen;
+    if((i % SIM_DB_RESET) == SIM_DB_RESET - 1) {
+      carddb_init();
+    }
+    if(!sim_db_check(sim_db_flags, sim_db_gen)) {
+      if(sim_verbose)
+        printf("operation %u: database not as written\n", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+/*===========================================================================
+ * Main.
+ *===========================================================================*/
+
+static uint16_t sim_mode(const char *name) {
+  if(!strcmp(name, "bin"))
+    return MODE_BIN;
+  if(!strcmp(name, "debug"))
+    return MODE_DEBUG;
+  if(!strcmp(name, "err"))
+    return MODE_ERR;
+  if(!strcmp(name, "26"))
+    return MODE_26;
+  if(!strcmp(name, "34"))
+    return MODE_34;
+  if(!strcmp(name, "ext"))
+    return MODE_EXT;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t frames = 10000;
+  uint8_t readers = WIEG_NUM_READERS;
+  uint8_t err_pct = 5, glitch_pct = 0;
+  uint16_t jitter = 0;
+  uint16_t mode = MODE_BIN;
+  const char *replay = NULL, *record = NULL, *capture = NULL, *flash = NULL;
+  const uint32_t cfg_pages[] = {CFG_PAGE_ADDRS};
+  uint32_t saves = 0, db_ops = 0, packed = 0;
+  const uint8_t *rec;
+  uint16_t rec_len;
+  FILE *trace = NULL;
+  uint64_t t0, total_ns;
+  uint32_t glitches = 0, short_gaps = 0;
+  uint32_t counted = 0, parity = 0, dropped = 0;
+  uint16_t early = 0;
+  bool fixed = false;
+  bool keypad = false;
+  bool proxy = false;
+  bool osdp = false, osdp_ok = true;
+  bool failed = false;
+  uint8_t i, j;
+  int c;
+
+  srand(1);
+  while((c = getopt(argc, argv, "n:r:e:g:j:fkpos:m:t:w:c:vF:L:S:X:W:D:H:B:")) != -1) {
+    switch(c) {
+      case 'n': frames = strtoul(optarg, NULL, 0); break;
+      case 'r': readers = strtoul(optarg, NULL, 0); break;
+      case 'e': err_pct = strtoul(optarg, NULL, 0); break;
+      case 'g': glitch_pct = strtoul(optarg, NULL, 0); break;
+      case 'j': jitter = strtoul(optarg, NULL, 0); break;
+      case 'f': fixed = true; break;
+      case 'k': keypad = true; break;
+      case 'p': proxy = true; break;
+      case 'o': osdp = true; break;
+      case 's': srand(strtoul(optarg, NULL, 0)); break;
+      case 'm': mode = sim_mode(optarg); break;
+      case 't': replay = optarg; break;
+      case 'w': record = optarg; break;
+      case 'c': capture = optarg; break;
+      case 'v': sim_verbose = true; break;
+      case 'F': flash = optarg; break;
+      case 'L':
+        if(sscanf(optarg, "%u,%u", &sim_flash.erase_us, &sim_flash.program_us) != 2) {
+          fprintf(stderr, "bad flash latency\n");
+          return 2;
+        }
+        break;
+      case 'S': saves = strtoul(optarg, NULL, 0); break;
+      case 'X': sim_cuts = strtoul(optarg, NULL, 0); break;
+      case 'W': sim_fails = strtoul(optarg, NULL, 0); break;
+      case 'D': db_ops = strtoul(optarg, NULL, 0); break;
+      case 'B': packed = strtoul(optarg, NULL, 0); break;
+      case 'H':
+        if((sscanf(optarg, "%u,%u", &sim_host.closed, &sim_host.open) != 2) || (sim_host.closed == 0)) {
+          fprintf(stderr, "bad host closed,open frames\n");
+          return 2;
+        }
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n frames] [-r readers] [-e err%%] [-g glitch%%] [-j jitter us] [-f] [-k] [-p] [-o]\n"
+                        "       [-s seed] [-m bin|debug|err|26|34|ext] [-t trace] [-w trace] [-c capture] [-v]\n"
+                        "       [-F flash file] [-L erase us,program us] [-S saves] [-D ops] [-X n] [-H closed,open]\n"
+                        "       [-B frames]\n", argv[0]);
+        return 2;
+    }
+  }
+  if((mode == 0) || (readers < 1) || (readers > WIEG_NUM_READERS) || (jitter > WIEG_PAUSE_WIDTH_US/4)) {
+    fprintf(stderr, "bad mode, reader count or jitter\n");
+    return 2;
+  }
+
+  if(packed > 0) {
+    failed = !sim_packed(packed);
+    if(failed) {
+      printf("FAILED\n");
+    }
+    return failed ? 1 : 0;
+  }
+
+  if(!sim_flash_open(flash, SIM_FLASH_BASE, SIM_FLASH_SIZE, FLASH_PAGE_SIZE)) {
+    perror((flash != NULL) ? flash : "flash");
+    return 1;
+  }
+  wieg_init();
+  print_mode = mode;
+
+  if(saves > 0) {
+    t0 = sim_clock_ns();
+    failed = !sim_settings(saves);
+    total_ns = sim_clock_ns() - t0;
+    printf("settings: %u saves, %u erases, %u halfwords programmed, %u bytes of the page in use (generation %u)\n",
+           saves, sim_flash.erases, sim_flash.programs, cfg_used(), cfg_generation());
+    printf("settings wear:");
+    for(i=0; i<sizeof(cfg_pages)/sizeof(cfg_pages[0]); i++) {
+      printf(" %u", sim_flash_wear_count(cfg_pages[i]));
+    }
+    printf(" erases per page\n");
+    if(sim_cuts > 0) {
+      printf("settings power cuts: %u (%u erasing), %u left the old value, %u the new one\n",
+             sim_flash.cuts, sim_flash.cut_erases, sim_cut_stats.old, sim_cut_stats.new);
+    }
+    if(sim_fails > 0) {
+      printf("settings write failures: %u, %u reported with the old values kept\n",
+             sim_flash.fails, sim_fails_reported);
+    }
+    if(sim_flash.busy_us > 0) {
+      printf("settings rate: %.0f saves/s on the device (%.3f s flash busy)\n",
+             saves / (sim_flash.busy_us / 1e6), sim_flash.busy_us / 1e6);
+    }
+    printf("settings rate: %.0f saves/s host (%.3f s)\n", saves / (total_ns / 1e9), total_ns / 1e9);
+    failed = failed || (sim_flash.errors != 0);
+    if(failed) {
+      printf("FAILED%s\n", (sim_flash.errors != 0) ? " (flash errors)" : "");
+    }
+    sim_flash_close();
+    return failed ? 1 : 0;
+  }
+  if(db_ops > 0) {
+    t0 = sim_clock_ns();
+    failed = !sim_carddb(db_ops) || (sim_db_stats.peek_errors != 0);
+    total_ns = sim_clock_ns() - t0;
+    printf("carddb: %u operations, %u loads, %u syncs of %u changes, %u compactions asked, %u cards (generation %u)\n",
+           db_ops, sim_db_stats.loads, sim_db_stats.syncs, sim_db_stats.changes, sim_db_stats.compactions,
+           carddb_count(), carddb_generation());
+    printf("carddb wear: %u %u erases per bank, %u of the journal\n",
+           sim_flash_wear_count(CARDDB_BANK_ADDR(0)), sim_flash_wear_count(CARDDB_BANK_ADDR(1)),
+           sim_flash_wear_count(CARDDB_JOURNAL_ADDR));
+    printf("carddb lookups during flash operations: %u, %u neither as before nor as after\n",
+           sim_db_stats.peeks, sim_db_stats.peek_errors);
+    if(sim_cuts > 0) {
+      printf("carddb power cuts: %u (%u erasing, %u in a bank write), %u left the database as before, %u as after\n",
+             sim_flash.cuts, sim_flash.cut_erases, sim_db_stats.cut_banks, sim_db_stats.cut_old, sim_db_stats.cut_new);
+    }
+    if(sim_fails > 0) {
+      printf("carddb write failures: %u, %u operations failed with the database left as before\n",
+             sim_flash.fails, sim_db_stats.fails);
+    }
+    printf("carddb rate: %.0f operations/s host (%.3f s)\n", db_ops / (total_ns / 1e9), total_ns / 1e9);
+    failed = failed || (sim_flash.errors != 0);
+    if(failed) {
+      printf("FAILED%s\n", (sim_flash.errors != 0) ? " (flash errors)" : "");
+    }
+    sim_flash_close();
+    return failed ? 1 : 0;
+  }
+  if(keypad) {
+    print_mode |= MODE_KEYPAD;
+    err_pct = 0;
+  }
+  if(proxy) {
+    readers = 1;
+    wieg_proxy.readers = 1 << 0;
+    sim_pad_output = sim_fwd_pad;
+  }
+  if(capture != NULL) {
+    wieg_capture_start(0, 0xFFFF);
+  }
+
+  t0 = sim_clock_ns();
+  if(replay != NULL) {
+    trace = fopen(replay, "r");
+    if((trace == NULL) || !sim_replay(trace)) {
+      perror(replay);
+      return 1;
+    }
+    fclose(trace);
+  } else {
+    if(record != NULL) {
+      trace = fopen(record, "w");
+      if(trace == NULL) {
+        perror(record);
+        return 1;
+      }
+    }
+    sim_check = (mode == MODE_BIN);
+    if(osdp) {
+      sim_any_time = true;
+      sim_reschedule = sim_receive;
+      osdp_ok = sim_osdp(frames, readers, err_pct, keypad);
+    } else {
+      sim_pad_lookahead = sim_edges_lookahead;
+      sim_flash_done = sim_edges_due;
+      sim_synthetic(frames, readers, err_pct, jitter, glitch_pct, fixed, keypad, proxy, trace);
+    }
+    if(trace != NULL)
+      fclose(trace);
+  }
+  total_ns = sim_clock_ns() - t0;
+
+  for(i=0; i<WIEG_NUM_READERS; i++) {
+    glitches += WIEGD[i].sigstats.glitches + WIEGD[i].sigstats.filtered;
+    early += WIEGD[i].sigstats.early;
+    /* gaps in buckets below the shortest sent: a glitch was counted */
+    for(j=0; (j<WIEG_HIST_BUCKETS) && ((2UL << j) <= (uint32_t)(WIEG_PAUSE_WIDTH_US - jitter)); j++)
+      short_gaps += WIEGD[i].sigstats.gap[j];
+  }
+  if(replay == NULL) {
+    printf("frames: %u sent", stats.sent);
+    if(sim_check) {
+      printf(", %u received, %u decoded, %u mismatched, %u unexpected",
+             stats.received, stats.decoded, stats.mismatches, stats.unexpected);
+      failed = (stats.received + sim_host.lost != stats.sent) || (stats.mismatches != 0) || (stats.unexpected != 0)
+               || (stats.seq_errors != 0);
+    }
+    printf("\nglitches: %u injected, %u rejected, %u gaps counted shorter than sent\n",
+           stats.glitches, glitches, short_gaps);
+    failed = failed || (glitches != stats.glitches) || (short_gaps != 0);
+  } else {
+    printf("edges: %llu, glitches rejected: %u\n", (unsigned long long)stats.edges, glitches);
+  }
+  if(sim_host.closed > 0) {
+    printf("host: port closed %u times, %u resets, %u events replayed, %u lost in resets, %u lost to a full log%s\n",
+           sim_host.closes, sim_host.resets, stats.replayed, sim_host.lost, wieg_log_lost,
+           (stats.seq_errors != 0) ? ", sequence numbers out of order" : "");
+    failed = failed || (stats.replayed == 0) || (wieg_log_lost != 0) || (wieg_log_pending() != 0);
+    if(sim_fails > 0)
+      printf("host: %u flash write failures\n", sim_flash.fails);
+  }
+  if(proxy) {
+    printf("proxy: %u expected, %u forwarded, %u received, %u mismatched, %u dropped\n",
+           stats.fwd_expected, wieg_proxy.forwarded, stats.fwd_received, stats.fwd_mismatches, wieg_proxy.dropped);
+    if(stats.fwd_received > 0) {
+      printf("forwarding delay: avg %llu us, max %llu us (device: max %u us), %u slow\n",
+             (unsigned long long)(stats.fwd_us / stats.fwd_received), (unsigned long long)stats.fwd_us_max,
+             WIEG_ST2US(wieg_proxy.delay_max), stats.fwd_slow);
+    }
+    failed = failed || (stats.fwd_received != stats.fwd_expected) || (stats.fwd_mismatches != 0);
+    failed = failed || (stats.fwd_slow != 0);
+  }
+  if(osdp) {
+    osdp_pd_t total = {0};
+    for(i=0; i<readers; i++) {
+      total.polls += osdp_pds[i].polls;
+      total.timeouts += osdp_pds[i].timeouts;
+      total.errors += osdp_pds[i].errors;
+      total.cards += osdp_pds[i].cards;
+      total.keys += osdp_pds[i].keys;
+      total.lost += osdp_pds[i].lost;
+    }
+    printf("osdp: %u polls, %u timeouts, %u errors, %u cards, %u keys, %u lost\n",
+           total.polls, total.timeouts, total.errors, total.cards, total.keys, total.lost);
+    printf("osdp line: %u replies dropped, %u corrupted, %u busy, %u PD restarts%s\n",
+           sim_pds.dropped, sim_pds.corrupted, sim_pds.busy, sim_pds.restarts,
+           osdp_ok ? "" : ", polling stuck or PD state wrong");
+    failed = failed || !osdp_ok || (total.cards != stats.sent) || (total.lost != 0);
+  }
+  if(capture != NULL) {
+    wieg_capture_stop();
+    rec = wieg_capture_record(&rec_len);
+    trace = fopen(capture, "wb");
+    if((trace == NULL) || (fwrite(rec, 1, rec_len, trace) != rec_len)) {
+      perror(capture);
+      return 1;
+    }
+    fclose(trace);
+    printf("capture: %u frames in %u bytes%s\n", rec[6] | (rec[7] << 8), rec_len,
+           (rec[5] & WIEG_CAP_FULL) ? " (buffer full)" : "");
+  }
+  for(i=0; i<WIEG_NUM_READERS; i++) {
+    counted += wieg_stats.reader[i].frames;
+    parity += wieg_stats.reader[i].parity;
+    dropped += wieg_stats.reader[i].dropped;
+  }
+  printf("counters: %u frames, %u bad parity, %u dropped\n", counted, parity, dropped);
+  if(sim_check && !keypad) {
+    /* with -k the key presses are frames too */
+    failed = failed || (counted != stats.received + sim_host.lost);
+  }
+  for(i=0; i<WIEG_NUM_READERS; i++) {
+    if(WIEGD[i].queue.overruns != 0) {
+      printf("reader %u: %u overruns\n", i+1, WIEGD[i].queue.overruns);
+    }
+  }
+  if(stats.edges > 0) {
+    printf("edge callback: avg %llu ns, max %llu ns\n",
+           (unsigned long long)(stats.edge_ns / stats.edges), (unsigned long long)stats.edge_ns_max);
+  }
+  if(stats.frames > 0) {
+    printf("end of frame: avg %llu us, max %llu us after the last bit, %u at a known length\n",
+           (unsigned long long)(stats.eof_us / stats.frames), (unsigned long long)stats.eof_us_max, early);
+    printf("frame processing: avg %llu ns, max %llu ns\n",
+           (unsigned long long)(stats.frame_ns / stats.frames), (unsigned long long)stats.frame_ns_max);
+    printf("output: %.1f bytes, %.1f writes per frame\n",
+           (double)stats.out_bytes / stats.frames, (double)stats.out_writes / stats.frames);
+    printf("throughput: %.0f frames/s (%.3f s host time)\n",
+           stats.frames / ((stats.edge_ns + stats.frame_ns) / 1e9), total_ns / 1e9);
+  }
+  if((sim_flash.erases > 0) || (sim_flash.programs > 0) || (sim_flash.errors > 0)) {
+    printf("flash: %u erases, %u halfwords programmed, %u errors\n",
+           sim_flash.erases, sim_flash.programs, sim_flash.errors);
+    failed = failed || (sim_flash.errors != 0);
+  }
+  sim_flash_close();
+  if(failed) {
+    printf("FAILED\n");
+  }
+  return failed ? 1 : 0;
+}
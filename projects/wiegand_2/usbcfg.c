@@ -285,12 +285,21 @@ static const USBEndpointConfig ep2config = {
   NULL
 };
 
+/*
+ * The host has the port open: DTR in its last SET_CONTROL_LINE_STATE
+ * (set on open, cleared on close by terminals and pyserial alike).
+ */
+#define CDC_CONTROL_LINE_DTR 0x01
+
+volatile bool usb_port_open = false;
+
 /*
  * Handles the USB driver global events.
  */
 static void usb_event(USBDriver *usbp, usbevent_t event) {
   switch(event) {
   case USB_EVENT_RESET:
+    usb_port_open = false;
     return;
 
   case USB_EVENT_ADDRESS:
@@ -316,6 +325,7 @@ static void usb_event(USBDriver *usbp, usbevent_t event) {
 
     /* Disconnection event on suspend.*/
     sduDisconnectI(&OUTPUT_CHANNEL);
+    usb_port_open = false;
 
     chSysUnlockFromISR();
     return;
@@ -329,6 +339,18 @@ static void usb_event(USBDriver *usbp, usbevent_t event) {
   return;
 }
 
+/*
+ * Class requests go to the serial-over-USB driver, after noting the
+ * DTR line.
+ */
+static bool requests_hook(USBDriver *usbp) {
+  if(((usbp->setup[0] & USB_RTYPE_TYPE_MASK) == USB_RTYPE_TYPE_CLASS)
+     && (usbp->setup[1] == CDC_SET_CONTROL_LINE_STATE)) {
+    usb_port_open = (usbp->setup[2] & CDC_CONTROL_LINE_DTR) != 0;
+  }
+  return sduRequestsHook(usbp);
+}
+
 /*
  * Handles the Start of Frame event.
  */
@@ -347,7 +369,7 @@ static void sof_handler(USBDriver *usbp) {
 const USBConfig usbcfg = {
   usb_event,
   get_descriptor,
-  sduRequestsHook,
+  requests_hook,
   sof_handler
 };
 
@@ -25,6 +25,9 @@
 
 #define OUTPUT_CHANNEL SDU1
 
+/* The host has the port open (DTR set), see usbcfg.c */
+extern volatile bool usb_port_open;
+
 #ifndef INCLUDED_FROM_USBCFG_C
 
 extern const USBConfig usbcfg;
@@ -0,0 +1,64 @@
+/*
+ * (c) 2016 flabbergast <s3+flabbergast@sdfeu.org>
+ * Licensed under the Apache License, Version 2.0.
+ */
+
+/*
+ * Wiegand card formats.
+ *
+ * Each X() line describes one format; adding a format only takes a new
+ * line here. The table is expanded in wiegand.c into the format
+ * descriptors and a bit-length -> format lookup, so there can be only
+ * one format per bit length (a duplicate triggers -Woverride-init).
+ *
+ * Bit positions count from 0 = first bit on the wire. Parity masks are
+ * over the frame value, where frame bit i is value bit (length-1-i), and
+ * include the parity bit itself. A zero mask is an unused parity slot.
+ *
+ * X(id, name, length, mode,
+ *   parity1, parity2, parity3,
+ *   facility start, facility length,
+ *   card start, card length,
+ *   printed value start, printed value length)
+ */
+
+#ifndef WIEG_FORMATS_H
+#define WIEG_FORMATS_H
+
+/* Frames longer than this are never classified */
+#define WIEG_FORMAT_MAX_LENGTH 64
+
+/* Mask of len bits starting at bit start in an n-bit frame */
+#define WIEG_RANGE(n, start, len) ((((uint64_t)1 << (len)) - 1) << ((n) - (start) - (len)))
+
+#define WIEG_EVEN(mask) {(mask), 0}
+#define WIEG_ODD(mask)  {(mask), 1}
+#define WIEG_NONE       {0, 0}
+
+#define WIEG_FORMATS(X) \
+  /* H10301 26-bit: 8-bit facility, 16-bit card */ \
+  X(WIEG_FMT_26, "26", 26, MODE_26, \
+    WIEG_EVEN(WIEG_RANGE(26, 0, 13)), WIEG_ODD(WIEG_RANGE(26, 13, 13)), WIEG_NONE, \
+    1, 8, 9, 16, 1, 24) \
+  /* H10306 34-bit: 16-bit facility, 16-bit card */ \
+  X(WIEG_FMT_34, "34", 34, MODE_34, \
+    WIEG_EVEN(WIEG_RANGE(34, 0, 17)), WIEG_ODD(WIEG_RANGE(34, 17, 17)), WIEG_NONE, \
+    1, 16, 17, 16, 1, 32) \
+  /* HID Corporate 1000 35-bit: 12-bit company, 20-bit card */ \
+  X(WIEG_FMT_35, "35", 35, MODE_EXT, \
+    WIEG_EVEN(0x3B6DB6DB6ULL), WIEG_ODD(0x36DB6DB6DULL), WIEG_ODD(WIEG_RANGE(35, 0, 35)), \
+    2, 12, 14, 20, 2, 32) \
+  /* H10304 37-bit: 16-bit facility, 19-bit card */ \
+  X(WIEG_FMT_37, "37", 37, MODE_EXT, \
+    WIEG_EVEN(WIEG_RANGE(37, 0, 19)), WIEG_ODD(WIEG_RANGE(37, 18, 19)), WIEG_NONE, \
+    1, 16, 17, 19, 1, 35) \
+  /* HID Corporate 1000 48-bit: 22-bit company, 23-bit card */ \
+  X(WIEG_FMT_48, "48", 48, MODE_EXT, \
+    WIEG_EVEN(0x76DB6DB6DB6CULL), WIEG_ODD(0x6DB6DB6DB6DBULL), WIEG_ODD(WIEG_RANGE(48, 0, 48)), \
+    2, 22, 24, 23, 2, 45) \
+  /* 56-bit (7 byte UID), no parity */ \
+  X(WIEG_FMT_56, "56", 56, MODE_EXT, \
+    WIEG_NONE, WIEG_NONE, WIEG_NONE, \
+    0, 24, 24, 32, 0, 56)
+
+#endif /* WIEG_FORMATS_H */
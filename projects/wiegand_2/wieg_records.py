@@ -0,0 +1,138 @@
+#!/usr/bin/env python
+#
+# Decode the binary event records of wiegand_2 ("mode bin"),
+# see the record layout in wiegand.h.
+#
+# Usage: wieg_records.py /dev/ttyACM0   (needs pyserial)
+#        wieg_records.py capture.bin
+#
+# Frames replayed from the device's event log are marked with "R"; ones
+# already shown (same sequence number) are skipped. With the
+# keypad on, a PIN entered after a card is shown with it.
+
+from __future__ import print_function
+
+import os
+import re
+import struct
+import sys
+
+SYNC = 0xA5
+NO_FORMAT = 0xFF
+REPLAYED = 0x80
+PIN = 0x40
+HEADER_SIZE = 21
+
+def crc16(data, crc=0xFFFF):
+    for b in bytearray(data):
+        crc ^= b << 8
+        for _ in range(8):
+            if crc & 0x8000:
+                crc = ((crc << 1) ^ 0x1021) & 0xFFFF
+            else:
+                crc = (crc << 1) & 0xFFFF
+    return crc
+
+# format names, in WIEG_FORMATS order
+def load_formats():
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "wieg_formats.h")
+    try:
+        with open(path) as f:
+            return re.findall(r'X\(\s*\w+\s*,\s*"([^"]*)"', f.read())
+    except IOError:
+        return []
+
+FORMATS = load_formats()
+
+def format_name(fmt):
+    if fmt == NO_FORMAT:
+        return "err"
+    if fmt < len(FORMATS):
+        return FORMATS[fmt]
+    return "fmt%u" % fmt
+
+def records(buf):
+    """Yield (record, rest) for each valid record at the front of buf,
+    skipping garbage (e.g. shell output) and corrupted records."""
+    while True:
+        start = buf.find(bytearray([SYNC]))
+        if start < 0:
+            return
+        buf = buf[start:]
+        if len(buf) < 2:
+            return
+        length = buf[1]
+        if length < HEADER_SIZE + 2:
+            buf = buf[1:]
+            continue
+        if len(buf) < length:
+            return
+        rec = buf[:length]
+        (crc,) = struct.unpack("<H", bytes(rec[-2:]))
+        if crc16(rec[1:-2]) != crc:
+            buf = buf[1:]
+            continue
+        buf = buf[length:]
+        yield rec, buf
+
+def decode(rec):
+    reader, fmt, n, time, value, seq = struct.unpack("<BBBIQI", bytes(rec[2:HEADER_SIZE]))
+    end = HEADER_SIZE + (n + 7) // 8
+    raw = rec[HEADER_SIZE:end]
+    bits = "".join("{0:08b}".format(b) for b in bytearray(raw))[:n]
+    pin = None
+    if reader & PIN:
+        pin = bytes(rec[end + 1:end + 1 + rec[end]]).decode("ascii", "replace")
+    return reader, fmt, n, time, value, seq, bits, pin
+
+# Sequence numbers of the frames shown, to drop replays seen before;
+# they go on over resets of the device (the time does not)
+seen = set()
+
+def show(rec):
+    reader, fmt, n, time, value, seq, bits, pin = decode(rec)
+    if seq in seen:
+        return
+    seen.add(seq)
+    mark = "R" if reader & REPLAYED else " "
+    reader &= ~(REPLAYED | PIN)
+    pin = " PIN %s" % pin if pin is not None else ""
+    if n == 0:
+        print("%8u%s %10u reader %u%s" % (seq, mark, time, reader + 1, pin))
+    elif fmt == NO_FORMAT:
+        print("%8u%s %10u reader %u %s %2u bits %s%s" % (seq, mark, time, reader + 1, format_name(fmt), n, bits, pin))
+    else:
+        print("%8u%s %10u reader %u %s %2u bits %s 0x%X%s" % (seq, mark, time, reader + 1, format_name(fmt), n, bits, value, pin))
+    sys.stdout.flush()
+
+def main():
+    if len(sys.argv) != 2:
+        print("Usage: %s <serial port | capture file>" % sys.argv[0])
+        sys.exit(1)
+
+    buf = bytearray()
+    if os.path.isfile(sys.argv[1]):
+        with open(sys.argv[1], "rb") as f:
+            buf = bytearray(f.read())
+        for rec, buf in records(buf):
+            show(rec)
+        return
+
+    import serial
+    port = serial.Serial(sys.argv[1], timeout=0.1)
+    print("Interrupt with Ctrl-C...")
+    try:
+        while True:
+            buf += bytearray(port.read(64))
+            for rec, rest in records(buf):
+                show(rec)
+                buf = rest
+            # keep a partial record, drop anything without a sync byte
+            start = buf.find(bytearray([SYNC]))
+            buf = buf[start:] if start >= 0 else bytearray()
+    except KeyboardInterrupt:
+        pass
+    port.close()
+
+if __name__ == "__main__":
+    main()
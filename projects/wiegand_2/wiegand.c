@@ -3,388 +3,1782 @@
  * Licensed under the Apache License, Version 2.0.
  */
 
+#include <string.h>
+
 #include "ch.h"
 #include "hal.h"
 
 #include "usbcfg.h"
 #include "flash.h"
+#include "crc16.h"
+#include "carddb.h"
 #include "wiegand.h"
+#include "cfgstore.h"
+#include "wieg_formats.h"
 
 /*===========================================================================
  * Global variables.
  *===========================================================================*/
 
-volatile systime_t wieg1_last_pulse_time;
-volatile uint8_t wieg1_reading_sequence = 0;
-static uint8_t wieg1_buffer[WIEG_BUFFER_SIZE];
-volatile uint8_t wieg1_buffer_pos = 0;
+static const WiegandConfig wieg_configs[WIEG_NUM_READERS] = {
+#if defined(F042)
+#define WIEG_EXT_CH(n, line) \
+  {EXT_CH_MODE_BOTH_EDGES | EXT_CH_MODE_AUTOSTART | WIEG##n##_IN_##line##_EXT, NULL}
+#else
+#define WIEG_EXT_CH(n, line) \
+  {EXT_CH_MODE_BOTH_EDGES | EXT_CH_MODE_AUTOSTART, NULL, WIEG##n##_IN_##line##_PORT, WIEG##n##_IN_##line##_PIN}
+#endif
+#define WIEG_READER_CONFIG(n, label) \
+  [WIEG_READER_##n] = { \
+    WIEG##n##_IN_DAT0_GPIO, WIEG##n##_IN_DAT0_PIN, \
+    WIEG##n##_IN_DAT1_GPIO, WIEG##n##_IN_DAT1_PIN, \
+    WIEG##n##_PINS_MODE, WIEG##n##_PINS_OUTPUT_MODE, \
+    WIEG##n##_IN_DAT0_CHANNEL, WIEG##n##_IN_DAT1_CHANNEL, \
+    WIEG_EXT_CH(n, DAT0), WIEG_EXT_CH(n, DAT1), \
+    label},
+  WIEG_READERS(WIEG_READER_CONFIG)
+#undef WIEG_READER_CONFIG
+#undef WIEG_EXT_CH
+};
+
+WiegandDriver WIEGD[WIEG_NUM_READERS];
 
 volatile uint16_t print_mode;
 
-#if WIEG_HAS_2
-volatile systime_t wieg2_last_pulse_time;
-volatile uint8_t wieg2_reading_sequence = 0;
-static uint8_t wieg2_buffer[WIEG_BUFFER_SIZE];
-volatile uint8_t wieg2_buffer_pos = 0;
-#endif
+volatile systime_t wieg_latency_last = 0;
+volatile systime_t wieg_latency_max = 0;
+
+WIEG_NOINIT wieg_stats_t wieg_stats;
+
+#if WIEG_SHOULD_RECEIVE
+/* Filled in by wieg_init from the reader configs */
+static EXTConfig extcfg;
+/* Reader owning each EXT channel */
+static WiegandDriver *wieg_ext_drivers[EXT_MAX_CHANNELS];
+static thread_t *wieg_recv_tp = NULL;
+#endif /* WIEG_SHOULD_RECEIVE */
 
 /*===========================================================================
  * Read/write mode in flash.
  *===========================================================================*/
 uint16_t read_print_mode(void) {
-  uint16_t mode;
-  mode = flash_read16(FLASH_ADDR);
-  if((mode & MODE_SIGNATURE) == MODE_SIGNATURE) {
-    return( mode & 0xFF );
-  } else {
-    return( MODE_DEFAULT );
-  }
+  uint16_t legacy;
+  uint8_t mode;
 
+  if(cfg_get(CFG_KEY_PRINT_MODE, &mode, 1) == 1)
+    return mode;
+  /* saved before the settings store, carried over */
+  legacy = flash_read16(FLASH_ADDR);
+  if((legacy & 0xFF00) == MODE_SIGNATURE) {
+    write_print_mode(legacy);
+    return legacy & 0xFF;
+  }
+  return MODE_DEFAULT;
 }
 
-/* Use sparingly */
-void write_print_mode(uint16_t mode) {
-  osalSysLock();
-  flash_unlock();
-  flash_erasepage(FLASH_ADDR);
-  flash_write16(FLASH_ADDR, (mode&0xFF)|MODE_SIGNATURE );
-  flash_lock();
-  osalSysUnlock();
+/* Appends to the settings store, no erase unless its page is full */
+bool write_print_mode(uint16_t mode) {
+  uint8_t m = mode & 0xFF;
+  return cfg_set(CFG_KEY_PRINT_MODE, &m, 1);
 }
 
 /*===========================================================================
  * Interrupt callbacks.
  *===========================================================================*/
 
-static void extcb10(EXTDriver *extp, expchannel_t channel) {
-  (void)extp;
-  (void)channel;
-  osalSysLockFromISR();
-  if( (chVTGetSystemTimeX()-wieg1_last_pulse_time) <= WIEG_PULSE_WIDTH_MIN ) {
-    osalSysUnlockFromISR();
+/*
+ * Append a bit to a frame; clears each word as it is entered.
+ */
+static inline void wieg_frame_push(wieg_frame_t *f, uint8_t bit) {
+  if(f->n < WIEG_BUFFER_SIZE) {
+    if((f->n & 31) == 0) {
+      f->bits[f->n >> 5] = 0;
+    }
+    if(bit) {
+      f->bits[f->n >> 5] |= 0x80000000UL >> (f->n & 31);
+    }
+    f->n++;
+  }
+}
+
+/*
+ * Frame queue, producer side (ISR context, system locked). Returns true
+ * if the bit starts a frame that is dropped, the ring being full.
+ */
+static inline bool wieg_queue_bit(wieg_queue_t *q, uint8_t bit, systime_t now) {
+  wieg_frame_t *f;
+  if(!q->receiving) {
+    /* first bit of a frame: claim the head slot if there is one */
+    q->receiving = true;
+    if((uint8_t)(q->head - q->tail) >= WIEG_QUEUE_SIZE) {
+      q->dropping = true;
+      q->overruns++;
+      return true;
+    }
+    q->dropping = false;
+    q->frames[q->head & (WIEG_QUEUE_SIZE-1)].n = 0;
+    q->frames[q->head & (WIEG_QUEUE_SIZE-1)].flags = 0;
+  }
+  if(q->dropping)
+    return false;
+  f = &q->frames[q->head & (WIEG_QUEUE_SIZE-1)];
+  wieg_frame_push(f, bit);
+  f->time = now;
+  return false;
+}
+
+/* Take back the last bit (it was a glitch), ISR context */
+static inline void wieg_queue_unbit(wieg_queue_t *q) {
+  wieg_frame_t *f = &q->frames[q->head & (WIEG_QUEUE_SIZE-1)];
+  if(!q->receiving || q->dropping || (f->n == 0))
     return;
+  f->n--;
+  f->bits[f->n >> 5] &= ~(0x80000000UL >> (f->n & 31));
+  if(f->n == 0) {
+    q->receiving = false;
   }
-  wieg1_last_pulse_time = chVTGetSystemTimeX();
-  wieg1_reading_sequence = 1;
-  // led_blink = 1;
-  if(wieg1_buffer_pos < WIEG_BUFFER_SIZE-1) {
-    wieg1_buffer[wieg1_buffer_pos++] = 0;
+}
+
+static inline void wieg_queue_commit(wieg_queue_t *q) {
+  if(q->receiving) {
+    q->receiving = false;
+    if(!q->dropping)
+      q->head++;
   }
-  osalSysUnlockFromISR();
 }
 
-static void extcb11(EXTDriver *extp, expchannel_t channel) {
-  (void)extp;
-  (void)channel;
-  osalSysLockFromISR();
-  if( (chVTGetSystemTimeX()-wieg1_last_pulse_time) <= WIEG_PULSE_WIDTH_MIN ) {
-    osalSysUnlockFromISR();
+/*
+ * Signal statistics: log2 histogram of a duration in us.
+ */
+static inline void wieg_hist_add(uint16_t *hist, systime_t t) {
+  uint32_t us = WIEG_ST2US(t);
+  uint8_t i = 0;
+  while((us > 1) && (i < WIEG_HIST_BUCKETS-1)) {
+    us >>= 1;
+    i++;
+  }
+  if(hist[i] < 0xFFFF) {
+    hist[i]++;
+  }
+}
+
+#if WIEG_SHOULD_RECEIVE
+/* Integer square root */
+static uint32_t wieg_isqrt(uint32_t v) {
+  uint32_t r = 0, b = 1UL << 30;
+  while(b > v) {
+    b >>= 2;
+  }
+  while(b != 0) {
+    if(v >= r + b) {
+      v -= r + b;
+      r = (r >> 1) + b;
+    } else {
+      r >>= 1;
+    }
+    b >>= 2;
+  }
+  return r;
+}
+
+/* End of frame silence for the learnt bit to bit time, see WIEG_GAP_FACTOR */
+static systime_t wieg_gap_frame_gap(const WiegandDriver *wdp) {
+  uint32_t gap = WIEG_GAP_FACTOR * ((wdp->gap_mean >> 4) + 2*wieg_isqrt(wdp->gap_var));
+  if(gap < WIEG_FRAME_GAP_MIN_US) {
+    gap = WIEG_FRAME_GAP_MIN_US;
+  }
+  return (gap < WIEG_ST2US(WIEG_FRAME_GAP)) ? WIEG_US2ST(gap) : WIEG_FRAME_GAP;
+}
+
+/*
+ * Bit to bit time, running mean and variance (see WIEG_GAP_SHIFT):
+ * d = gap - mean, mean += d/2^s, var += (d^2 - var)/2^s.
+ * The first frame does not wait WIEG_FRAME_GAP once enough of its gaps
+ * have been seen; wieg_frame_adapt() keeps it up to date after that.
+ */
+static inline void wieg_gap_learn(WiegandDriver *wdp, systime_t t) {
+  int32_t us = (int32_t)WIEG_ST2US(t);
+  int32_t d;
+  if(wdp->gap_samples == 0) {
+    wdp->gap_mean = (uint32_t)us << 4;
+    wdp->gap_var = 0;
+  } else {
+    d = us - (int32_t)(wdp->gap_mean >> 4);
+    wdp->gap_mean = (uint32_t)((int32_t)wdp->gap_mean + ((d * 16) >> WIEG_GAP_SHIFT));
+    wdp->gap_var = (uint32_t)((int32_t)wdp->gap_var + ((d*d - (int32_t)wdp->gap_var) >> WIEG_GAP_SHIFT));
+  }
+  if(wdp->gap_samples < 0xFFFF) {
+    wdp->gap_samples++;
+  }
+  if(wdp->gap_samples == WIEG_GAP_MIN_SAMPLES) {
+    wdp->frame_gap = wieg_gap_frame_gap(wdp);
+  }
+}
+
+#if WIEG_USE_CAPTURE
+/* Edge capture (see WIEG_CAP_MAGIC), header and CRC around the edge data */
+static uint8_t wieg_cap_buf[WIEG_CAP_HEADER_SIZE + WIEG_CAPTURE_SIZE + 2];
+static WiegandDriver * volatile wieg_cap_wdp = NULL;  /* reader captured, NULL: stopped */
+static uint8_t wieg_cap_reader;
+static uint8_t wieg_cap_flags;
+static uint16_t wieg_cap_len;      /* edge data bytes */
+static uint16_t wieg_cap_frames;   /* frames ended ... */
+static uint16_t wieg_cap_want;     /* ... stop at this many, 0: never started */
+static systime_t wieg_cap_start;
+static systime_t wieg_cap_last;    /* last edge */
+static uint32_t wieg_cap_d[2];     /* the last two edge to edge times, us */
+
+/*
+ * Append an edge of the captured reader, system locked. Done before the
+ * edge goes through the filter, so glitches are kept too.
+ */
+static inline void wieg_capture_edge(WiegandDriver *wdp, uint8_t bit, bool low, systime_t now) {
+  uint8_t *p = &wieg_cap_buf[WIEG_CAP_HEADER_SIZE + wieg_cap_len];
+  uint32_t d, v;
+
+  if(wdp != wieg_cap_wdp)
+    return;
+  if(wieg_cap_len > WIEG_CAPTURE_SIZE - 5) {
+    /* 5 bytes: the longest varint */
+    wieg_cap_flags |= WIEG_CAP_FULL;
+    wieg_cap_wdp = NULL;
     return;
   }
-  wieg1_last_pulse_time = chVTGetSystemTimeX();
-  wieg1_reading_sequence = 1;
-  // led_blink = 1;
-  if(wieg1_buffer_pos < WIEG_BUFFER_SIZE-1) {
-    wieg1_buffer[wieg1_buffer_pos++] = 1;
+  d = WIEG_ST2US(now - wieg_cap_last);
+  v = d - wieg_cap_d[1];
+  v = (v << 1) ^ (uint32_t)((int32_t)v >> 31);
+  wieg_cap_last = now;
+  wieg_cap_d[1] = wieg_cap_d[0];
+  wieg_cap_d[0] = d;
+  *p = bit | (low ? 0x02 : 0) | (uint8_t)((v & 0x1F) << 2);
+  v >>= 5;
+  while(v != 0) {
+    *p++ |= 0x80;
+    *p = v & 0x7F;
+    v >>= 7;
   }
-  osalSysUnlockFromISR();
+  wieg_cap_len = (uint16_t)(p + 1 - &wieg_cap_buf[WIEG_CAP_HEADER_SIZE]);
 }
+#endif /* WIEG_USE_CAPTURE */
 
-#if WIEG_HAS_2
-static void extcb20(EXTDriver *extp, expchannel_t channel) {
-  (void)extp;
-  (void)channel;
+/* A frame is complete: hand it to the receive thread, system locked */
+static inline void wieg_frame_end(WiegandDriver *wdp) {
+#if WIEG_USE_CAPTURE
+  if((wdp == wieg_cap_wdp) && (++wieg_cap_frames >= wieg_cap_want)) {
+    wieg_cap_wdp = NULL;
+  }
+#endif /* WIEG_USE_CAPTURE */
+  wieg_queue_commit(&wdp->queue);
+  if(wieg_recv_tp != NULL) {
+    chEvtSignalI(wieg_recv_tp, EVENT_MASK(wdp->index));
+  }
+}
+
+/*
+ * Frame timers: armed on each edge, fire wdp->frame_gap after the last
+ * bit. Reader i signals event i to the receive thread.
+ */
+static void wieg_vt_cb(void *arg) {
+  WiegandDriver *wdp = (WiegandDriver *)arg;
   osalSysLockFromISR();
-  if( (chVTGetSystemTimeX()-wieg2_last_pulse_time) <= WIEG_PULSE_WIDTH_MIN ) {
-    osalSysUnlockFromISR();
+  wieg_frame_end(wdp);
+  osalSysUnlockFromISR();
+}
+
+static inline bool wieg_line_low(const WiegandConfig *cfg, uint8_t bit) {
+  return (bit ? palReadPad(cfg->dat1_gpio, cfg->dat1_pin) : palReadPad(cfg->dat0_gpio, cfg->dat0_pin)) == PAL_LOW;
+}
+
+#if WIEG_USE_FILTER
+/*
+ * Filter stage for a falling edge at 'start': the other line has to be
+ * idle, and the line still low WIEG_SAMPLE_WAIT later (ringing is not).
+ * Runs before the system is locked.
+ */
+static inline bool wieg_edge_confirmed(const WiegandConfig *cfg, uint8_t bit, systime_t start) {
+  bool idle = !wieg_line_low(cfg, !bit);
+#if CH_CFG_ST_FREQUENCY >= 1000000
+  while((systime_t)(chVTGetSystemTimeX() - start) < WIEG_SAMPLE_WAIT)
+    ;
+#else
+  (void)start;
+#endif
+  return idle && wieg_line_low(cfg, bit);
+}
+#endif /* WIEG_USE_FILTER */
+
+/*
+ * Edge handling, system locked. A bit is taken on the falling edge;
+ * the rising edge ends the pulse, which is where a frame that has
+ * reached its known length is ended (see WIEG_EARLY_CLOSE_FRAMES), and
+ * where the gap before the pulse is counted, once the filter has kept
+ * it.
+ */
+static inline void wieg_edge(WiegandDriver *wdp, uint8_t bit, bool low, bool confirmed, systime_t now) {
+  wieg_frame_t *f;
+
+  if(!low) {
+    /* rising edge: end of the pulse */
+    if(!wdp->pulse_low || (bit != wdp->pulse_bit))
+      return;
+    wdp->pulse_low = false;
+    wieg_hist_add(wdp->sigstats.pulse, now - wdp->last_pulse_time);
+#if WIEG_USE_FILTER
+    if(wdp->queue.receiving && !wdp->queue.dropping && ((now - wdp->last_pulse_time) < WIEG_GLITCH_WIDTH)) {
+      /* too short for a pulse: take the bit back */
+      wieg_queue_unbit(&wdp->queue);
+      wdp->last_pulse_time = wdp->prev_pulse_time;
+      wdp->pulse_gap = 0;
+      wdp->sigstats.filtered++;
+      return;
+    }
+#endif /* WIEG_USE_FILTER */
+    if(wdp->pulse_gap != 0) {
+      wieg_hist_add(wdp->sigstats.gap, wdp->pulse_gap);
+      wieg_gap_learn(wdp, wdp->pulse_gap);
+      wdp->pulse_gap = 0;
+    }
+    if(!wdp->queue.receiving || wdp->queue.dropping)
+      return;
+    f = &wdp->queue.frames[wdp->queue.head & (WIEG_QUEUE_SIZE-1)];
+    if((wdp->close_len != 0) && (f->n == wdp->close_len) && (wieg_classify(f) != NULL)) {
+      /* the length this reader sends and good parity: done */
+      chVTResetI(&wdp->vt);
+      wieg_frame_end(wdp);
+      wdp->sigstats.early++;
+    }
+    return;
+  }
+  if( (now-wdp->last_pulse_time) <= WIEG_PULSE_WIDTH_MIN ) {
+    wdp->sigstats.glitches++;
     return;
   }
-  wieg2_last_pulse_time = chVTGetSystemTimeX();
-  wieg2_reading_sequence = 1;
+  if(!confirmed) {
+    wdp->sigstats.filtered++;
+    return;
+  }
+  /* the first bit of a frame has no gap */
+  wdp->pulse_gap = wdp->queue.receiving ? (now - wdp->last_pulse_time) : 0;
+  wdp->prev_pulse_time = wdp->last_pulse_time;
+  wdp->last_pulse_time = now;
+  wdp->pulse_low = true;
+  wdp->pulse_bit = bit;
+  chVTSetI(&wdp->vt, wdp->frame_gap, wieg_vt_cb, wdp);
   // led_blink = 1;
-  if(wieg2_buffer_pos < WIEG_BUFFER_SIZE-1) {
-    wieg2_buffer[wieg2_buffer_pos++] = 0;
+  if(wieg_queue_bit(&wdp->queue, bit, now)) {
+    wieg_stats.reader[wdp->index].overruns++;
   }
-  osalSysUnlockFromISR();
 }
 
-static void extcb21(EXTDriver *extp, expchannel_t channel) {
+/*
+ * Shared EXT callback, both edges of every data line of every reader.
+ * Also keeps track of its own run time.
+ */
+static void wieg_extcb(EXTDriver *extp, expchannel_t channel) {
+  WiegandDriver *wdp = wieg_ext_drivers[channel];
+  const WiegandConfig *cfg = wdp->config;
+  systime_t now = chVTGetSystemTimeX();
+  uint8_t bit = (channel == cfg->dat1_channel);
+  bool low = wieg_line_low(cfg, bit);
+  bool confirmed = true;
+  systime_t t;
   (void)extp;
-  (void)channel;
-  osalSysLockFromISR();
-  if( (chVTGetSystemTimeX()-wieg2_last_pulse_time) <= WIEG_PULSE_WIDTH_MIN ) {
-    osalSysUnlockFromISR();
-    return;
+#if WIEG_USE_FILTER
+  if(low) {
+    confirmed = wieg_edge_confirmed(cfg, bit, now);
   }
-  wieg2_last_pulse_time = chVTGetSystemTimeX();
-  wieg2_reading_sequence = 1;
-  // led_blink = 1;
-  if(wieg2_buffer_pos < WIEG_BUFFER_SIZE-1) {
-    wieg2_buffer[wieg2_buffer_pos++] = 1;
+#endif /* WIEG_USE_FILTER */
+  osalSysLockFromISR();
+#if WIEG_USE_CAPTURE
+  wieg_capture_edge(wdp, bit, low, now);
+#endif /* WIEG_USE_CAPTURE */
+  wieg_edge(wdp, bit, low, confirmed, now);
+  t = chVTGetSystemTimeX() - now;
+  wdp->sigstats.isr_time += t;
+  wdp->sigstats.isr_edges++;
+  if(t > wdp->sigstats.isr_max) {
+    wdp->sigstats.isr_max = t;
   }
   osalSysUnlockFromISR();
 }
-#endif /* WIEG_HAS_2 */
+#endif /* WIEG_SHOULD_RECEIVE */
 
-#if defined(TEENSY30) || defined(TEENSY32) || defined(MCHCK) || defined(KL27Z)
-static const EXTConfig extcfg = {
-  {
-   {EXT_CH_MODE_FALLING_EDGE|EXT_CH_MODE_AUTOSTART, extcb10, WIEG1_IN_DAT0_PORT, WIEG1_IN_DAT0_PIN},
-   {EXT_CH_MODE_FALLING_EDGE|EXT_CH_MODE_AUTOSTART, extcb11, WIEG1_IN_DAT1_PORT, WIEG1_IN_DAT1_PIN},
-#if WIEG_HAS_2
-   {EXT_CH_MODE_FALLING_EDGE|EXT_CH_MODE_AUTOSTART, extcb20, WIEG2_IN_DAT0_PORT, WIEG2_IN_DAT0_PIN},
-   {EXT_CH_MODE_FALLING_EDGE|EXT_CH_MODE_AUTOSTART, extcb21, WIEG2_IN_DAT1_PORT, WIEG2_IN_DAT1_PIN},
-#endif
-  }
-};
-#elif defined(F042)
-static const EXTConfig extcfg = {
-  {
-    {EXT_CH_MODE_FALLING_EDGE | EXT_CH_MODE_AUTOSTART | WIEG1_IN_DAT0_EXT, extcb10},
-    {EXT_CH_MODE_FALLING_EDGE | EXT_CH_MODE_AUTOSTART | WIEG1_IN_DAT1_EXT, extcb11},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-#if WIEG_HAS_2
-    {EXT_CH_MODE_FALLING_EDGE | EXT_CH_MODE_AUTOSTART | WIEG2_IN_DAT0_EXT, extcb20}, // 13
-    {EXT_CH_MODE_FALLING_EDGE | EXT_CH_MODE_AUTOSTART | WIEG2_IN_DAT1_EXT, extcb21}, // 14
-#else
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-#endif
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL},
-    {EXT_CH_MODE_DISABLED, NULL}
+/*===========================================================================
+ * Access control.
+ *===========================================================================*/
+
+#if WIEG_USE_CARDDB
+volatile uint16_t wieg_access_granted = 0;
+volatile uint16_t wieg_access_denied = 0;
+
+static virtual_timer_t wieg_relay_vt;
+
+static void wieg_relay_off(void *arg) {
+  (void)arg;
+  osalSysLockFromISR();
+  palClearPad(WIEG_RELAY_GPIO, WIEG_RELAY_PIN);
+  osalSysUnlockFromISR();
+}
+
+/*
+ * Decide on a decoded card and open the door, before anything is
+ * printed. A card that is granted again while the relay is on restarts
+ * the relay time.
+ */
+static void wieg_access(const wieg_frame_t *f, const wieg_format_t *fmt) {
+  uint64_t id = wieg_field(wieg_frame_value(f), f->n, fmt->value_start, fmt->value_len);
+  uint8_t flags;
+
+  if(carddb_lookup(id, &flags) && (flags & CARDDB_GRANT)) {
+    osalSysLock();
+    palSetPad(WIEG_RELAY_GPIO, WIEG_RELAY_PIN);
+    chVTSetI(&wieg_relay_vt, (flags & CARDDB_EXTENDED) ? WIEG_RELAY_TIME_EXT : WIEG_RELAY_TIME,
+             wieg_relay_off, NULL);
+    osalSysUnlock();
+    wieg_access_granted++;
+  } else {
+    wieg_access_denied++;
   }
-};
-#endif
+}
+#endif /* WIEG_USE_CARDDB */
 
 /*===========================================================================
  * Receive.
  *===========================================================================*/
 
 #if WIEG_SHOULD_RECEIVE
-void wieg_process_message(uint8_t* buf, uint8_t n, uint8_t label) {
+static inline void wieg_put_le(uint8_t *p, uint64_t v, uint8_t len) {
+  while(len-- > 0) {
+    *p++ = (uint8_t)v;
+    v >>= 8;
+  }
+}
+
+/*
+ * An event to output: a frame, a card with the PIN entered after it, or
+ * a PIN alone (f.n == 0).
+ */
+typedef struct {
+  wieg_frame_t f;
+  uint32_t seq;
+  uint8_t reader;      /* | WIEG_REC_PIN if a PIN was entered */
+  uint8_t pin_len;
+  char pin[WIEG_PIN_MAX];
+} wieg_event_t;
+
+/*
+ * Pack an event into a binary record (see wiegand.h) and send it with
+ * one write, so an event costs a single USB transfer. Returns false if
+ * the record did not fit in the output buffers.
+ */
+static bool wieg_send_record(const wieg_event_t *ev, uint8_t reader, const wieg_format_t *fmt) {
+  uint8_t rec[WIEG_REC_MAX_SIZE];
+  const wieg_frame_t *f = &ev->f;
+  uint8_t nbytes = (f->n + 7) / 8;
+  uint8_t len = WIEG_REC_HEADER_SIZE + nbytes + 2;
+  uint16_t crc;
   uint8_t i;
-  // check if we can decode in one of the protocols
-  // if yes, print it out
-  if( wieg_is_26(buf, n) ) {
-    if(print_mode&(MODE_DEBUG|MODE_26)) {
-      chnPutTimeout(&OUTPUT_CHANNEL, label, TIME_IMMEDIATE);
-      if(print_mode&MODE_DEBUG) {
-        chnWriteTimeout(&OUTPUT_CHANNEL, (const uint8_t *)":26:", 4, TIME_IMMEDIATE);
-        for(i=0; i<n; i++) {
-          chnPutTimeout(&OUTPUT_CHANNEL, '0'+buf[i], TIME_IMMEDIATE);
-        }
-        chnPutTimeout(&OUTPUT_CHANNEL, ':', TIME_IMMEDIATE);
-      }
-      led_blink = 1;
-      phex24(&OUTPUT_CHANNEL, wieg_decode_26(buf));
-      pent(&OUTPUT_CHANNEL);
+
+  if(reader & WIEG_REC_PIN) {
+    len += 1 + ev->pin_len;
+  }
+
+  rec[0] = WIEG_REC_SYNC;
+  rec[1] = len;
+  rec[2] = reader;
+  rec[3] = (fmt != NULL) ? wieg_format_id(fmt) : WIEG_REC_NO_FORMAT;
+  rec[4] = f->n;
+  wieg_put_le(&rec[5], f->time, 4);
+  wieg_put_le(&rec[9], (fmt != NULL) ? wieg_field(wieg_frame_value(f), f->n, fmt->value_start, fmt->value_len) : 0, 8);
+  wieg_put_le(&rec[17], ev->seq, 4);
+  for(i=0; i<nbytes; i++) {
+    rec[WIEG_REC_HEADER_SIZE+i] = (uint8_t)(f->bits[i >> 2] >> (24 - 8*(i & 3)));
+  }
+  if(reader & WIEG_REC_PIN) {
+    rec[WIEG_REC_HEADER_SIZE+nbytes] = ev->pin_len;
+    memcpy(&rec[WIEG_REC_HEADER_SIZE+nbytes+1], ev->pin, ev->pin_len);
+  }
+  crc = crc16_update(CRC16_INIT, &rec[1], len - 3);
+  wieg_put_le(&rec[len-2], crc, 2);
+  return chnWriteTimeout(&OUTPUT_CHANNEL, rec, len, TIME_IMMEDIATE) == len;
+}
+
+/*
+ * Text output of an event. Once the output queue does not take a write
+ * the rest of the line is left out, and the next line starts on a new
+ * one.
+ */
+static bool wieg_text_ok;
+static bool wieg_text_cut = false;
+
+static void wieg_text_write(const char *s, size_t n) {
+  if(wieg_text_ok && (chnWriteTimeout(&OUTPUT_CHANNEL, (const uint8_t *)s, n, TIME_IMMEDIATE) != n))
+    wieg_text_ok = false;
+}
+
+static void wieg_text_put(char c) {
+  if(wieg_text_ok && (chnPutTimeout(&OUTPUT_CHANNEL, c, TIME_IMMEDIATE) != MSG_OK))
+    wieg_text_ok = false;
+}
+
+/* The lowest 'digits' hex digits of v */
+static void wieg_text_hex(uint64_t v, uint8_t digits) {
+  uint8_t c;
+  while(digits-- > 0) {
+    c = (uint8_t)((v >> (4*digits)) & 15);
+    wieg_text_put(c + ((c < 10) ? '0' : 'A' - 10));
+  }
+}
+
+/*
+ * Output an event in the current print mode. Replayed events (reader |
+ * WIEG_REC_REPLAYED) are marked: in the record, or with an "@<seq>:"
+ * prefix in the text modes. An entered PIN follows the card as
+ * "/<digits>" in the text modes; the print mode filters on the card, a
+ * PIN alone is always shown. Returns false if the output was lost (the
+ * record, or any of the line), and counts it as dropped.
+ */
+static bool wieg_output(const wieg_event_t *ev, uint8_t reader, const wieg_format_t *fmt) {
+  uint8_t i;
+  const wieg_frame_t *f = &ev->f;
+  uint8_t n = f->n;
+  uint8_t label = WIEGD[reader & WIEG_REC_READER].config->label;
+
+  if(print_mode&MODE_BIN) {
+    led_blink = 1;
+    if(!wieg_send_record(ev, reader, fmt)) {
+      wieg_stats.reader[reader & WIEG_REC_READER].dropped++;
+      return false;
+    }
+    return true;
+  }
+  if((n > 0) && !(print_mode&(MODE_DEBUG|((fmt != NULL) ? fmt->mode : MODE_ERR))))
+    return true;
+  wieg_text_ok = true;
+  if(wieg_text_cut) {
+    wieg_text_write("\r\n", 2);
+  }
+  if(reader & WIEG_REC_REPLAYED) {
+    wieg_text_put('@');
+    wieg_text_hex(ev->seq, 8);
+    wieg_text_put(':');
+  }
+  if(n == 0) {
+    // PIN without a card
+    wieg_text_put(label);
+    if(print_mode&MODE_DEBUG) {
+      wieg_text_write(":pin", 4);
     }
-  } else if( wieg_is_34(buf,n) ) {
-    if( print_mode&(MODE_DEBUG|MODE_34) ) {
-      chnPutTimeout(&OUTPUT_CHANNEL, label, TIME_IMMEDIATE);
-      if(print_mode&MODE_DEBUG) {
-        chnWriteTimeout(&OUTPUT_CHANNEL, (const uint8_t *)":34:", 4, TIME_IMMEDIATE);
-        for(i=0; i<n; i++) {
-          chnPutTimeout(&OUTPUT_CHANNEL, '0'+buf[i], TIME_IMMEDIATE);
-        }
-        chnPutTimeout(&OUTPUT_CHANNEL, ':', TIME_IMMEDIATE);
+    led_blink = 1;
+  } else if(fmt != NULL) {
+    wieg_text_put(label);
+    if(print_mode&MODE_DEBUG) {
+      wieg_text_put(':');
+      wieg_text_write(fmt->name, strlen(fmt->name));
+      wieg_text_put(':');
+      for(i=0; i<n; i++) {
+        wieg_text_put('0'+wieg_get_bit(f, i));
       }
-      led_blink = 1;
-      phex32(&OUTPUT_CHANNEL, wieg_decode_34(buf));
-      pent(&OUTPUT_CHANNEL);
+      wieg_text_put(':');
     }
-  } else if( print_mode&(MODE_DEBUG|MODE_ERR) ) {
+    led_blink = 1;
+    wieg_text_hex(wieg_field(wieg_frame_value(f), n, fmt->value_start, fmt->value_len), (fmt->value_len+3)/4);
+  } else {
     // couldn't decode
-    chnPutTimeout(&OUTPUT_CHANNEL, label, TIME_IMMEDIATE);
+    wieg_text_put(label);
     if(print_mode&MODE_DEBUG) {
-      chnWriteTimeout(&OUTPUT_CHANNEL, (const uint8_t *)":err:", 5, TIME_IMMEDIATE);
+      wieg_text_write(":err:", 5);
     }
-    chnWriteTimeout(&OUTPUT_CHANNEL, (const uint8_t *)"0x", 2, TIME_IMMEDIATE);
-    phex(&OUTPUT_CHANNEL,n);
-    chnPutTimeout(&OUTPUT_CHANNEL, ':', TIME_IMMEDIATE);
+    wieg_text_write("0x", 2);
+    wieg_text_hex(n, 2);
+    wieg_text_put(':');
     led_blink = 1;
     for(i=0; i<n; i++) {
-      chnPutTimeout(&OUTPUT_CHANNEL, '0'+buf[i], TIME_IMMEDIATE);
+      wieg_text_put('0'+wieg_get_bit(f, i));
     }
-    pent(&OUTPUT_CHANNEL);
   }
-}
-
-static THD_WORKING_AREA(waWieg1Thr, 128);
-static THD_FUNCTION(Wieg1Thr, arg) {
-  (void)arg;
-  chRegSetThreadName("wieg_recv_1");
-
-  while(true) { 
-    if((wieg1_reading_sequence == 1) && 
-        ((chVTGetSystemTime() - wieg1_last_pulse_time) >= 2*WIEG_PAUSE_WIDTH_MAX)) {
-      // finished reading
-      wieg_process_message(wieg1_buffer, wieg1_buffer_pos, '-');
-      // start waiting for a new message
-      wieg1_reading_sequence = 0;
-      wieg1_buffer_pos=0;
-    }
-    chThdSleep(WIEG_PAUSE_WIDTH_MAX);
+  if(reader & WIEG_REC_PIN) {
+    wieg_text_put('/');
+    wieg_text_write(ev->pin, ev->pin_len);
   }
-}
-
-#if WIEG_HAS_2
-static THD_WORKING_AREA(waWieg2Thr, 128);
-static THD_FUNCTION(Wieg2Thr, arg) {
-  (void)arg;
-  chRegSetThreadName("wieg_recv_2");
-
-  while(true) { 
-    if((wieg2_reading_sequence == 1) && 
-        ((chVTGetSystemTime() - wieg2_last_pulse_time) >= 2*WIEG_PAUSE_WIDTH_MAX)) {
-      // finished reading
-      wieg_process_message(wieg2_buffer, wieg2_buffer_pos, '+');
-      // start waiting for a new message
-      wieg2_reading_sequence = 0;
-      wieg2_buffer_pos=0;
-    }
-    chThdSleep(WIEG_PAUSE_WIDTH_MAX);
+  wieg_text_write("\r\n", 2);
+  wieg_text_cut = !wieg_text_ok;
+  if(!wieg_text_ok) {
+    wieg_stats.reader[reader & WIEG_REC_READER].dropped++;
+    return false;
   }
+  return true;
 }
-#endif /* WIEG_HAS_2 */
-#endif /* WIEG_SHOULD_RECEIVE */
 
+#if WIEG_USE_CAPTURE
 /*===========================================================================
- * Send.
+ * Edge capture.
  *===========================================================================*/
 
 /*
- * Wiegand write
- * - expects bits (zeroes and non-zeroes) in buf
+ * Record the edges of a reader (index in WIEGD[]) until 'frames' frames
+ * have ended or the buffer is full. Decoding goes on as usual.
  */
-void wieg_send(uint8_t* buf, uint8_t n) {
-  uint8_t i;
-#if WIEG_SHOULD_RECEIVE
-  extChannelDisable(&EXTD1, WIEG1_IN_DAT0_CHANNEL);
-  extChannelDisable(&EXTD1, WIEG1_IN_DAT1_CHANNEL);
-#endif /* WIEG_SHOULD_RECEIVE */
+bool wieg_capture_start(uint8_t reader, uint16_t frames) {
+  const WiegandConfig *cfg;
+
+  if((reader >= WIEG_NUM_READERS) || (frames == 0))
+    return false;
+  cfg = WIEGD[reader].config;
   osalSysLock();
-  palSetPadMode(WIEG1_IN_DAT0_GPIO, WIEG1_IN_DAT0_PIN, WIEG1_PINS_OUTPUT_MODE);
-  palSetPadMode(WIEG1_IN_DAT1_GPIO, WIEG1_IN_DAT1_PIN, WIEG1_PINS_OUTPUT_MODE);
-  for(i=0; i<n; i++) {
-    if(buf[i]==0) {
-      palClearPad(WIEG1_IN_DAT0_GPIO, WIEG1_IN_DAT0_PIN);
-      chThdSleepS(WIEG_PULSE_WIDTH);
-      palSetPad(WIEG1_IN_DAT0_GPIO, WIEG1_IN_DAT0_PIN);
-    } else {
-      palClearPad(WIEG1_IN_DAT1_GPIO, WIEG1_IN_DAT1_PIN);
-      chThdSleepS(WIEG_PULSE_WIDTH);
-      palSetPad(WIEG1_IN_DAT1_GPIO, WIEG1_IN_DAT1_PIN);
-    }
-    chThdSleepS(WIEG_PAUSE_WIDTH);
-  }
-  palSetPadMode(WIEG1_IN_DAT0_GPIO, WIEG1_IN_DAT0_PIN, WIEG1_PINS_MODE);
-  palSetPadMode(WIEG1_IN_DAT1_GPIO, WIEG1_IN_DAT1_PIN, WIEG1_PINS_MODE);
+  wieg_cap_reader = reader;
+  wieg_cap_flags = (wieg_line_low(cfg, 0) ? WIEG_CAP_DAT0_LOW : 0) | (wieg_line_low(cfg, 1) ? WIEG_CAP_DAT1_LOW : 0);
+  wieg_cap_len = 0;
+  wieg_cap_frames = 0;
+  wieg_cap_want = frames;
+  wieg_cap_start = wieg_cap_last = chVTGetSystemTimeX();
+  wieg_cap_d[0] = wieg_cap_d[1] = 0;
+  wieg_cap_wdp = &WIEGD[reader];
   osalSysUnlock();
-  chThdSleep(3*WIEG_PAUSE_WIDTH_MAX);
-#if WIEG_SHOULD_RECEIVE
-  extChannelEnable(&EXTD1, WIEG1_IN_DAT0_CHANNEL);
-  extChannelEnable(&EXTD1, WIEG1_IN_DAT1_CHANNEL);
-#endif /* WIEG_SHOULD_RECEIVE */
+  return true;
+}
+
+void wieg_capture_stop(void) {
+  osalSysLock();
+  wieg_cap_wdp = NULL;
+  osalSysUnlock();
+}
+
+bool wieg_capture_running(void) {
+  return wieg_cap_wdp != NULL;
+}
+
+/*
+ * The record of the last capture, once it is over (NULL before the first
+ * one, or while running).
+ */
+const uint8_t *wieg_capture_record(uint16_t *len) {
+  uint8_t *rec = wieg_cap_buf;
+  uint16_t crc;
+
+  if((wieg_cap_want == 0) || wieg_capture_running())
+    return NULL;
+  memcpy(rec, WIEG_CAP_MAGIC, 4);
+  rec[4] = wieg_cap_reader;
+  rec[5] = wieg_cap_flags;
+  wieg_put_le(&rec[6], wieg_cap_frames, 2);
+  wieg_put_le(&rec[8], wieg_cap_len, 2);
+  wieg_put_le(&rec[10], wieg_cap_start, 4);
+  *len = WIEG_CAP_HEADER_SIZE + wieg_cap_len + 2;
+  crc = crc16_update(CRC16_INIT, &rec[4], *len - 6);
+  wieg_put_le(&rec[*len-2], crc, 2);
+  return rec;
 }
+#endif /* WIEG_USE_CAPTURE */
 
 /*===========================================================================
- * Init code.
+ * Counters.
  *===========================================================================*/
 
-void wieg_init(void) {
-  // iqObjectInit(&wiegand_input_queue, wiegand_input_queue_buffer, sizeof(wiegand_input_queue_buffer), wiegand_input_queue_inotify, NULL);
-  palSetPadMode(WIEG1_IN_DAT0_GPIO, WIEG1_IN_DAT0_PIN, WIEG1_PINS_MODE);
-  palSetPadMode(WIEG1_IN_DAT1_GPIO, WIEG1_IN_DAT1_PIN, WIEG1_PINS_MODE);
-#if WIEG_HAS_2
-  palSetPadMode(WIEG2_IN_DAT0_GPIO, WIEG2_IN_DAT0_PIN, WIEG2_PINS_MODE);
-  palSetPadMode(WIEG2_IN_DAT1_GPIO, WIEG2_IN_DAT1_PIN, WIEG2_PINS_MODE);
-#endif /* WIEG_HAS_2 */
-  print_mode = read_print_mode();
-#if (WIEG_SHOULD_RECEIVE)
-  chThdCreateStatic(waWieg1Thr, sizeof(waWieg1Thr), NORMALPRIO+3, Wieg1Thr, NULL);
-#if WIEG_HAS_2
-  chThdCreateStatic(waWieg2Thr, sizeof(waWieg2Thr), NORMALPRIO+3, Wieg2Thr, NULL);
-#endif /* WIEG_HAS_2 */
-  extStart(&EXTD1, &extcfg);
-#endif /* WIEG_SHOULD_RECEIVE */
+void wieg_stats_clear(void) {
+  osalSysLock();
+  memset(&wieg_stats, 0, sizeof(wieg_stats));
+  wieg_stats.magic = WIEG_STATS_MAGIC;
+  osalSysUnlock();
+}
+
+/*
+ * Fill rec (WIEG_STATS_MAX_SIZE bytes) with the counter record, see
+ * wiegand.h; returns its length.
+ */
+uint16_t wieg_stats_record(uint8_t *rec) {
+  uint16_t len = WIEG_STATS_HEADER_SIZE;
+  const uint32_t *c;
+  uint8_t i, j;
+
+  memcpy(rec, WIEG_STATS_MAGIC_TEXT, 4);
+  rec[4] = WIEG_NUM_READERS;
+  rec[5] = WIEG_STATS_COUNTERS;
+  wieg_put_le(&rec[6], wieg_stats.starts, 4);
+  for(i=0; i<WIEG_NUM_READERS; i++) {
+    c = (const uint32_t *)&wieg_stats.reader[i];
+    for(j=0; j<WIEG_STATS_COUNTERS; j++) {
+      wieg_put_le(&rec[len], c[j], 4);
+      len += 4;
+    }
+  }
+  wieg_put_le(&rec[len], crc16_update(CRC16_INIT, &rec[4], len - 4), 2);
+  return len + 2;
 }
 
 /*===========================================================================
- * Individual protocols.
+ * Event log.
  *===========================================================================*/
 
-uint8_t one(uint8_t m) {
-  if(m==0)
-    return 0;
-  else
-    return 1;
+/*
+ * Events that cannot be output (port not open, or output full) go to a
+ * RAM ring; when it is full it is moved to the flash log page. Both are
+ * replayed, oldest first, in batches of WIEG_LOG_BATCH once the host is
+ * back. Every event gets a sequence number, so the host can drop the
+ * ones it has seen (the flash log is replayed again after a reset until
+ * it has been emptied).
+ *
+ * Sequence numbers go on over resets, as the system time starts again.
+ * A soft reset carries on from the copy in WIEG_NOINIT RAM; otherwise
+ * numbers start at the end of the block reserved last in the settings
+ * store (CFG_KEY_LOG_SEQ), what was left of it is skipped. A block is
+ * reserved at a power up, then halfway through the block when no frame
+ * is coming in: the edge interrupts wait while the flash is programmed.
+ */
+static wieg_event_t wieg_log_ring[WIEG_LOG_RAM_SIZE];
+static uint8_t wieg_log_head = 0;
+static uint8_t wieg_log_tail = 0;
+static uint32_t wieg_log_seq = 0;
+static uint32_t wieg_log_seq_end = 0;          /* reserved up to */
+static WIEG_NOINIT uint32_t wieg_log_kept[2];  /* wieg_log_seq, and its complement */
+
+volatile uint16_t wieg_log_buffered = 0;
+volatile uint16_t wieg_log_replayed = 0;
+volatile uint16_t wieg_log_lost = 0;
+
+static bool wieg_host_ready(void) {
+  return usb_port_open && (OUTPUT_CHANNEL.config->usbp->state == USB_ACTIVE);
+}
+
+/* A block only counts once it is saved; if not, the next event tries again */
+static void wieg_log_seq_reserve(void) {
+  uint8_t b[4];
+
+  wieg_put_le(b, wieg_log_seq + WIEG_LOG_SEQ_BLOCK, 4);
+  if(cfg_set(CFG_KEY_LOG_SEQ, b, 4))
+    wieg_log_seq_end = wieg_log_seq + WIEG_LOG_SEQ_BLOCK;
 }
 
-uint8_t wieg_count_ones(uint8_t *buf, uint8_t n) {
+/* Reserve the next block halfway through this one */
+static void wieg_log_seq_ahead(void) {
   uint8_t i;
-  uint8_t count = 0;
-  for(i=0; i<n; i++) {
-    if(buf[i]!=0)
-      count++;
+
+  if(wieg_log_seq_end - wieg_log_seq > WIEG_LOG_SEQ_BLOCK/2)
+    return;
+  for(i=0; i<WIEG_NUM_READERS; i++) {
+    if(WIEGD[i].queue.receiving)
+      return;
   }
-  return(count);
+  wieg_log_seq_reserve();
 }
 
-bool wieg_is_26(uint8_t *buf, uint8_t n) {
-  if(n != 26)
-    return false;
-  /* check parity */
-  if(  ((wieg_count_ones(buf+1,12) +one(buf[0]) ) % 2 == 1) 
-    || ((wieg_count_ones(buf+13,12)+one(buf[25])) % 2 == 0) ) {
-    return false;
+static uint32_t wieg_log_next_seq(void) {
+  if(wieg_log_seq >= wieg_log_seq_end) {
+    wieg_log_seq_reserve();
   }
-  return true;
+  wieg_log_kept[0] = wieg_log_seq + 1;
+  wieg_log_kept[1] = ~wieg_log_kept[0];
+  return wieg_log_seq++;
 }
 
-uint32_t wieg_decode_26(uint8_t *buf) {
-  /* collect bits into one number */
-  uint32_t msg = 0;
-  uint8_t i;
-  for(i=1; i<25; i++) {
-    msg = (msg<<1) | (buf[i]==0 ? 0 : 1);
+static void wieg_log_seq_init(void) {
+  uint8_t b[4];
+
+  if(cfg_get(CFG_KEY_LOG_SEQ, b, 4) == 4) {
+    wieg_log_seq_end = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+  }
+  wieg_log_seq = wieg_log_seq_end;
+  if((wieg_log_kept[1] == ~wieg_log_kept[0]) && (wieg_log_kept[0] <= wieg_log_seq_end)
+     && (wieg_log_seq_end - wieg_log_kept[0] <= WIEG_LOG_SEQ_BLOCK)) {
+    wieg_log_seq = wieg_log_kept[0];
   }
-  return msg;
 }
 
-bool wieg_is_34(uint8_t *buf, uint8_t n) {
-  if(n != 34)
-    return false;
-  /* check parity */
-  if(  ((wieg_count_ones(buf+1,16) +one(buf[0]) ) % 2 == 1) 
-    || ((wieg_count_ones(buf+17,16)+one(buf[33])) % 2 == 0) ) {
+#if defined(WIEG_LOG_ADDR)
+/*
+ * Flash log entry, WIEG_LOG_ENTRY_SIZE bytes written by halfwords:
+ *  0-3   sequence number
+ *  4-7   time of the last bit
+ *  8     reader, | WIEG_REC_PIN
+ *  9     number of bits n
+ *  10-   raw bits, WIEG_BUFFER_WORDS*4 bytes as in the binary record
+ *  then  number of PIN digits, WIEG_PIN_MAX digits, padding to a halfword
+ *  last  CRC-16 of the above (2 bytes), written last
+ */
+#define WIEG_LOG_PIN         (10 + WIEG_BUFFER_WORDS*4)
+#define WIEG_LOG_ENTRY_SIZE  ((WIEG_LOG_PIN + 1 + WIEG_PIN_MAX + 3) & ~1)
+#define WIEG_LOG_ENTRIES     (WIEG_LOG_SIZE / WIEG_LOG_ENTRY_SIZE)
+
+static uint16_t wieg_log_flash_len = 0;    /* entries written */
+static uint16_t wieg_log_flash_read = 0;   /* ... of which replayed */
+
+static void wieg_log_flash_entry(uint16_t i, uint8_t *e) {
+  uint32_t addr = WIEG_LOG_ADDR + i*WIEG_LOG_ENTRY_SIZE;
+  uint8_t j;
+  uint16_t h;
+  for(j=0; j<WIEG_LOG_ENTRY_SIZE; j+=2) {
+    h = flash_read16(addr + j);
+    e[j] = (uint8_t)h;
+    e[j+1] = (uint8_t)(h >> 8);
+  }
+}
+
+static bool wieg_log_flash_get(uint16_t i, wieg_event_t *ev) {
+  uint8_t e[WIEG_LOG_ENTRY_SIZE];
+  uint8_t j;
+
+  wieg_log_flash_entry(i, e);
+  if(crc16_update(CRC16_INIT, e, WIEG_LOG_ENTRY_SIZE-2) != (e[WIEG_LOG_ENTRY_SIZE-2] | (e[WIEG_LOG_ENTRY_SIZE-1] << 8)))
     return false;
+  ev->seq = e[0] | (e[1] << 8) | (e[2] << 16) | ((uint32_t)e[3] << 24);
+  ev->f.time = e[4] | (e[5] << 8) | (e[6] << 16) | ((uint32_t)e[7] << 24);
+  ev->reader = e[8];
+  ev->f.n = e[9];
+  for(j=0; j<WIEG_BUFFER_WORDS*4; j++) {
+    if((j & 3) == 0) {
+      ev->f.bits[j >> 2] = 0;
+    }
+    ev->f.bits[j >> 2] |= (uint32_t)e[10+j] << (24 - 8*(j & 3));
   }
-  return true;
+  ev->pin_len = e[WIEG_LOG_PIN];
+  memcpy(ev->pin, &e[WIEG_LOG_PIN+1], WIEG_PIN_MAX);
+  return ((ev->reader & ~WIEG_REC_PIN) < WIEG_NUM_READERS) && (ev->f.n <= WIEG_BUFFER_SIZE)
+         && (ev->pin_len <= WIEG_PIN_MAX);
 }
 
-uint32_t wieg_decode_34(uint8_t *buf) {
-  /* collect bits into one number */
-  uint32_t msg = 0;
-  uint8_t i;
-  for(i=1; i<33; i++) {
-    msg = (msg<<1) | (buf[i]==0 ? 0 : 1);
+/*
+ * Write an event to the next entry. If a halfword fails, its CRC is
+ * cleared (0 always programs) so that it reads as torn and the log
+ * goes on after it, and false is returned: the event is kept for the
+ * next entry.
+ */
+static bool wieg_log_flash_put(const wieg_event_t *ev) {
+  uint8_t e[WIEG_LOG_ENTRY_SIZE];
+  uint32_t addr = WIEG_LOG_ADDR + wieg_log_flash_len*WIEG_LOG_ENTRY_SIZE;
+  flash_status_t st = FLASH_OK;
+  uint8_t j;
+
+  memset(e, 0xFF, sizeof(e));
+  wieg_put_le(&e[0], ev->seq, 4);
+  wieg_put_le(&e[4], ev->f.time, 4);
+  e[8] = ev->reader;
+  e[9] = ev->f.n;
+  for(j=0; j<WIEG_BUFFER_WORDS*4; j++) {
+    e[10+j] = (uint8_t)(ev->f.bits[j >> 2] >> (24 - 8*(j & 3)));
+  }
+  e[WIEG_LOG_PIN] = ev->pin_len;
+  memcpy(&e[WIEG_LOG_PIN+1], ev->pin, WIEG_PIN_MAX);
+  wieg_put_le(&e[WIEG_LOG_ENTRY_SIZE-2], crc16_update(CRC16_INIT, e, WIEG_LOG_ENTRY_SIZE-2), 2);
+  /* a halfword at a time, so the edge interrupts are not held off longer */
+  for(j=0; (j<WIEG_LOG_ENTRY_SIZE) && (st == FLASH_OK); j+=2) {
+    osalSysLock();
+    flash_unlock();
+    st = flash_write16(addr + j, e[j] | (e[j+1] << 8));
+    flash_lock();
+    osalSysUnlock();
+    if((st == FLASH_OK) && (flash_read16(addr + j) != (e[j] | (e[j+1] << 8))))
+      st = FLASH_ERR_VERIFY;
   }
-  return msg;
+  if(st != FLASH_OK) {
+    osalSysLock();
+    flash_unlock();
+    flash_write16(addr + WIEG_LOG_ENTRY_SIZE-2, 0);
+    flash_lock();
+    osalSysUnlock();
+  }
+  wieg_log_flash_len++;
+  return st == FLASH_OK;
+}
+
+/* Keeps the entries (all replayed) if the erase fails, to try again after the next ones */
+static void wieg_log_flash_erase(void) {
+  flash_status_t st;
+
+  osalSysLock();
+  flash_unlock();
+  st = flash_erasepage(WIEG_LOG_ADDR);
+  flash_lock();
+  osalSysUnlock();
+  if(st != FLASH_OK)
+    return;
+  wieg_log_flash_len = 0;
+  wieg_log_flash_read = 0;
+}
+
+/* Find the end of the log, and carry on with its sequence numbers if
+ * the settings store is behind */
+static void wieg_log_flash_init(void) {
+  wieg_event_t ev;
+  while((wieg_log_flash_len < WIEG_LOG_ENTRIES)
+        && (flash_read16(WIEG_LOG_ADDR + wieg_log_flash_len*WIEG_LOG_ENTRY_SIZE + WIEG_LOG_ENTRY_SIZE-2) != 0xFFFF)) {
+    if(wieg_log_flash_get(wieg_log_flash_len, &ev) && (ev.seq >= wieg_log_seq)) {
+      wieg_log_seq = ev.seq + 1;
+      wieg_log_seq_end = wieg_log_seq;
+    }
+    wieg_log_flash_len++;
+  }
+}
+#endif /* WIEG_LOG_ADDR */
+
+static void wieg_log_init(void) {
+  wieg_log_seq_init();
+#if defined(WIEG_LOG_ADDR)
+  wieg_log_flash_init();
+#endif
+  if(wieg_log_seq == wieg_log_seq_end) {
+    wieg_log_seq_reserve();
+  }
+}
+
+uint16_t wieg_log_pending(void) {
+#if defined(WIEG_LOG_ADDR)
+  return (uint8_t)(wieg_log_head - wieg_log_tail) + wieg_log_flash_len - wieg_log_flash_read;
+#else
+  return (uint8_t)(wieg_log_head - wieg_log_tail);
+#endif
+}
+
+static void wieg_log_store(const wieg_event_t *ev) {
+
+  if((uint8_t)(wieg_log_head - wieg_log_tail) >= WIEG_LOG_RAM_SIZE) {
+#if defined(WIEG_LOG_ADDR)
+    /* move the ring to flash, as much as fits */
+    while((wieg_log_tail != wieg_log_head) && (wieg_log_flash_len < WIEG_LOG_ENTRIES)) {
+      if(wieg_log_flash_put(&wieg_log_ring[wieg_log_tail & (WIEG_LOG_RAM_SIZE-1)]))
+        wieg_log_tail++;
+    }
+    if(wieg_log_tail != wieg_log_head)
+#endif /* WIEG_LOG_ADDR */
+    {
+      wieg_log_lost++;
+      return;
+    }
+  }
+  wieg_log_ring[wieg_log_head & (WIEG_LOG_RAM_SIZE-1)] = *ev;
+  wieg_log_head++;
+  wieg_log_buffered++;
+}
+
+/* Output up to WIEG_LOG_BATCH logged events, oldest first */
+static void wieg_log_replay(void) {
+  wieg_event_t *ev;
+  uint8_t i;
+#if defined(WIEG_LOG_ADDR)
+  wieg_event_t fev;
+#endif
+
+  for(i=0; (i<WIEG_LOG_BATCH) && (wieg_log_pending() > 0); i++) {
+    if(!wieg_host_ready())
+      return;
+#if defined(WIEG_LOG_ADDR)
+    if(wieg_log_flash_read < wieg_log_flash_len) {
+      if(!wieg_log_flash_get(wieg_log_flash_read, &fev)) {
+        /* torn write; one that failed (CRC 0) was written again to the next entry */
+        if(flash_read16(WIEG_LOG_ADDR + wieg_log_flash_read*WIEG_LOG_ENTRY_SIZE + WIEG_LOG_ENTRY_SIZE-2) != 0)
+          wieg_log_lost++;
+      } else if(wieg_output(&fev, fev.reader | WIEG_REC_REPLAYED, wieg_classify(&fev.f))) {
+        wieg_log_replayed++;
+      } else {
+        return;
+      }
+      wieg_log_flash_read++;
+      if(wieg_log_flash_read == wieg_log_flash_len) {
+        wieg_log_flash_erase();
+      }
+      continue;
+    }
+#endif /* WIEG_LOG_ADDR */
+    ev = &wieg_log_ring[wieg_log_tail & (WIEG_LOG_RAM_SIZE-1)];
+    if(!wieg_output(ev, ev->reader | WIEG_REC_REPLAYED, wieg_classify(&ev->f)))
+      return;
+    wieg_log_tail++;
+    wieg_log_replayed++;
+  }
+}
+
+/*
+ * After each frame, work out when the next one from this reader can be
+ * considered finished (see WIEG_GAP_FACTOR and WIEG_EARLY_CLOSE_FRAMES).
+ * A frame that does not decode may have been cut short, so that goes
+ * back to the fixed gap until the timing has been learnt again.
+ */
+static void wieg_frame_adapt(WiegandDriver *wdp, const wieg_frame_t *f, const wieg_format_t *fmt) {
+  if(fmt == NULL) {
+    osalSysLock();
+    wdp->gap_samples = 0;
+    wdp->frame_gap = WIEG_FRAME_GAP;
+    wdp->close_len = 0;
+    osalSysUnlock();
+    wdp->stable = 0;
+    return;
+  }
+  if((f->n == wdp->last_len) && (wdp->stable > 0)) {
+    if(wdp->stable < 0xFF)
+      wdp->stable++;
+  } else {
+    wdp->last_len = f->n;
+    wdp->stable = 1;
+  }
+
+  osalSysLock();
+  if(wdp->gap_samples >= WIEG_GAP_MIN_SAMPLES) {
+    wdp->frame_gap = wieg_gap_frame_gap(wdp);
+  }
+  osalSysUnlock();
+  wdp->close_len = (wdp->stable >= WIEG_EARLY_CLOSE_FRAMES) ? f->n : 0;
+}
+
+/*
+ * Output an event, or log it if it can't be output now or older events
+ * are still waiting.
+ */
+static void wieg_event_out(wieg_event_t *ev, const wieg_format_t *fmt) {
+  ev->seq = wieg_log_next_seq();
+  if((wieg_log_pending() == 0) && wieg_host_ready() && wieg_output(ev, ev->reader, fmt))
+    return;
+  wieg_log_store(ev);
+}
+
+/*===========================================================================
+ * Keypad.
+ *===========================================================================*/
+
+/* The key in a keypad frame (see MODE_KEYPAD), -1 if it is not one */
+static int8_t wieg_key(const wieg_frame_t *f) {
+  uint8_t v;
+
+  if(f->n == 4) {
+    v = (uint8_t)wieg_get_bits(f, 0, 4);
+  } else if(f->n == 8) {
+    v = (uint8_t)wieg_get_bits(f, 0, 8);
+    if((((v >> 4) ^ v) & 0x0F) != 0x0F)
+      return -1;
+    v &= 0x0F;
+  } else {
+    return -1;
+  }
+  return (v <= 11) ? (int8_t)v : -1;
+}
+
+/*
+ * End the keypad entry of a reader: output the card held with the PIN if
+ * it was entered, or else the card alone, if any.
+ */
+static void wieg_pin_end(WiegandDriver *wdp, bool entered, systime_t time) {
+  wieg_event_t ev;
+
+  if((wdp->pin_card.n == 0) && (!entered || (wdp->pin_len == 0))) {
+    wdp->pin_len = 0;
+    return;
+  }
+  ev.f = wdp->pin_card;
+  ev.reader = wdp->index;
+  ev.pin_len = 0;
+  if(ev.f.n == 0) {
+    ev.f.time = time;
+  }
+  if(entered) {
+    ev.reader |= WIEG_REC_PIN;
+    ev.pin_len = wdp->pin_len;
+    memcpy(ev.pin, wdp->pin, wdp->pin_len);
+  }
+  wdp->pin_card.n = 0;
+  wdp->pin_len = 0;
+  wieg_event_out(&ev, wieg_classify(&ev.f));
+}
+
+static void wieg_keypad(WiegandDriver *wdp, const wieg_frame_t *f, uint8_t key) {
+  if(key == WIEG_KEY_ENTER) {
+    wieg_pin_end(wdp, true, f->time);
+  } else if(key == WIEG_KEY_CANCEL) {
+    wieg_pin_end(wdp, false, f->time);
+  } else {
+    if(wdp->pin_len < WIEG_PIN_MAX) {
+      wdp->pin[wdp->pin_len++] = '0' + key;
+    }
+    wdp->pin_time = f->time;
+  }
+}
+
+/* Hold a card for the PIN that may follow, ending an earlier entry */
+static void wieg_keypad_card(WiegandDriver *wdp, const wieg_frame_t *f) {
+  wieg_pin_end(wdp, false, f->time);
+  wdp->pin_card = *f;
+  wdp->pin_time = f->time;
+}
+
+/* End entries that have had no key for WIEG_PIN_TIMEOUT */
+static void wieg_keypad_timeouts(void) {
+  WiegandDriver *wdp;
+  uint8_t i;
+
+  for(i=0; i<WIEG_NUM_READERS; i++) {
+    wdp = &WIEGD[i];
+    if(((wdp->pin_card.n != 0) || (wdp->pin_len != 0))
+       && ((systime_t)(chVTGetSystemTime() - wdp->pin_time) >= WIEG_PIN_TIMEOUT)) {
+      wieg_pin_end(wdp, false, wdp->pin_time);
+    }
+  }
+}
+
+/*===========================================================================
+ * Receive thread.
+ *===========================================================================*/
+
+#if WIEG_USE_PROXY
+static void wieg_proxy_forward(const wieg_frame_t *f, WiegandDriver *wdp, const wieg_format_t *fmt);
+#endif
+
+/*
+ * A frame has been received: forward it (proxy), open the door if it is
+ * a listed card, then output it (MODE_KEYPAD: hold cards for a PIN, and
+ * collect keys).
+ */
+void wieg_process_message(const wieg_frame_t *f, WiegandDriver *wdp) {
+  wieg_counters_t *st = &wieg_stats.reader[wdp->index];
+  const wieg_format_t *fmt;
+  wieg_event_t ev;
+  int8_t key;
+
+  // check if we can decode in one of the formats
+  fmt = wieg_classify(f);
+  st->frames++;
+  if((fmt == NULL) && (wieg_format_for_length(f->n) != NULL)) {
+    st->parity++;
+  }
+  if(f->n >= WIEG_BUFFER_SIZE) {
+    st->overflows++;
+  }
+#if WIEG_USE_PROXY
+  wieg_proxy_forward(f, wdp, fmt);
+#endif /* WIEG_USE_PROXY */
+  if((print_mode & MODE_KEYPAD) && ((key = wieg_key(f)) >= 0)) {
+    wieg_keypad(wdp, f, key);
+    return;
+  }
+  /* only the lines' timing is learnt */
+  if(!(f->flags & WIEG_FRAME_INPUT)) {
+    wieg_frame_adapt(wdp, f, fmt);
+  }
+#if WIEG_USE_CARDDB
+  if(fmt != NULL) {
+    wieg_access(f, fmt);
+  }
+#endif /* WIEG_USE_CARDDB */
+  if((print_mode & MODE_KEYPAD) && (fmt != NULL)) {
+    wieg_keypad_card(wdp, f);
+    return;
+  }
+  ev.f = *f;
+  ev.reader = wdp->index;
+  ev.pin_len = 0;
+  wieg_event_out(&ev, fmt);
+}
+
+static void wieg_note_latency(systime_t last_pulse) {
+  systime_t latency = chVTGetSystemTime() - last_pulse;
+  wieg_latency_last = latency;
+  if(latency > wieg_latency_max) {
+    wieg_latency_max = latency;
+  }
+}
+
+/*
+ * Frame queue, consumer side (receive thread).
+ */
+static void wieg_queue_drain(WiegandDriver *wdp) {
+  wieg_queue_t *q = &wdp->queue;
+  while(q->tail != q->head) {
+    wieg_frame_t *f = &q->frames[q->tail & (WIEG_QUEUE_SIZE-1)];
+    wieg_note_latency(f->time);
+    wieg_process_message(f, wdp);
+    q->tail++;
+  }
+}
+
+/*
+ * A frame for a reader (index in WIEGD[]) from elsewhere, an OSDP
+ * reader: queued as if it had come in on the reader's lines, so it takes
+ * the same path, but for the end of frame timing which it does not
+ * train (WIEG_FRAME_INPUT). The receive thread, of a higher priority,
+ * runs right away. Returns false if the queue is full or a frame is
+ * coming in.
+ */
+bool wieg_input_frame(uint8_t reader, const wieg_frame_t *f) {
+  wieg_queue_t *q = &WIEGD[reader].queue;
+  bool ok = false;
+
+  osalSysLock();
+  if(!q->receiving && ((uint8_t)(q->head - q->tail) < WIEG_QUEUE_SIZE)) {
+    q->frames[q->head & (WIEG_QUEUE_SIZE-1)] = *f;
+    q->frames[q->head & (WIEG_QUEUE_SIZE-1)].flags = WIEG_FRAME_INPUT;
+    q->head++;
+    chEvtSignalI(wieg_recv_tp, EVENT_MASK(reader));
+    chSchRescheduleS();
+    ok = true;
+  }
+  osalSysUnlock();
+  return ok;
+}
+
+/*
+ * Drain all completed frames of the signalled readers, then go on with
+ * keypad timeouts and the event log replay (also woken up every
+ * WIEG_LOG_REPLAY_INTERVAL).
+ */
+static void wieg_recv_events(eventmask_t events) {
+  uint8_t i;
+  for(i=0; i<WIEG_NUM_READERS; i++) {
+    if(events & EVENT_MASK(i)) {
+      wieg_queue_drain(&WIEGD[i]);
+    }
+  }
+  wieg_keypad_timeouts();
+  wieg_log_replay();
+  wieg_log_seq_ahead();
+}
+
+static THD_WORKING_AREA(waWiegThr, 320);
+static THD_FUNCTION(WiegThr, arg) {
+  (void)arg;
+  chRegSetThreadName("wieg_recv");
+
+  while(true) {
+    // finished reading
+    wieg_recv_events(chEvtWaitAnyTimeout(ALL_EVENTS, WIEG_LOG_REPLAY_INTERVAL));
+  }
+}
+#endif /* WIEG_SHOULD_RECEIVE */
+
+/*===========================================================================
+ * Send.
+ *===========================================================================*/
+
+/*
+ * Wiegand write, driven from the WIEG_TX_GPTD one-shot callback:
+ * PULSE (line low) -> PAUSE -> ... -> last PULSE -> GAP -> next frame.
+ * The timer is shared, so frames to different readers are sent one
+ * after the other. Only the sending reader's channels are disabled,
+ * the other readers keep receiving.
+ */
+typedef enum {
+  WIEG_TX_IDLE,
+  WIEG_TX_PULSE_STATE,
+  WIEG_TX_PAUSE_STATE,
+  WIEG_TX_GAP_STATE
+} wieg_tx_state_t;
+
+typedef struct {
+  WiegandDriver *wdp;
+  wieg_frame_t frame;
+  uint32_t period;     /* see wieg_send_async_period() */
+  wiegtxcb_t cb;
+  void *arg;
+} wieg_tx_t;
+
+static wieg_tx_t wieg_tx_queue[WIEG_TX_QUEUE_SIZE];
+static volatile uint8_t wieg_tx_head = 0;
+static volatile uint8_t wieg_tx_tail = 0;
+static volatile wieg_tx_state_t wieg_tx_state = WIEG_TX_IDLE;
+static uint8_t wieg_tx_bit;
+static uint8_t wieg_tx_level;
+static systime_t wieg_tx_start;    /* first bit of the frame being sent */
+static uint32_t wieg_tx_gap_left;  /* GPT ticks of the gap still to go */
+
+static void wieg_tx_gpt_cb(GPTDriver *gptp);
+
+static const GPTConfig wieg_tx_gptcfg = {
+  WIEG_TX_GPT_FREQ,
+  wieg_tx_gpt_cb,
+  0,
+  0
+};
+
+/* Pull the line for the current bit low, system locked */
+static void wieg_tx_pulse_start(void) {
+  const wieg_tx_t *tx = &wieg_tx_queue[wieg_tx_tail & (WIEG_TX_QUEUE_SIZE-1)];
+  const WiegandConfig *cfg = tx->wdp->config;
+  wieg_tx_level = wieg_get_bit(&tx->frame, wieg_tx_bit);
+  if(wieg_tx_level == 0) {
+    palClearPad(cfg->dat0_gpio, cfg->dat0_pin);
+  } else {
+    palClearPad(cfg->dat1_gpio, cfg->dat1_pin);
+  }
+  wieg_tx_state = WIEG_TX_PULSE_STATE;
+  gptStartOneShotI(&WIEG_TX_GPTD, WIEG_TX_PULSE);
+}
+
+/* Start sending the frame at the tail of the queue, system locked */
+static void wieg_tx_frame_start(void) {
+  const WiegandConfig *cfg = wieg_tx_queue[wieg_tx_tail & (WIEG_TX_QUEUE_SIZE-1)].wdp->config;
+#if WIEG_SHOULD_RECEIVE
+  extChannelDisableI(&EXTD1, cfg->dat0_channel);
+  extChannelDisableI(&EXTD1, cfg->dat1_channel);
+#endif /* WIEG_SHOULD_RECEIVE */
+  palSetPad(cfg->dat0_gpio, cfg->dat0_pin);
+  palSetPad(cfg->dat1_gpio, cfg->dat1_pin);
+  palSetPadMode(cfg->dat0_gpio, cfg->dat0_pin, cfg->pins_output_mode);
+  palSetPadMode(cfg->dat1_gpio, cfg->dat1_pin, cfg->pins_output_mode);
+  wieg_tx_bit = 0;
+  wieg_tx_pulse_start();
+  wieg_tx_start = chVTGetSystemTimeX();
+}
+
+/* Next part of the gap, the GPT counter may be only 16 bits wide */
+static void wieg_tx_gap_next(void) {
+  uint32_t t = (wieg_tx_gap_left > WIEG_TX_GAP_CHUNK) ? WIEG_TX_GAP_CHUNK : wieg_tx_gap_left;
+  wieg_tx_gap_left -= t;
+  gptStartOneShotI(&WIEG_TX_GPTD, t);
+}
+
+/* Gap after the frame being sent, at its last pulse */
+static uint32_t wieg_tx_gap(const wieg_tx_t *tx) {
+  uint32_t elapsed;
+  if(tx->period == 0)
+    return WIEG_TX_FRAME_GAP;
+  elapsed = WIEG_ST2US(chVTGetSystemTimeX() - wieg_tx_start);
+  return (tx->period > elapsed + WIEG_TX_GAP_MIN) ? tx->period - elapsed : WIEG_TX_GAP_MIN;
+}
+
+static void wieg_tx_gpt_cb(GPTDriver *gptp) {
+  wieg_tx_t *tx;
+  const WiegandConfig *cfg;
+  (void)gptp;
+
+  osalSysLockFromISR();
+  tx = &wieg_tx_queue[wieg_tx_tail & (WIEG_TX_QUEUE_SIZE-1)];
+  cfg = tx->wdp->config;
+  switch(wieg_tx_state) {
+    case WIEG_TX_PULSE_STATE:
+      if(wieg_tx_level == 0) {
+        palSetPad(cfg->dat0_gpio, cfg->dat0_pin);
+      } else {
+        palSetPad(cfg->dat1_gpio, cfg->dat1_pin);
+      }
+      if(++wieg_tx_bit < tx->frame.n) {
+        wieg_tx_state = WIEG_TX_PAUSE_STATE;
+        gptStartOneShotI(&WIEG_TX_GPTD, WIEG_TX_PAUSE);
+      } else {
+        palSetPadMode(cfg->dat0_gpio, cfg->dat0_pin, cfg->pins_mode);
+        palSetPadMode(cfg->dat1_gpio, cfg->dat1_pin, cfg->pins_mode);
+        wieg_tx_state = WIEG_TX_GAP_STATE;
+        wieg_tx_gap_left = wieg_tx_gap(tx);
+        wieg_tx_gap_next();
+      }
+      break;
+    case WIEG_TX_PAUSE_STATE:
+      wieg_tx_pulse_start();
+      break;
+    case WIEG_TX_GAP_STATE:
+      if(wieg_tx_gap_left > 0) {
+        wieg_tx_gap_next();
+        break;
+      }
+#if WIEG_SHOULD_RECEIVE
+      extChannelEnableI(&EXTD1, cfg->dat0_channel);
+      extChannelEnableI(&EXTD1, cfg->dat1_channel);
+#endif /* WIEG_SHOULD_RECEIVE */
+      if(tx->cb != NULL) {
+        tx->cb(tx->arg);
+      }
+      wieg_tx_tail++;
+      if(wieg_tx_tail != wieg_tx_head) {
+        wieg_tx_frame_start();
+      } else {
+        wieg_tx_state = WIEG_TX_IDLE;
+      }
+      break;
+    default:
+      break;
+  }
+  osalSysUnlockFromISR();
+}
+
+/*
+ * Queue a frame for sending on reader wdp's lines and return
+ * immediately. cb (may be NULL) is called once the frame and the
+ * following gap have been sent. The next frame starts period us after
+ * this one did, or at least WIEG_TX_GAP_MIN after its end; with period
+ * 0 the gap is WIEG_TX_FRAME_GAP.
+ * Returns false if the transmit queue is full or the frame is empty.
+ */
+bool wieg_send_async_period(WiegandDriver *wdp, const wieg_frame_t *f, uint32_t period, wiegtxcb_t cb, void *arg) {
+  wieg_tx_t *tx;
+
+  if(f->n == 0)
+    return false;
+  osalSysLock();
+  if((uint8_t)(wieg_tx_head - wieg_tx_tail) >= WIEG_TX_QUEUE_SIZE) {
+    osalSysUnlock();
+    return false;
+  }
+  tx = &wieg_tx_queue[wieg_tx_head & (WIEG_TX_QUEUE_SIZE-1)];
+  tx->wdp = wdp;
+  tx->frame = *f;
+  tx->period = period;
+  tx->cb = cb;
+  tx->arg = arg;
+  wieg_tx_head++;
+  if(wieg_tx_state == WIEG_TX_IDLE) {
+    wieg_tx_frame_start();
+  }
+  osalSysUnlock();
+  return true;
+}
+
+bool wieg_send_async(WiegandDriver *wdp, const wieg_frame_t *f, wiegtxcb_t cb, void *arg) {
+  return wieg_send_async_period(wdp, f, 0, cb, arg);
+}
+
+static void wieg_send_done(void *arg) {
+  chBSemSignalI((binary_semaphore_t *)arg);
+}
+
+/*
+ * Blocking Wiegand write, returns once the frame has been sent.
+ */
+void wieg_send(WiegandDriver *wdp, const wieg_frame_t *f) {
+  binary_semaphore_t done;
+
+  if(f->n == 0)
+    return;
+  chBSemObjectInit(&done, true);
+  while(!wieg_send_async(wdp, f, wieg_send_done, &done)) {
+    chThdSleep(WIEG_PAUSE_WIDTH_MAX);
+  }
+  chBSemWait(&done);
+}
+
+/*===========================================================================
+ * Load generator.
+ *===========================================================================*/
+
+static uint32_t wieg_gen_rand(wieg_gen_t *gen) {
+  /* xorshift32 */
+  gen->seed ^= gen->seed << 13;
+  gen->seed ^= gen->seed >> 17;
+  gen->seed ^= gen->seed << 5;
+  return gen->seed;
+}
+
+static void wieg_gen_frame(wieg_gen_t *gen, wieg_frame_t *f) {
+  const wieg_format_t *fmt = gen->format;
+  uint32_t card = gen->random ? wieg_gen_rand(gen) : gen->card++;
+
+  if(fmt->card_len < 32) {
+    card &= (1UL << fmt->card_len) - 1;
+  }
+  wieg_encode(f, fmt, gen->facility, card);
+  if((gen->err_pct != 0) && wieg_format_has_parity(fmt) && ((wieg_gen_rand(gen) % 100) < gen->err_pct)) {
+    /* the first bit is a parity bit in all formats that have parity */
+    f->bits[0] ^= 0x80000000UL;
+    gen->errors++;
+  }
+}
+
+/* Transmit callback of a generator frame, system locked */
+static void wieg_gen_sent(void *arg) {
+  wieg_gen_t *gen = arg;
+  uint32_t t, dev;
+
+  if(gen->sent > 0) {
+    t = WIEG_ST2US(wieg_tx_start - gen->last);
+    dev = (t > gen->period) ? t - gen->period : gen->period - t;
+    gen->dev_sum += dev;
+    if(dev > gen->dev_max) {
+      gen->dev_max = dev;
+    }
+  } else {
+    gen->first = wieg_tx_start;
+  }
+  gen->last = wieg_tx_start;
+  gen->sent++;
+}
+
+/*
+ * Queue the next generator frame on reader wdp, if there is room in
+ * the transmit queue and frames left to send. Returns true if one was
+ * queued. The caller polls this until gen->queued reaches gen->count,
+ * then waits for gen->sent to catch up; gen has to stay around until
+ * then.
+ */
+bool wieg_gen_step(WiegandDriver *wdp, wieg_gen_t *gen) {
+  if(gen->queued >= gen->count)
+    return false;
+  if(!gen->pending) {
+    wieg_gen_frame(gen, &gen->frame);
+    gen->pending = true;
+  }
+  if(!wieg_send_async_period(wdp, &gen->frame, gen->period, wieg_gen_sent, gen))
+    return false;
+  gen->pending = false;
+  gen->queued++;
+  return true;
+}
+
+#if (WIEG_SHOULD_RECEIVE) && WIEG_USE_PROXY
+/*===========================================================================
+ * Proxy.
+ *===========================================================================*/
+
+wieg_proxy_t wieg_proxy = {0, NULL, false, 0, 0, 0, 0, 0, 0, 0, 0};
+
+/* Transmit callback of a forwarded frame (arg: its last input bit), system locked */
+static void wieg_proxy_sent(void *arg) {
+  systime_t delay = wieg_tx_start - (systime_t)(uintptr_t)arg;
+  wieg_proxy.delay_last = delay;
+  if(delay > wieg_proxy.delay_max) {
+    wieg_proxy.delay_max = delay;
+  }
+}
+
+/*
+ * Forward a frame from one of wieg_proxy.readers to the other reader's
+ * lines: decoded cards (rewritten if asked to) and keypad keys, nothing
+ * else. Called ahead of everything else in the receive thread; the
+ * transmitter only stops the receiving on the lines it drives.
+ */
+static void wieg_proxy_forward(const wieg_frame_t *f, WiegandDriver *wdp, const wieg_format_t *fmt) {
+  const wieg_format_t *out_fmt;
+  wieg_frame_t out;
+  uint64_t value;
+  uint32_t facility, card;
+
+  if(!(wieg_proxy.readers & (1U << wdp->index)))
+    return;
+  if(fmt == NULL) {
+    if(wieg_key(f) < 0) {
+      wieg_proxy.invalid++;
+      return;
+    }
+    out = *f;
+  } else if((wieg_proxy.format == NULL) && !wieg_proxy.fc_remap) {
+    out = *f;
+  } else {
+    value = wieg_frame_value(f);
+    facility = (uint32_t)wieg_field(value, f->n, fmt->facility_start, fmt->facility_len);
+    card = (uint32_t)wieg_field(value, f->n, fmt->card_start, fmt->card_len);
+    if(wieg_proxy.fc_remap && (facility == wieg_proxy.fc_from)) {
+      facility = wieg_proxy.fc_to;
+    }
+    out_fmt = (wieg_proxy.format != NULL) ? wieg_proxy.format : fmt;
+    if(!wieg_encode(&out, out_fmt, facility, card)) {
+      wieg_proxy.unfit++;
+      return;
+    }
+  }
+  if(wieg_send_async(&WIEGD[(wdp->index + 1) % WIEG_NUM_READERS], &out, wieg_proxy_sent, (void *)(uintptr_t)f->time)) {
+    wieg_proxy.forwarded++;
+  } else {
+    wieg_proxy.dropped++;
+  }
+}
+#endif /* WIEG_SHOULD_RECEIVE && WIEG_USE_PROXY */
+
+/*===========================================================================
+ * Init code.
+ *===========================================================================*/
+
+void wieg_init(void) {
+  WiegandDriver *wdp;
+  uint8_t i;
+  // iqObjectInit(&wiegand_input_queue, wiegand_input_queue_buffer, sizeof(wiegand_input_queue_buffer), wiegand_input_queue_inotify, NULL);
+  for(i=0; i<WIEG_NUM_READERS; i++) {
+    wdp = &WIEGD[i];
+    wdp->config = &wieg_configs[i];
+    wdp->index = i;
+    wdp->frame_gap = WIEG_FRAME_GAP;
+    palSetPadMode(wdp->config->dat0_gpio, wdp->config->dat0_pin, wdp->config->pins_mode);
+    palSetPadMode(wdp->config->dat1_gpio, wdp->config->dat1_pin, wdp->config->pins_mode);
+#if (WIEG_SHOULD_RECEIVE)
+    chVTObjectInit(&wdp->vt);
+    extcfg.channels[wdp->config->dat0_channel] = wdp->config->dat0_ext;
+    extcfg.channels[wdp->config->dat0_channel].cb = wieg_extcb;
+    extcfg.channels[wdp->config->dat1_channel] = wdp->config->dat1_ext;
+    extcfg.channels[wdp->config->dat1_channel].cb = wieg_extcb;
+    wieg_ext_drivers[wdp->config->dat0_channel] = wdp;
+    wieg_ext_drivers[wdp->config->dat1_channel] = wdp;
+#endif /* WIEG_SHOULD_RECEIVE */
+  }
+  cfg_init();
+  print_mode = read_print_mode();
+#if (WIEG_SHOULD_RECEIVE)
+  /* kept over a soft reset, garbage at power up */
+  if(wieg_stats.magic != WIEG_STATS_MAGIC) {
+    wieg_stats_clear();
+  }
+  wieg_stats.starts++;
+#endif /* WIEG_SHOULD_RECEIVE */
+#if (WIEG_SHOULD_RECEIVE)
+  wieg_log_init();
+#endif
+#if WIEG_USE_CARDDB
+  carddb_init();
+  palClearPad(WIEG_RELAY_GPIO, WIEG_RELAY_PIN);
+  palSetPadMode(WIEG_RELAY_GPIO, WIEG_RELAY_PIN, WIEG_RELAY_MODE);
+  chVTObjectInit(&wieg_relay_vt);
+#endif /* WIEG_USE_CARDDB */
+  gptStart(&WIEG_TX_GPTD, &wieg_tx_gptcfg);
+#if (WIEG_SHOULD_RECEIVE)
+  wieg_recv_tp = chThdCreateStatic(waWiegThr, sizeof(waWiegThr), NORMALPRIO+3, WiegThr, NULL);
+  extStart(&EXTD1, &extcfg);
+#endif /* WIEG_SHOULD_RECEIVE */
+}
+
+/*===========================================================================
+ * Frame decoding.
+ *===========================================================================*/
+
+/*
+ * Frame bit access. Fields are read with shifts and masks from the
+ * packed words, so none of this loops over individual bits.
+ */
+uint8_t wieg_get_bit(const wieg_frame_t *f, uint8_t i) {
+  return (f->bits[i >> 5] >> (31 - (i & 31))) & 1;
+}
+
+/* len bits starting at bit start, first bit ending up as the MSB; len <= 32 */
+uint32_t wieg_get_bits(const wieg_frame_t *f, uint8_t start, uint8_t len) {
+  uint8_t w = start >> 5;
+  uint8_t o = start & 31;
+  uint64_t v;
+  if(len == 0)
+    return 0;
+  v = (uint64_t)f->bits[w] << 32;
+  if(o + len > 32)
+    v |= f->bits[w+1];
+  return (uint32_t)((v << o) >> (64 - len));
+}
+
+/* Cortex-M0 has no popcount instruction */
+static inline uint8_t wieg_popcount(uint32_t v) {
+  v = v - ((v >> 1) & 0x55555555UL);
+  v = (v & 0x33333333UL) + ((v >> 2) & 0x33333333UL);
+  v = (v + (v >> 4)) & 0x0F0F0F0FUL;
+  return (uint8_t)((v * 0x01010101UL) >> 24);
+}
+
+static inline uint8_t wieg_popcount64(uint64_t v) {
+  return wieg_popcount((uint32_t)v) + wieg_popcount((uint32_t)(v >> 32));
+}
+
+/* Whole frame as a number, first bit as the MSB; n <= 64 */
+uint64_t wieg_frame_value(const wieg_frame_t *f) {
+  if(f->n <= 32)
+    return wieg_get_bits(f, 0, f->n);
+  return ((uint64_t)f->bits[0] << (f->n - 32)) | wieg_get_bits(f, 32, f->n - 32);
+}
+
+/* len bits starting at frame bit start, out of an n-bit frame value */
+uint64_t wieg_field(uint64_t value, uint8_t n, uint8_t start, uint8_t len) {
+  value >>= n - start - len;
+  if(len < 64)
+    value &= ((uint64_t)1 << len) - 1;
+  return value;
+}
+
+/*===========================================================================
+ * Format table.
+ *===========================================================================*/
+
+enum {
+#define WIEG_FORMAT_ID(id, ...) id,
+  WIEG_FORMATS(WIEG_FORMAT_ID)
+#undef WIEG_FORMAT_ID
+  WIEG_FMT_COUNT
+};
+
+static const wieg_format_t wieg_formats[WIEG_FMT_COUNT] = {
+#define WIEG_FORMAT_DESC(id, name, len, mode, p1, p2, p3, fs, fl, cs, cl, vs, vl) \
+  [id] = {name, len, mode, {p1, p2, p3}, fs, fl, cs, cl, vs, vl},
+  WIEG_FORMATS(WIEG_FORMAT_DESC)
+#undef WIEG_FORMAT_DESC
+};
+
+/* format index + 1 for each bit length, 0 if none */
+static const uint8_t wieg_format_by_length[WIEG_FORMAT_MAX_LENGTH+1] = {
+#define WIEG_FORMAT_LEN(id, name, len, ...) [len] = id + 1,
+  WIEG_FORMATS(WIEG_FORMAT_LEN)
+#undef WIEG_FORMAT_LEN
+};
+
+/* Index of a format in WIEG_FORMATS */
+uint8_t wieg_format_id(const wieg_format_t *fmt) {
+  return (uint8_t)(fmt - wieg_formats);
+}
+
+/*
+ * Find the format for a frame: only the format registered for the
+ * frame's bit length is checked. Returns NULL on unknown length or
+ * parity failure.
+ */
+const wieg_format_t *wieg_classify(const wieg_frame_t *f) {
+  const wieg_format_t *fmt;
+  uint64_t value;
+  uint8_t i;
+
+  fmt = wieg_format_for_length(f->n);
+  if(fmt == NULL)
+    return NULL;
+  value = wieg_frame_value(f);
+  for(i=0; i<WIEG_MAX_PARITY; i++) {
+    if((fmt->parity[i].mask != 0)
+      && ((wieg_popcount64(value & fmt->parity[i].mask) & 1) != fmt->parity[i].odd)) {
+      return NULL;
+    }
+  }
+  return fmt;
+}
+
+/* Format of a frame length, NULL if there is none */
+const wieg_format_t *wieg_format_for_length(uint8_t n) {
+  if((n > WIEG_FORMAT_MAX_LENGTH) || (wieg_format_by_length[n] == 0))
+    return NULL;
+  return &wieg_formats[wieg_format_by_length[n] - 1];
+}
+
+/* Format by name ("26", ...), NULL if there is none */
+const wieg_format_t *wieg_format_find(const char *name) {
+  uint8_t i;
+  for(i=0; i<WIEG_FMT_COUNT; i++) {
+    if(!strcmp(wieg_formats[i].name, name))
+      return &wieg_formats[i];
+  }
+  return NULL;
+}
+
+/* True if frames of fmt carry a parity bit (the 56-bit format does not) */
+bool wieg_format_has_parity(const wieg_format_t *fmt) {
+  uint8_t i;
+  for(i=0; i<WIEG_MAX_PARITY; i++) {
+    if(fmt->parity[i].mask != 0)
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Build a frame of format fmt from a facility code and a card number,
+ * parity bits included: each one is the bit of its parity mask not
+ * covered by the fields or an earlier parity bit. Returns false if a
+ * field does not fit.
+ */
+bool wieg_encode(wieg_frame_t *f, const wieg_format_t *fmt, uint32_t facility, uint32_t card) {
+  uint8_t n = fmt->length;
+  uint64_t value, used, bit;
+  uint8_t i;
+
+  if(((fmt->facility_len < 32) && ((facility >> fmt->facility_len) != 0))
+     || ((fmt->card_len < 32) && ((card >> fmt->card_len) != 0)))
+    return false;
+  value = ((uint64_t)facility << (n - fmt->facility_start - fmt->facility_len))
+          | ((uint64_t)card << (n - fmt->card_start - fmt->card_len));
+  used = WIEG_RANGE(n, fmt->facility_start, fmt->facility_len) | WIEG_RANGE(n, fmt->card_start, fmt->card_len);
+  for(i=0; i<WIEG_MAX_PARITY; i++) {
+    if(fmt->parity[i].mask == 0)
+      continue;
+    bit = fmt->parity[i].mask & ~used;
+    bit &= -bit;
+    if((wieg_popcount64(value & fmt->parity[i].mask) & 1) != fmt->parity[i].odd)
+      value |= bit;
+    used |= bit;
+  }
+  f->n = n;
+  value <<= 64 - n;
+  f->bits[0] = (uint32_t)(value >> 32);
+  f->bits[1] = (uint32_t)value;
+  for(i=2; i<WIEG_BUFFER_WORDS; i++) {
+    f->bits[i] = 0;
+  }
+  return true;
 }
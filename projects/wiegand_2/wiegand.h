@@ -6,38 +6,302 @@
 #ifndef WIEGAND_H
 #define WIEGAND_H
 
+/*===========================================================================
+ * Types.
+ *===========================================================================*/
+
+/* Maximum number of bits in a frame; extra bits are dropped */
+#define WIEG_BUFFER_SIZE     128
+
+#if WIEG_BUFFER_SIZE > 255
+#error "WIEG_BUFFER_SIZE must fit in the uint8_t bit count"
+#endif
+
+#define WIEG_BUFFER_WORDS    ((WIEG_BUFFER_SIZE+31)/32)
+
+/*
+ * Received frame, bits packed MSB-first: bit i of the frame is
+ * bit (31 - i%32) of bits[i/32]. Bits past n are undefined.
+ */
+typedef struct {
+  uint32_t bits[WIEG_BUFFER_WORDS];
+  systime_t time;      /* time of the last bit */
+  uint8_t n;
+  uint8_t flags;       /* WIEG_FRAME_INPUT, set once queued */
+} wieg_frame_t;
+
+/* Not from the reader's lines (OSDP), see wieg_input_frame() */
+#define WIEG_FRAME_INPUT     0x01
+
+/* Longest PIN kept from a keypad, further digits are dropped */
+#define WIEG_PIN_MAX         8
+
+/* Completed frames buffered per reader (power of 2) */
+#define WIEG_QUEUE_SIZE      4
+
+/*
+ * Single-producer/single-consumer ring of frames. The edge callbacks
+ * fill frames[head] and the frame timer publishes it by advancing head;
+ * the receive thread consumes from tail. head and tail are free-running.
+ */
+typedef struct {
+  wieg_frame_t frames[WIEG_QUEUE_SIZE];
+  volatile uint8_t head;
+  volatile uint8_t tail;
+  volatile bool receiving;   /* a frame is being received */
+  volatile bool dropping;    /* ... but the ring was full at its start */
+  volatile uint16_t overruns;
+} wieg_queue_t;
+
+#define WIEG_MAX_PARITY 3
+
+/* Parity check: bits covered (incl. the parity bit) and expected parity */
+typedef struct {
+  uint64_t mask;
+  uint8_t odd;
+} wieg_parity_t;
+
+/* Card format descriptor, see wieg_formats.h */
+typedef struct {
+  const char *name;
+  uint8_t length;
+  uint8_t mode;
+  wieg_parity_t parity[WIEG_MAX_PARITY];
+  uint8_t facility_start;
+  uint8_t facility_len;
+  uint8_t card_start;
+  uint8_t card_len;
+  uint8_t value_start;
+  uint8_t value_len;
+} wieg_format_t;
+
+/*
+ * Per-reader signal statistics. Histogram bucket i counts durations
+ * in [2^i, 2^(i+1)) us, the first and last buckets are open-ended.
+ */
+#define WIEG_HIST_BUCKETS    16
+
+typedef struct {
+  uint16_t pulse[WIEG_HIST_BUCKETS];   /* pulse (line low) width */
+  uint16_t gap[WIEG_HIST_BUCKETS];     /* bit start to next bit start */
+  uint16_t glitches;                   /* edges rejected by the hold-off */
+  uint16_t filtered;                   /* ... by the filter stage (WIEG_USE_FILTER) */
+  uint16_t early;                      /* frames closed at a known length */
+  uint32_t isr_time;                   /* edge callback run time, system ticks ... */
+  uint32_t isr_edges;                  /* ... over this many edges */
+  systime_t isr_max;
+} wieg_sigstats_t;
+
+/*
+ * Per-reader frame counters, kept over a soft reset (see wieg_stats).
+ * Each has a single writer, the edge callback (overruns) or the receive
+ * thread (the others), so they are updated without locking.
+ */
+typedef struct {
+  uint32_t frames;                     /* frames received */
+  uint32_t parity;                     /* ... of a known length, but bad parity */
+  uint32_t overflows;                  /* ... that filled WIEG_BUFFER_SIZE, cut there */
+  uint32_t overruns;                   /* frames lost, the queue was full */
+  uint32_t dropped;                    /* outputs the TIME_IMMEDIATE writes did not take */
+} wieg_counters_t;
+
+#define WIEG_STATS_COUNTERS  (sizeof(wieg_counters_t) / sizeof(uint32_t))
+
+/*
+ * Transmit completion callback, called from ISR context with the
+ * system locked (only I-class functions may be used).
+ */
+typedef void (*wiegtxcb_t)(void *arg);
+
+/* Frames waiting to be transmitted (power of 2) */
+#define WIEG_TX_QUEUE_SIZE   4
+
+/*
+ * Reader configuration: the two data lines, their EXT channels and the
+ * EXT channel setup (its callback is filled in by wieg_init).
+ */
+typedef struct {
+  ioportid_t dat0_gpio;
+  uint8_t dat0_pin;
+  ioportid_t dat1_gpio;
+  uint8_t dat1_pin;
+  iomode_t pins_mode;
+  iomode_t pins_output_mode;
+  expchannel_t dat0_channel;
+  expchannel_t dat1_channel;
+  EXTChannelConfig dat0_ext;
+  EXTChannelConfig dat1_ext;
+  uint8_t label;       /* prefix of the printed frames */
+} WiegandConfig;
+
+/*
+ * Reader state. Instances are in WIEGD[], one per WIEG_READERS entry.
+ */
+typedef struct {
+  const WiegandConfig *config;
+  uint8_t index;       /* in WIEGD[], also the receive event number */
+  volatile systime_t last_pulse_time;
+  volatile systime_t prev_pulse_time;
+  volatile systime_t pulse_gap;    /* from the pulse before, counted once this one passes, 0: none */
+  volatile bool pulse_low;
+  volatile uint8_t pulse_bit;      /* line of the pulse in progress */
+  virtual_timer_t vt;  /* frame timer */
+  /* adaptive end of frame, see wieg_gap_learn() and wieg_frame_adapt() */
+  volatile uint32_t gap_mean;      /* bit to bit time, us << 4 */
+  volatile uint32_t gap_var;       /* its variance, us^2 */
+  volatile uint16_t gap_samples;
+  volatile systime_t frame_gap;    /* silence that ends a frame */
+  volatile uint8_t close_len;      /* end a frame that classifies at this length, 0: never */
+  uint8_t last_len;                /* length of the last decoded frame ... */
+  uint8_t stable;                  /* ... and how many in a row had it */
+  /* keypad entry in progress (MODE_KEYPAD), see wieg_keypad() */
+  wieg_frame_t pin_card;           /* card waiting for its PIN, n == 0: none */
+  systime_t pin_time;              /* last card or key */
+  uint8_t pin_len;
+  char pin[WIEG_PIN_MAX];
+  wieg_queue_t queue;
+  wieg_sigstats_t sigstats;
+} WiegandDriver;
+
+/*
+ * Load generator (shell "gen"): frames of one format sent every period
+ * us, see wieg_gen_step(). Set up the fields down to err_pct and zero
+ * the rest.
+ */
+typedef struct {
+  const wieg_format_t *format;
+  uint32_t count;
+  uint32_t period;                 /* us from one frame start to the next */
+  uint32_t facility;
+  uint32_t card;                   /* next card number ... */
+  uint32_t seed;                   /* ... or random ones (non-zero seed) */
+  bool random;
+  uint8_t err_pct;                 /* frames sent with a parity error, %, formats with parity only */
+  uint32_t queued;
+  uint32_t errors;                 /* parity errors injected */
+  bool pending;                    /* frame built but not queued yet */
+  wieg_frame_t frame;
+  volatile uint32_t sent;
+  volatile systime_t first;        /* first bit of the first frame sent */
+  volatile systime_t last;         /* ... of the last one */
+  volatile uint32_t dev_sum;       /* |frame start to frame start - period|, us */
+  volatile uint32_t dev_max;
+} wieg_gen_t;
+
+/*
+ * Proxy settings and counters (WIEG_USE_PROXY). Frames from the readers
+ * in 'readers' are sent out again on the other reader's lines.
+ */
+typedef struct {
+  uint8_t readers;                 /* bit i: forward from WIEGD[i] */
+  const wieg_format_t *format;     /* re-encode cards in this format, NULL: keep */
+  bool fc_remap;                   /* facility code fc_from becomes fc_to */
+  uint32_t fc_from;
+  uint32_t fc_to;
+  volatile uint16_t forwarded;
+  volatile uint16_t invalid;       /* neither a card nor a key */
+  volatile uint16_t unfit;         /* does not fit the output format */
+  volatile uint16_t dropped;       /* transmit queue full */
+  volatile systime_t delay_last;   /* last input bit -> first output bit */
+  volatile systime_t delay_max;
+} wieg_proxy_t;
+
 /*===========================================================================
  * Declarations.
  *===========================================================================*/
 
 void wieg_init(void);
-void wieg_send(uint8_t* buf, uint8_t n);
-bool wieg_is_26(uint8_t *buf, uint8_t n);
-uint32_t wieg_decode_26(uint8_t *buf);
-bool wieg_is_34(uint8_t *buf, uint8_t n);
-uint32_t wieg_decode_34(uint8_t *buf);
+bool wieg_send_async(WiegandDriver *wdp, const wieg_frame_t *f, wiegtxcb_t cb, void *arg);
+bool wieg_send_async_period(WiegandDriver *wdp, const wieg_frame_t *f, uint32_t period, wiegtxcb_t cb, void *arg);
+void wieg_send(WiegandDriver *wdp, const wieg_frame_t *f);
+uint8_t wieg_get_bit(const wieg_frame_t *f, uint8_t i);
+uint32_t wieg_get_bits(const wieg_frame_t *f, uint8_t start, uint8_t len);
+uint64_t wieg_frame_value(const wieg_frame_t *f);
+uint64_t wieg_field(uint64_t value, uint8_t n, uint8_t start, uint8_t len);
+const wieg_format_t *wieg_classify(const wieg_frame_t *f);
+uint8_t wieg_format_id(const wieg_format_t *fmt);
+const wieg_format_t *wieg_format_find(const char *name);
+const wieg_format_t *wieg_format_for_length(uint8_t n);
+bool wieg_format_has_parity(const wieg_format_t *fmt);
+bool wieg_encode(wieg_frame_t *f, const wieg_format_t *fmt, uint32_t facility, uint32_t card);
+uint16_t wieg_log_pending(void);
+bool wieg_input_frame(uint8_t reader, const wieg_frame_t *f);
+bool wieg_gen_step(WiegandDriver *wdp, wieg_gen_t *gen);
+void wieg_stats_clear(void);
+uint16_t wieg_stats_record(uint8_t *rec);
 
 uint16_t read_print_mode(void);
-void write_print_mode(uint16_t mode);
+bool write_print_mode(uint16_t mode);
 
 extern volatile uint8_t led_blink;
 
 extern volatile uint16_t print_mode;
 
+/* last bit -> start of processing, for the most recent and the worst frame */
+extern volatile systime_t wieg_latency_last;
+extern volatile systime_t wieg_latency_max;
+
+/* event log: frames logged while the host could not take them, replayed, lost */
+extern volatile uint16_t wieg_log_buffered;
+extern volatile uint16_t wieg_log_replayed;
+extern volatile uint16_t wieg_log_lost;
+
 #define MODE_SIGNATURE 0xBE00
 
 #define MODE_DEBUG (1<<0)
 #define MODE_ERR (1<<1)
 #define MODE_26  (1<<2)
 #define MODE_34  (1<<3)
+#define MODE_EXT (1<<4)
+#define MODE_BIN (1<<5)
+/* not an output mode: collect keypad presses into PINs (with the above) */
+#define MODE_KEYPAD (1<<6)
 
 #define MODE_DEFAULT MODE_DEBUG
 
 #if defined(F042)
-/* Address - beginning of the last 1k page (on 32kB MCUs) */
+/* Address - beginning of the last 1k page (on 32kB MCUs), where the
+ * mode was saved before the settings store */
 #define FLASH_ADDR 0x08007C00
+#define FLASH_PAGE_SIZE 1024
+/* Settings store (cfgstore.h): the page below the card database and
+ * the one at FLASH_ADDR; code has to stay below the first one (see
+ * ld/STM32F042x6_WIEG.ld) */
+#define CFG_PAGE_ADDRS 0x08006000, FLASH_ADDR
+/* Card database: two 2k banks (225 cards) and a 1k journal (63
+ * entries), starting 7 pages below FLASH_ADDR. A part with more flash
+ * sets larger banks, 9 bytes a card. */
+#define CARDDB_ADDR 0x08006400
+#define CARDDB_BANK_SIZE (2*FLASH_PAGE_SIZE)
+#define CARDDB_JOURNAL_SIZE FLASH_PAGE_SIZE
+#define CARDDB_SIZE (2*CARDDB_BANK_SIZE + CARDDB_JOURNAL_SIZE)
+/* Event log, the page between the card database and FLASH_ADDR */
+#define WIEG_LOG_ADDR 0x08007800
+#define WIEG_LOG_SIZE FLASH_PAGE_SIZE
+/* RAM kept over a soft reset: the ram1 region of ld/STM32F042x6_WIEG.ld,
+ * which the startup code neither clears nor initialises */
+#define WIEG_NOINIT __attribute__((section(".ram1")))
 #endif /* F042 */
 
+#if !defined(WIEG_NOINIT)
+#define WIEG_NOINIT
+#endif
+
+/* Check decoded cards against the card database and drive the relay */
+#if !defined(WIEG_USE_CARDDB)
+#if defined(CARDDB_ADDR)
+#define WIEG_USE_CARDDB TRUE
+#else
+#define WIEG_USE_CARDDB FALSE
+#endif
+#endif
+
+#if WIEG_USE_CARDDB
+/* access decisions since boot */
+extern volatile uint16_t wieg_access_granted;
+extern volatile uint16_t wieg_access_denied;
+#endif
+
 /*===========================================================================
  * Pin definitions.
  *===========================================================================*/
@@ -45,7 +309,7 @@ extern volatile uint16_t print_mode;
 #if defined(TEENSY30) || defined(TEENSY32) || defined(MCHCK) || defined(KL27Z)
 #define WIEG1_IN_DAT0_CHANNEL 0
 #define WIEG1_IN_DAT1_CHANNEL 1
-#define WIEG_HAS_2 FALSE
+#define WIEG_READERS(X) X(1, '-')
 #endif
 
 #if defined(TEENSY30) || defined(TEENSY32)
@@ -103,7 +367,6 @@ extern volatile uint16_t print_mode;
 #define WIEG1_PINS_MODE PAL_MODE_INPUT
 #define WIEG1_PINS_OUTPUT_MODE PAL_MODE_OUTPUT_OPENDRAIN
 
-#define WIEG_HAS_2 TRUE
 #define WIEG2_IN_DAT0_GPIO GPIOA
 #define WIEG2_IN_DAT0_PORT PORTA
 #define WIEG2_IN_DAT0_PIN 13
@@ -116,22 +379,213 @@ extern volatile uint16_t print_mode;
 #define WIEG2_IN_DAT1_CHANNEL 14
 #define WIEG2_PINS_MODE PAL_MODE_INPUT
 #define WIEG2_PINS_OUTPUT_MODE PAL_MODE_OUTPUT_OPENDRAIN
-// also need to edit extcfg (lines are channels)
+
+#define WIEG_READERS(X) X(1, '-') X(2, '+')
+#endif
+
+/*
+ * WIEG_READERS(X) lists the readers of a board as X(n, label); reader n
+ * uses the WIEGn_* pin definitions above. Adding a reader takes its pin
+ * definitions and an entry in the list.
+ */
+
+/* Door relay output, pulsed when a card is granted */
+#if defined(F042)
+#define WIEG_RELAY_GPIO GPIOA
+#define WIEG_RELAY_PIN GPIOA_PIN7
+#define WIEG_RELAY_MODE PAL_MODE_OUTPUT_PUSHPULL
+#endif
+
+/*
+ * OSDP line (WIEG_USE_OSDP, see osdp.h): USART2, whose DE output drives
+ * the RS-485 transceiver's DE and /RE, tied together. DE is raised one
+ * bit time before the first start bit and dropped one bit time after
+ * the last stop bit (DEAT, DEDT in 1/16 bit).
+ */
+#if defined(F042)
+#define OSDP_SD        SD2
+#define OSDP_TX_GPIO   GPIOA
+#define OSDP_TX_PIN    GPIOA_PIN2
+#define OSDP_RX_GPIO   GPIOA
+#define OSDP_RX_PIN    GPIOA_PIN3
+#define OSDP_DE_GPIO   GPIOA
+#define OSDP_DE_PIN    GPIOA_PIN1
+#define OSDP_PINS_MODE PAL_MODE_ALTERNATE(1)
+#define OSDP_SD_CR1    ((16U * USART_CR1_DEAT_0) | (16U * USART_CR1_DEDT_0))
+#define OSDP_SD_CR3    USART_CR3_DEM
+#endif
+
+/* Timer driving the transmitter, see WIEG_TX_GPT_FREQ */
+#if defined(F042)
+#define WIEG_TX_GPTD GPTD14
+#else
+#define WIEG_TX_GPTD GPTD1
+#endif
+
+enum {
+#define WIEG_READER_ID(n, label) WIEG_READER_##n,
+  WIEG_READERS(WIEG_READER_ID)
+#undef WIEG_READER_ID
+  WIEG_NUM_READERS
+};
+
+extern WiegandDriver WIEGD[WIEG_NUM_READERS];
+
+/* Proxy between two readers, see wieg_proxy_t */
+#if !defined(WIEG_USE_PROXY)
+#if defined(F042)
+#define WIEG_USE_PROXY TRUE
+#else
+#define WIEG_USE_PROXY FALSE
+#endif
+#endif
+
+#if WIEG_USE_PROXY
+extern wieg_proxy_t wieg_proxy;
+#endif
+
+/* OSDP readers on an RS-485 line, see osdp.h */
+#if !defined(WIEG_USE_OSDP)
+#if defined(OSDP_SD) && (WIEG_SHOULD_RECEIVE)
+#define WIEG_USE_OSDP TRUE
+#else
+#define WIEG_USE_OSDP FALSE
+#endif
+#endif
+
+/*
+ * Counters of all readers, in RAM that is not cleared at startup
+ * (WIEG_NOINIT). They are only cleared when 'magic' is wrong, at power
+ * up, or by the shell.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t starts;                 /* since the counters were cleared */
+  wieg_counters_t reader[WIEG_NUM_READERS];
+} wieg_stats_t;
+
+#define WIEG_STATS_MAGIC     0x57535431
+
+extern wieg_stats_t wieg_stats;
+
+/* Raw edge capture of one reader (shell "capture"), see WIEG_CAP_* */
+#if !defined(WIEG_USE_CAPTURE)
+#define WIEG_USE_CAPTURE TRUE
+#endif
+/* bytes of encoded edges kept, about 70 per 34-bit frame */
+#if !defined(WIEG_CAPTURE_SIZE)
+#define WIEG_CAPTURE_SIZE    512
+#endif
+
+#if (WIEG_SHOULD_RECEIVE) && WIEG_USE_CAPTURE
+bool wieg_capture_start(uint8_t reader, uint16_t frames);
+void wieg_capture_stop(void);
+bool wieg_capture_running(void);
+const uint8_t *wieg_capture_record(uint16_t *len);
 #endif
 
 /*===========================================================================
  * Protocol definitions.
  *===========================================================================*/
 
+/*
+ * Edges are timestamped with the system time, which runs at 1 MHz on
+ * F042 (see chconf.h); other targets only get tick resolution.
+ */
+#if CH_CFG_ST_FREQUENCY == 1000000
+#define WIEG_ST2US(n) ((uint32_t)(n))
+#define WIEG_US2ST(n) ((systime_t)(n))
+#else
+#define WIEG_ST2US(n) ((uint32_t)(((uint64_t)(n) * 1000000UL) / CH_CFG_ST_FREQUENCY))
+#define WIEG_US2ST(n) ((systime_t)(((uint64_t)(n) * CH_CFG_ST_FREQUENCY + 999999UL) / 1000000UL))
+#endif
+
+#define WIEG_PULSE_WIDTH_US  50
+#define WIEG_PAUSE_WIDTH_US  2000
+
 #define WIEG_PULSE_WIDTH_MIN (US2ST(20))
-#define WIEG_PULSE_WIDTH     (US2ST(50))
+#define WIEG_PULSE_WIDTH     (US2ST(WIEG_PULSE_WIDTH_US))
 #define WIEG_PULSE_WIDTH_MAX (US2ST(100))
 #define WIEG_PAUSE_WIDTH_MIN (US2ST(200))
-#define WIEG_PAUSE_WIDTH     (MS2ST(2))
+#define WIEG_PAUSE_WIDTH     (US2ST(WIEG_PAUSE_WIDTH_US))
 #define WIEG_PAUSE_WIDTH_MAX (MS2ST(20))
 #define WIEG_SAMPLE_WAIT     (US2ST(5))
 
-#define WIEG_BUFFER_SIZE     100
+/*
+ * Filter stage on top of the WIEG_PULSE_WIDTH_MIN hold-off: a falling
+ * edge only counts if the line is still low WIEG_SAMPLE_WAIT later and
+ * the other line is high, and a bit whose pulse ends before
+ * WIEG_GLITCH_WIDTH is taken back. The re-sample delay is a busy
+ * wait in the edge callback and needs the 1 MHz system time (F042);
+ * with a slower one the line is re-read right away.
+ */
+#if !defined(WIEG_USE_FILTER)
+#define WIEG_USE_FILTER TRUE
+#endif
+#define WIEG_GLITCH_WIDTH    (US2ST(10))
+/* Silence after the last bit that terminates a frame, at most */
+#define WIEG_FRAME_GAP       (WIEG_PAUSE_WIDTH_MAX)
+
+/*
+ * Adaptive end of frame. Each reader learns its bit to bit time (a
+ * running mean and variance over the last few gaps, 1/2^WIEG_GAP_SHIFT
+ * weight for the newest) and ends a frame after WIEG_GAP_FACTOR times
+ * mean + 2 standard deviations of silence, within WIEG_FRAME_GAP_MIN_US ..
+ * WIEG_FRAME_GAP. Until WIEG_GAP_MIN_SAMPLES gaps have been seen, and
+ * after a frame that does not decode, WIEG_FRAME_GAP is used; the gap is
+ * learnt as soon as that many have been seen, so only a first frame (or
+ * the first after a bad one) shorter than WIEG_GAP_MIN_SAMPLES + 1 bits
+ * waits WIEG_FRAME_GAP, which is then the worst proxy forwarding delay.
+ *
+ * Once a reader has sent WIEG_EARLY_CLOSE_FRAMES decodable frames of
+ * the same length in a row, a frame reaching that length with good
+ * parity ends with its last pulse. A longer frame from that reader would be cut
+ * (and its tail would reset this), so the reader has to be stable.
+ */
+#define WIEG_GAP_SHIFT           3
+#define WIEG_GAP_MIN_SAMPLES     16
+#define WIEG_GAP_FACTOR          3
+#define WIEG_FRAME_GAP_MIN_US    1000
+#define WIEG_EARLY_CLOSE_FRAMES  8
+
+/* Event log: frames kept in RAM (power of 2) before going to flash,
+ * frames replayed at a time, and how often the replay is retried */
+#define WIEG_LOG_RAM_SIZE    8
+#define WIEG_LOG_BATCH       8
+#define WIEG_LOG_REPLAY_INTERVAL (MS2ST(100))
+/* sequence numbers reserved in the settings store at a time, and so
+ * skipped at a power up */
+#define WIEG_LOG_SEQ_BLOCK   65536
+
+/*
+ * Keypad (MODE_KEYPAD). Key presses come as 4-bit frames (the key) or
+ * 8-bit ones (the key in the low nibble, its complement in the high
+ * one); keys 0-9 are digits, 10 is '*' and 11 is '#'. A decoded card is
+ * held until the PIN that follows is ended with WIEG_KEY_ENTER and then
+ * output with it as one event. WIEG_KEY_CANCEL, or no key for
+ * WIEG_PIN_TIMEOUT, outputs the card alone and drops the digits. A PIN
+ * entered without a card is output on its own. The relay still acts on
+ * the card alone; checking PINs is left to the host.
+ */
+#define WIEG_KEY_CANCEL      10
+#define WIEG_KEY_ENTER       11
+#define WIEG_PIN_TIMEOUT     (WIEG_US2ST(5000000UL))
+
+/* How long the relay is held for a granted card (CARDDB_EXTENDED: longer);
+ * MS2ST() overflows past about 4 s with the 1 MHz system time */
+#define WIEG_RELAY_TIME      (WIEG_US2ST(3000000UL))
+#define WIEG_RELAY_TIME_EXT  (WIEG_US2ST(10000000UL))
+
+/* Transmit timing, in WIEG_TX_GPT_FREQ ticks (1 us) */
+#define WIEG_TX_GPT_FREQ     1000000
+#define WIEG_TX_PULSE        (WIEG_PULSE_WIDTH_US)
+#define WIEG_TX_PAUSE        (WIEG_PAUSE_WIDTH_US - WIEG_PULSE_WIDTH_US)
+/* quiet time after a frame before the next one (or receiving) */
+#define WIEG_TX_FRAME_GAP    60000
+/* ... at least, with wieg_send_async_period(), above WIEG_FRAME_GAP */
+#define WIEG_TX_GAP_MIN      25000
+/* longest one-shot, the F042 timer is 16 bits */
+#define WIEG_TX_GAP_CHUNK    50000
 
 /*===========================================================================
  * Output definitions.
@@ -144,4 +598,75 @@ extern volatile uint16_t print_mode;
 #define phex32(chn, c) phex16(chn, (c>>16)); phex16(chn, (c&0xFFFF))
 #define pent(chn) chnWriteTimeout(chn, (const uint8_t *)"\r\n", 2, TIME_IMMEDIATE);
 
+/*
+ * Binary event record (MODE_BIN), sent with a single write for every
+ * frame. Multi-byte fields are little endian.
+ *
+ *  0     WIEG_REC_SYNC
+ *  1     record length, sync and CRC included
+ *  2     reader (index in WIEGD[]), | WIEG_REC_REPLAYED if from the event log,
+ *        | WIEG_REC_PIN if a PIN follows the raw bits
+ *  3     format (index in WIEG_FORMATS), WIEG_REC_NO_FORMAT if unknown
+ *  4     number of bits n
+ *  5-8   time of the last bit (system ticks, us on F042)
+ *  9-16  decoded value, 0 if unknown
+ *  17-20 sequence number
+ *  21-   raw bits, (n+7)/8 bytes, first bit in the MSB of the first byte
+ *        (none for a PIN without a card, n = 0)
+ *  then  with WIEG_REC_PIN: number of digits, then the digits in ASCII
+ *  last  CRC-16/CCITT-FALSE of bytes 1 .. before the CRC (2 bytes)
+ *
+ * See wieg_records.py for a host-side decoder.
+ */
+#define WIEG_REC_SYNC        0xA5
+#define WIEG_REC_NO_FORMAT   0xFF
+#define WIEG_REC_REPLAYED    0x80
+#define WIEG_REC_PIN         0x40
+#define WIEG_REC_READER      0x3F
+#define WIEG_REC_HEADER_SIZE 21
+#define WIEG_REC_MAX_SIZE    (WIEG_REC_HEADER_SIZE + WIEG_BUFFER_WORDS*4 + 1 + WIEG_PIN_MAX + 2)
+
+/*
+ * Edge capture record, sent once the capture is over:
+ *
+ *  0-3   WIEG_CAP_MAGIC
+ *  4     reader (index in WIEGD[])
+ *  5     WIEG_CAP_DAT0_LOW, WIEG_CAP_DAT1_LOW: line levels when the capture
+ *        started; WIEG_CAP_FULL if it stopped on a full buffer
+ *  6-7   frames ended during the capture
+ *  8-9   length of the edge data
+ *  10-13 start time (system ticks, us on F042)
+ *  14-   edge data
+ *  last  CRC-16/CCITT-FALSE of bytes 4 .. before the CRC (2 bytes)
+ *
+ * Each edge is a varint: the first byte holds the line (bit 0, 1: DAT1),
+ * its level after the edge (bit 1, 1: low) and 5 bits of v, each further
+ * byte 7 more bits, bit 7 set if another byte follows. v is d(i) -
+ * d(i-2) zigzag encoded (0, -1, 1, -2, ... -> 0, 1, 2, 3, ...), d(i)
+ * being the time in us from the edge before to edge i (from the start
+ * for the first edge, 0 before it). A regular reader alternates pulse
+ * and pause lengths, so most edges take a single byte.
+ *
+ * See wiegcap.py for a host-side decoder (VCD, or a wiegsim trace).
+ */
+#define WIEG_CAP_MAGIC       "WCAP"
+#define WIEG_CAP_DAT0_LOW    0x01
+#define WIEG_CAP_DAT1_LOW    0x02
+#define WIEG_CAP_FULL        0x80
+#define WIEG_CAP_HEADER_SIZE 14
+
+/*
+ * Counter record (shell "stats bin"):
+ *
+ *  0-3   WIEG_STATS_MAGIC_TEXT
+ *  4     number of readers
+ *  5     counters per reader (WIEG_STATS_COUNTERS)
+ *  6-9   starts since the counters were cleared
+ *  10-   the counters of each reader, in wieg_counters_t order, 4 bytes each
+ *  last  CRC-16/CCITT-FALSE of bytes 4 .. before the CRC (2 bytes)
+ */
+#define WIEG_STATS_MAGIC_TEXT "WSTA"
+#define WIEG_STATS_HEADER_SIZE 10
+#define WIEG_STATS_MAX_SIZE  (WIEG_STATS_HEADER_SIZE + WIEG_NUM_READERS*WIEG_STATS_COUNTERS*4 + 2)
+
 #endif /* WIEGAND_H */
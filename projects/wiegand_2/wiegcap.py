@@ -0,0 +1,161 @@
+#!/usr/bin/env python
+#
+# Capture the raw DAT0/DAT1 edges of a wiegand_2 reader ("capture"
+# command) and write them out as a VCD file (PulseView / sigrok-cli
+# import it, as does GTKWave) or as a wiegsim trace (wiegsim -t).
+#
+# Usage: wiegcap.py /dev/ttyACM0 <reader> <frames> <out>   (needs pyserial)
+#        wiegcap.py capture.bin <out>
+#
+# The output is VCD if its name ends in .vcd, a wiegsim trace otherwise.
+# See the capture record layout in wiegand.h.
+
+from __future__ import print_function
+
+import os
+import struct
+import sys
+import time
+
+MAGIC = b"WCAP"
+DAT0_LOW = 0x01
+DAT1_LOW = 0x02
+FULL = 0x80
+HEADER_SIZE = 14
+# VCD identifiers of DAT0 and DAT1
+VCD_IDS = "!\""
+
+def crc16(data, crc=0xFFFF):
+    for b in bytearray(data):
+        crc ^= b << 8
+        for _ in range(8):
+            if crc & 0x8000:
+                crc = ((crc << 1) ^ 0x1021) & 0xFFFF
+            else:
+                crc = (crc << 1) & 0xFFFF
+    return crc
+
+def find_record(buf):
+    """Return (record, complete) for the first capture record in buf,
+    (None, False) if there is none yet."""
+    start = buf.find(MAGIC)
+    if start < 0 or len(buf) < start + HEADER_SIZE:
+        return None, False
+    (length,) = struct.unpack("<H", bytes(buf[start + 8:start + 10]))
+    end = start + HEADER_SIZE + length + 2
+    if len(buf) < end:
+        return None, False
+    return buf[start:end], True
+
+def decode(rec):
+    """Return reader, flags, frames, start time and the edges as
+    (time, line, level) tuples, level 0 being low."""
+    reader, flags, frames, length, start = struct.unpack("<BBHHI", bytes(rec[4:HEADER_SIZE]))
+    (crc,) = struct.unpack("<H", bytes(rec[-2:]))
+    if crc16(rec[4:-2]) != crc:
+        raise ValueError("bad CRC")
+    data = bytearray(rec[HEADER_SIZE:HEADER_SIZE + length])
+    edges = []
+    t = start
+    d = [0, 0]
+    i = 0
+    while i < len(data):
+        b = data[i]
+        line = b & 1
+        level = 0 if b & 2 else 1
+        v = (b >> 2) & 0x1F
+        shift = 5
+        while b & 0x80:
+            i += 1
+            b = data[i]
+            v |= (b & 0x7F) << shift
+            shift += 7
+        i += 1
+        # zigzag, then relative to the time between the two edges before
+        v = (v >> 1) ^ -(v & 1)
+        dt = (d[1] + v) & 0xFFFFFFFF
+        d = [dt, d[0]]
+        t += dt
+        edges.append((t, line, level))
+    return reader, flags, frames, start, edges
+
+def write_vcd(path, reader, flags, start, edges):
+    with open(path, "w") as f:
+        f.write("$comment wiegand_2 reader %u $end\n" % (reader + 1))
+        f.write("$timescale 1 us $end\n")
+        f.write("$scope module reader%u $end\n" % (reader + 1))
+        f.write("$var wire 1 %s DAT0 $end\n" % VCD_IDS[0])
+        f.write("$var wire 1 %s DAT1 $end\n" % VCD_IDS[1])
+        f.write("$upscope $end\n$enddefinitions $end\n")
+        f.write("#0\n$dumpvars\n%u%s\n%u%s\n$end\n"
+                % (0 if flags & DAT0_LOW else 1, VCD_IDS[0], 0 if flags & DAT1_LOW else 1, VCD_IDS[1]))
+        last = None
+        for t, line, level in edges:
+            if t != last:
+                f.write("#%u\n" % (t - start))
+                last = t
+            f.write("%u%s\n" % (level, VCD_IDS[line]))
+
+def write_trace(path, reader, edges):
+    with open(path, "w") as f:
+        f.write("# <time us> <reader> <line> <level>, from wiegcap.py\n")
+        for t, line, level in edges:
+            f.write("%u %u %u %u\n" % (t, reader + 1, line, level))
+
+def capture(port_name, reader, frames):
+    import serial
+    port = serial.Serial(port_name, timeout=0.5)
+    port.write(b"\r\n")
+    time.sleep(0.2)
+    port.reset_input_buffer()
+    port.write(("capture %u %u\r\n" % (reader, frames)).encode("ascii"))
+    print("Waiting for %u frames on reader %u, Ctrl-C stops..." % (frames, reader))
+    buf = bytearray()
+    try:
+        while True:
+            buf += bytearray(port.read(64))
+            rec, complete = find_record(buf)
+            if complete:
+                break
+    except KeyboardInterrupt:
+        # any key ends the capture early, the record follows
+        port.write(b"\r")
+        deadline = time.time() + 2
+        while time.time() < deadline:
+            buf += bytearray(port.read(64))
+            rec, complete = find_record(buf)
+            if complete:
+                break
+    port.close()
+    return rec
+
+def main():
+    args = sys.argv[1:]
+    if len(args) == 2 and os.path.isfile(args[0]):
+        with open(args[0], "rb") as f:
+            rec, _ = find_record(bytearray(f.read()))
+    elif len(args) == 4:
+        rec = capture(args[0], int(args[1]), int(args[2]))
+    else:
+        print("Usage: %s <serial port> <reader> <frames> <out>" % sys.argv[0])
+        print("       %s <capture file> <out>" % sys.argv[0])
+        sys.exit(1)
+    if rec is None:
+        print("No capture record")
+        sys.exit(1)
+
+    try:
+        reader, flags, frames, start, edges = decode(rec)
+    except (ValueError, IndexError) as e:
+        print("Bad capture record: %s" % e)
+        sys.exit(1)
+    out = args[-1]
+    if out.endswith(".vcd"):
+        write_vcd(out, reader, flags, start, edges)
+    else:
+        write_trace(out, reader, edges)
+    print("Reader %u: %u edges, %u frames, %u bytes%s"
+          % (reader + 1, len(edges), frames, len(rec), " (buffer full)" if flags & FULL else ""))
+
+if __name__ == "__main__":
+    main()